@@ -0,0 +1,160 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "CSVWriter.h"
+#include "misc.h"
+#include <cerrno>
+#include <mutex>
+#include <set>
+
+CSVWriter::CSVWriter()
+    : m_file(NULL)
+    , m_flushed(0)
+{
+}
+
+CSVWriter::~CSVWriter()
+{
+    close();
+}
+
+FILE *CSVWriter::open(const std::string &folder, const std::string &path, bool &empty)
+{
+    empty = false;
+
+    if ((m_file != NULL) && (path == m_path))
+        return m_file;
+
+    close();
+    createPath(folder);
+
+    // The folder may have been removed since it was created
+    if ((m_file = fopen(path.c_str(), "a+")) == NULL)
+    {
+        createPath(folder, true);
+        if ((m_file = fopen(path.c_str(), "a+")) == NULL)
+            return NULL;
+    }
+
+    m_buffer.resize(CSV_BUFFER_SIZE);
+    setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+
+    fseek(m_file, 0, SEEK_END);
+    empty = (ftell(m_file) == 0);
+
+    m_path = path;
+    m_flushed = time(nullptr);
+
+    return m_file;
+}
+
+void CSVWriter::commit(unsigned int flushInterval)
+{
+    if (m_file == NULL)
+        return;
+
+    const time_t now = time(nullptr);
+    if ((flushInterval == 0) || (now - m_flushed >= (time_t)flushInterval) || (now < m_flushed))
+    {
+        if (fflush(m_file) != 0)
+        {
+            char msg[80 + MAX_PATH];
+            snprintf(msg, sizeof(msg), "Unable to write %s\n", m_path.c_str());
+            print_error(stdout, PROC_ERROR, msg);
+        }
+        m_flushed = now;
+    }
+}
+
+void CSVWriter::close()
+{
+    if (m_file != NULL)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+    m_path.clear();
+}
+
+void CSVWriter::createPath(const std::string &folder, bool force)
+{
+    static std::mutex mtx;
+    static std::set<std::string> created;
+
+    std::lock_guard<std::mutex> lock(mtx);
+
+    if (!force && (created.find(folder) != created.end()))
+        return;
+
+    // A folder that couldn't be created (yet) is tried again next time
+    const int rc = CreatePath(folder.c_str());
+    if ((rc == 0) || (rc == EEXIST))
+        created.insert(folder);
+    else
+        created.erase(folder);
+}
+
+int CSVWriter::update(const std::string &path, const std::string &data)
+{
+    std::string current;
+    FILE *csv = fopen(path.c_str(), "r");
+    if (csv != NULL)
+    {
+        char buf[8192];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), csv)) > 0)
+            current.append(buf, len);
+        fclose(csv);
+    }
+
+    if (current == data)
+        return 0;   // Nothing new
+
+    // Append only when the rows on disk are still valid, rewrite otherwise
+    size_t offset = 0;
+    const char *mode = "w";
+    if (!current.empty() && (current.size() < data.size()) && (data.compare(0, current.size(), current) == 0))
+    {
+        offset = current.size();
+        mode = "a";
+    }
+
+    if ((csv = fopen(path.c_str(), mode)) == NULL)
+        return -1;
+
+    const size_t len = data.size() - offset;
+    const bool ok = (fwrite(data.data() + offset, 1, len, csv) == len);
+
+    return (fclose(csv) == 0) && ok ? 0 : -1;
+}
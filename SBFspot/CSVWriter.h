@@ -0,0 +1,78 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include "osselect.h"
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#define CSV_BUFFER_SIZE 65536   // User-space buffer of an open CSV file
+
+// Append-only CSV file that stays open between exports
+// Data is collected in a large buffer and written when the buffer is full,
+// when the file rolls over to a new path (a new day) or after CSV_FlushInterval seconds
+class CSVWriter
+{
+public:
+    CSVWriter();
+    ~CSVWriter();
+
+    // Returns the open file for <path>, NULL when it can't be opened
+    // empty is true when the file has no data yet (header needed)
+    FILE *open(const std::string &folder, const std::string &path, bool &empty);
+
+    // End of an export
+    void commit(unsigned int flushInterval);
+    void close();
+
+    // CreatePath, only once for each folder unless forced
+    static void createPath(const std::string &folder, bool force = false);
+
+    // Brings the file at <path> up to date with <data>
+    // Only the new tail is appended when the file holds an unchanged part of <data>,
+    // the file is rewritten when older rows have changed. Returns -1 on error
+    static int update(const std::string &path, const std::string &data);
+
+private:
+    CSVWriter(const CSVWriter&) = delete;
+    CSVWriter& operator=(const CSVWriter&) = delete;
+
+    FILE *m_file;
+    std::string m_path;
+    std::vector<char> m_buffer;
+    time_t m_flushed;
+};
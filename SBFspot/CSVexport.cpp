@@ -33,10 +33,21 @@ DISCLAIMER:
 ************************************************************************************************/
 
 #include "CSVexport.h"
+#include "CSVWriter.h"
 #include "EventData.h"
 #include <algorithm> // std::max
 #include "mppt.h"
 
+// Spot and battery files of the day stay open, only used by the CSV export worker
+static CSVWriter spotCSV;
+static CSVWriter batteryCSV;
+
+static inline void putfield(FILE *csv, char delimiter, const char *value)
+{
+    putc(delimiter, csv);
+    fputs(value, csv);
+}
+
 //DecimalPoint To Text
 const std::string dp2txt(const char dp)
 {
@@ -117,9 +128,16 @@ size_t max_mppt(InverterData* const inverters[])
     return mppt_max;
 }
 
+static std::string CSVProperties(const Config *cfg)
+{
+    char props[256];
+    snprintf(props, sizeof(props), "sep=%c\nVersion CSV1|Tool SBFspot%s (%s)|Linebreaks %s|Delimiter %s|Decimalpoint %s|Precision %d\n\n", cfg->delimiter, cfg->prgVersion, OS, linebreak2txt().c_str(), delim2txt(cfg->delimiter).c_str(), dp2txt(cfg->decimalpoint).c_str() , cfg->precision);
+    return props;
+}
+
 int ExportProperties(FILE *csv, const Config *cfg)
 {
-    return fprintf(csv, "sep=%c\nVersion CSV1|Tool SBFspot%s (%s)|Linebreaks %s|Delimiter %s|Decimalpoint %s|Precision %d\n\n", cfg->delimiter, cfg->prgVersion, OS, linebreak2txt().c_str(), delim2txt(cfg->delimiter).c_str(), dp2txt(cfg->decimalpoint).c_str() , cfg->precision);
+    return fputs(CSVProperties(cfg).c_str(), csv);
 }
 
 int ExportMonthDataToCSV(const Config *cfg, InverterData* const inverters[])
@@ -133,53 +151,41 @@ int ExportMonthDataToCSV(const Config *cfg, InverterData* const inverters[])
         }
         else
         {
-            FILE *csv;
+            std::ostringstream csv;
 
             //Expand date specifiers in config::outputPath
             std::stringstream csvpath;
             csvpath << strftime_t(cfg->outputPath, inverters[0]->dayData[0].datetime);
-            CreatePath(csvpath.str().c_str());
+            CSVWriter::createPath(csvpath.str());
 
             csvpath << FOLDER_SEP << cfg->plantname << '-' << strfgmtime_t("%Y%m", inverters[0]->monthData[0].datetime) << ".csv";
 
-            if ((csv = fopen(csvpath.str().c_str(), "w+")) == NULL)
+            if (cfg->CSV_ExtendedHeader)
             {
-                if (!cfg->quiet)
-                {
-                    snprintf(msg, sizeof(msg), "Unable to open output file %s\n", csvpath.str().c_str());
-                    print_error(stdout, PROC_ERROR, msg);
-                }
-                return -1;
+                csv << CSVProperties(cfg);
+
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << inverters[inv]->DeviceName << cfg->delimiter << inverters[inv]->DeviceName;
+                csv << '\n';
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << inverters[inv]->DeviceType << cfg->delimiter << inverters[inv]->DeviceType;
+                csv << '\n';
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << inverters[inv]->Serial << cfg->delimiter << inverters[inv]->Serial;
+                csv << '\n';
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << "Total yield" << cfg->delimiter << "Day yield";
+                csv << '\n';
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << "Counter" << cfg->delimiter << "Analog";
+                csv << '\n';
             }
-            else
+            if (cfg->CSV_Header)
             {
-                if (cfg->CSV_ExtendedHeader)
-                {
-                    ExportProperties(csv, cfg);
-
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%c%s%c%s", cfg->delimiter, inverters[inv]->DeviceName.c_str(), cfg->delimiter, inverters[inv]->DeviceName.c_str());
-                    fputs("\n", csv);
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%c%s%c%s", cfg->delimiter, inverters[inv]->DeviceType.c_str(), cfg->delimiter, inverters[inv]->DeviceType.c_str());
-                    fputs("\n", csv);
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%c%lu%c%lu", cfg->delimiter, inverters[inv]->Serial, cfg->delimiter, inverters[inv]->Serial);
-                    fputs("\n", csv);
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%cTotal yield%cDay yield", cfg->delimiter, cfg->delimiter);
-                    fputs("\n", csv);
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%cCounter%cAnalog", cfg->delimiter, cfg->delimiter);
-                    fputs("\n", csv);
-                }
-                if (cfg->CSV_Header)
-                {
-                    fprintf(csv, "%s", DateTimeFormatToDMY(cfg->DateFormat).c_str());
-                    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                        fprintf(csv, "%ckWh%ckWh", cfg->delimiter, cfg->delimiter);
-                    fputs("\n", csv);
-                }
+                csv << DateTimeFormatToDMY(cfg->DateFormat);
+                for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+                    csv << cfg->delimiter << "kWh" << cfg->delimiter << "kWh";
+                csv << '\n';
             }
 
             char FormattedFloat[16];
@@ -193,16 +199,25 @@ int ExportMonthDataToCSV(const Config *cfg, InverterData* const inverters[])
 
                 if (datetime != 0)
                 {
-                    fprintf(csv, "%s", strfgmtime_t(cfg->DateFormat, datetime).c_str());
+                    csv << strfgmtime_t(cfg->DateFormat, datetime);
                     for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
                     {
-                        fprintf(csv, "%c%s", cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->monthData[idx].totalWh / 1000, 0, cfg->precision, cfg->decimalpoint));
-                        fprintf(csv, "%c%s", cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->monthData[idx].dayWh / 1000, 0, cfg->precision, cfg->decimalpoint));
+                        csv << cfg->delimiter << FormatDouble(FormattedFloat, (double)inverters[inv]->monthData[idx].totalWh / 1000, 0, cfg->precision, cfg->decimalpoint);
+                        csv << cfg->delimiter << FormatDouble(FormattedFloat, (double)inverters[inv]->monthData[idx].dayWh / 1000, 0, cfg->precision, cfg->decimalpoint);
                     }
-                    fputs("\n", csv);
+                    csv << '\n';
+                }
+            }
+
+            if (CSVWriter::update(csvpath.str(), csv.str()) != 0)
+            {
+                if (!cfg->quiet)
+                {
+                    snprintf(msg, sizeof(msg), "Unable to write output file %s\n", csvpath.str().c_str());
+                    print_error(stdout, PROC_ERROR, msg);
                 }
+                return -1;
             }
-            fclose(csv);
         }
     }
     return 0;
@@ -212,7 +227,7 @@ int ExportDayDataToCSV(const Config *cfg, InverterData* const inverters[])
 {
     char msg[80 + MAX_PATH];
 
-    FILE *csv;
+    std::ostringstream csv;
 
     //fix 1.3.1 for inverters with BT piggyback (missing interval data in the dark)
     //need to find first valid date in array
@@ -229,48 +244,36 @@ int ExportDayDataToCSV(const Config *cfg, InverterData* const inverters[])
     //Expand date specifiers in config::outputPath
     std::stringstream csvpath;
     csvpath << strftime_t(cfg->outputPath, date);
-    CreatePath(csvpath.str().c_str());
+    CSVWriter::createPath(csvpath.str());
 
     csvpath << FOLDER_SEP << cfg->plantname << "-" << strftime_t("%Y%m%d", date) << ".csv";
 
-    if ((csv = fopen(csvpath.str().c_str(), "w+")) == NULL)
+    if (cfg->CSV_ExtendedHeader)
     {
-        if (!cfg->quiet)
-        {
-            snprintf(msg, sizeof(msg), "Unable to open output file %s\n", csvpath.str().c_str());
-            print_error(stdout, PROC_ERROR, msg);
-        }
-        return -1;
+        csv << CSVProperties(cfg);
+
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << inverters[inv]->DeviceName << cfg->delimiter << inverters[inv]->DeviceName;
+        csv << '\n';
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << inverters[inv]->DeviceType << cfg->delimiter << inverters[inv]->DeviceType;
+        csv << '\n';
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << inverters[inv]->Serial << cfg->delimiter << inverters[inv]->Serial;
+        csv << '\n';
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << "Total yield" << cfg->delimiter << "Power";
+        csv << '\n';
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << "Counter" << cfg->delimiter << "Analog";
+        csv << '\n';
     }
-    else
+    if (cfg->CSV_Header)
     {
-        if (cfg->CSV_ExtendedHeader)
-        {
-            ExportProperties(csv, cfg);
-
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%c%s%c%s", cfg->delimiter, inverters[inv]->DeviceName.c_str(), cfg->delimiter, inverters[inv]->DeviceName.c_str());
-            fputs("\n", csv);
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%c%s%c%s", cfg->delimiter, inverters[inv]->DeviceType.c_str(), cfg->delimiter, inverters[inv]->DeviceType.c_str());
-            fputs("\n", csv);
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%c%lu%c%lu", cfg->delimiter, inverters[inv]->Serial, cfg->delimiter, inverters[inv]->Serial);
-            fputs("\n", csv);
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%cTotal yield%cPower", cfg->delimiter, cfg->delimiter);
-            fputs("\n", csv);
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%cCounter%cAnalog", cfg->delimiter, cfg->delimiter);
-            fputs("\n", csv);
-        }
-        if (cfg->CSV_Header)
-        {
-            fputs(DateTimeFormatToDMY(cfg->DateTimeFormat).c_str(), csv);
-            for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
-                fprintf(csv, "%ckWh%ckW", cfg->delimiter, cfg->delimiter);
-            fputs("\n", csv);
-        }
+        csv << DateTimeFormatToDMY(cfg->DateTimeFormat);
+        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            csv << cfg->delimiter << "kWh" << cfg->delimiter << "kW";
+        csv << '\n';
     }
 
     char FormattedFloat[16];
@@ -290,17 +293,26 @@ int ExportDayDataToCSV(const Config *cfg, InverterData* const inverters[])
         {
             if ((cfg->CSV_SaveZeroPower) || (totalPower > 0))
             {
-                fprintf(csv, "%s", strftime_t(cfg->DateTimeFormat, datetime).c_str());
+                csv << strftime_t(cfg->DateTimeFormat, datetime);
                 for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
                 {
-                    fprintf(csv, "%c%s", cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->dayData[dd].totalWh / 1000, 0, cfg->precision, cfg->decimalpoint));
-                    fprintf(csv, "%c%s", cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->dayData[dd].watt / 1000, 0, cfg->precision, cfg->decimalpoint));
+                    csv << cfg->delimiter << FormatDouble(FormattedFloat, (double)inverters[inv]->dayData[dd].totalWh / 1000, 0, cfg->precision, cfg->decimalpoint);
+                    csv << cfg->delimiter << FormatDouble(FormattedFloat, (double)inverters[inv]->dayData[dd].watt / 1000, 0, cfg->precision, cfg->decimalpoint);
                 }
-                fputs("\n", csv);
+                csv << '\n';
             }
         }
     }
-    fclose(csv);
+
+    if (CSVWriter::update(csvpath.str(), csv.str()) != 0)
+    {
+        if (!cfg->quiet)
+        {
+            snprintf(msg, sizeof(msg), "Unable to write output file %s\n", csvpath.str().c_str());
+            print_error(stdout, PROC_ERROR, msg);
+        }
+        return -1;
+    }
     return 0;
 }
 
@@ -445,13 +457,12 @@ int ExportSpotDataToCSV(const Config *cfg, InverterData* const inverters[])
     time_t spottime = cfg->SpotTimeSource ? time(nullptr) : inverters[0]->InverterDatetime;
 
     //Expand date specifiers in config::outputPath
+    const std::string csvfolder = strftime_t(cfg->outputPath, spottime);
     std::stringstream csvpath;
-    csvpath << strftime_t(cfg->outputPath, spottime);
-    CreatePath(csvpath.str().c_str());
+    csvpath << csvfolder << FOLDER_SEP << cfg->plantname << "-Spot-" << strftime_t("%Y%m%d", spottime) << ".csv";
 
-    csvpath << FOLDER_SEP << cfg->plantname << "-Spot-" << strftime_t("%Y%m%d", spottime) << ".csv";
-
-    if ((csv = fopen(csvpath.str().c_str(), "a+")) == NULL)
+    bool empty;
+    if ((csv = spotCSV.open(csvfolder, csvpath.str(), empty)) == NULL)
     {
         if (!cfg->quiet)
         {
@@ -465,13 +476,7 @@ int ExportSpotDataToCSV(const Config *cfg, InverterData* const inverters[])
         size_t maxmppt = max_mppt(inverters);   // Max mppt of plant
 
         //Write header when new file has been created
-#if defined(_WIN32)
-        if (filelength(fileno(csv)) == 0)
-#else
-        struct stat fStat;
-        stat(csvpath.str().c_str(), &fStat);
-        if (fStat.st_size == 0)
-#endif
+        if (empty)
         {
             if (cfg->SpotWebboxHeader)
                 WriteWebboxHeader(csv, cfg, inverters, maxmppt);
@@ -480,7 +485,6 @@ int ExportSpotDataToCSV(const Config *cfg, InverterData* const inverters[])
         }
 
         char FormattedFloat[32];
-        const char *strout = "%c%s";
 
         if (cfg->SpotWebboxHeader)
             fputs(strftime_t(cfg->DateTimeFormat, spottime).c_str(), csv);
@@ -492,8 +496,8 @@ int ExportSpotDataToCSV(const Config *cfg, InverterData* const inverters[])
                 if (!cfg->SpotWebboxHeader)
                 {
                     fputs(strftime_t(cfg->DateTimeFormat, spottime).c_str(), csv);
-                    fprintf(csv, strout, cfg->delimiter, inverters[inv]->DeviceName.c_str());
-                    fprintf(csv, strout, cfg->delimiter, inverters[inv]->DeviceType.c_str());
+                    putfield(csv, cfg->delimiter, inverters[inv]->DeviceName.c_str());
+                    putfield(csv, cfg->delimiter, inverters[inv]->DeviceType.c_str());
                     fprintf(csv, "%c%lu", cfg->delimiter, inverters[inv]->Serial);
                 }
 
@@ -503,56 +507,56 @@ int ExportSpotDataToCSV(const Config *cfg, InverterData* const inverters[])
 
                 for (const auto &mpp : inverters[inv]->mpp)
                 {
-                    fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Watt(), 0, cfg->precision, cfg->decimalpoint));
+                    putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Watt(), 0, cfg->precision, cfg->decimalpoint));
                 }
                 fputs(missing_mppt.c_str(), csv);
 
                 for (const auto &mpp : inverters[inv]->mpp)
                 {
-                    fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Amp(), 0, cfg->precision, cfg->decimalpoint));
+                    putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Amp(), 0, cfg->precision, cfg->decimalpoint));
                 }
                 fputs(missing_mppt.c_str(), csv);
 
                 for (const auto &mpp : inverters[inv]->mpp)
                 {
-                    fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Volt(), 0, cfg->precision, cfg->decimalpoint));
+                    putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, mpp.second.Volt(), 0, cfg->precision, cfg->decimalpoint));
                 }
                 fputs(missing_mppt.c_str(), csv);
 
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac1, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac2, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac3, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac1 / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac2 / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac3 / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac1 / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac2 / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac3 / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->calPdcTot, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->TotalPac, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, inverters[inv]->calEfficiency, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->EToday / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->ETotal / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->GridFreq / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->OperationTime / 3600, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->FeedInTime / 3600, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac1, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac2, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Pac3, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac1 / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac2 / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Iac3 / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac1 / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac2 / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Uac3 / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->calPdcTot, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->TotalPac, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, inverters[inv]->calEfficiency, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->EToday / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->ETotal / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->GridFreq / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->OperationTime / 3600, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, (double)inverters[inv]->FeedInTime / 3600, 0, cfg->precision, cfg->decimalpoint));
                 if (inverters[inv]->BT_Signal == 0)
-                    fprintf(csv, strout, cfg->delimiter, NA);
+                    putfield(csv, cfg->delimiter, NA);
                 else
-                    fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, inverters[inv]->BT_Signal, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, tagdefs.getDesc(inverters[inv]->DeviceStatus, "?").c_str());
-                fprintf(csv, strout, cfg->delimiter, tagdefs.getDesc(inverters[inv]->GridRelayStatus, "?").c_str());
+                    putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, inverters[inv]->BT_Signal, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, tagdefs.getDesc(inverters[inv]->DeviceStatus, "?").c_str());
+                putfield(csv, cfg->delimiter, tagdefs.getDesc(inverters[inv]->GridRelayStatus, "?").c_str());
                 if (is_NaN(inverters[inv]->Temperature))
-                    fprintf(csv, strout, cfg->delimiter, NA);
+                    putfield(csv, cfg->delimiter, NA);
                 else
-                    fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Temperature / 100, 0, cfg->precision, cfg->decimalpoint));
+                    putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, (float)inverters[inv]->Temperature / 100, 0, cfg->precision, cfg->decimalpoint));
                 if (!cfg->SpotWebboxHeader)
                     fputs("\n", csv);
             }
             if (cfg->SpotWebboxHeader)
                 fputs("\n", csv);
         }
-        fclose(csv);
+        spotCSV.commit(cfg->CSV_FlushInterval);
     }
     return 0;
 }
@@ -567,7 +571,7 @@ int ExportEventsToCSV(const Config *cfg, InverterData* const inverters[], std::s
     //Expand date specifiers in config::outputPath_Events
     std::stringstream csvpath;
     csvpath << strftime_t(cfg->outputPath_Events, time(nullptr));
-    CreatePath(csvpath.str().c_str());
+    CSVWriter::createPath(csvpath.str());
 
     csvpath << FOLDER_SEP << cfg->plantname << "-" << (cfg->userGroup == UG_USER ? "User" : "Installer") << "-Events-" << dt_range_csv.c_str() << ".csv";
 
@@ -666,13 +670,12 @@ int ExportBatteryDataToCSV(const Config *cfg, InverterData* const inverters[])
     time_t spottime = time(nullptr);
 
     //Expand date specifiers in config::outputPath
+    const std::string csvfolder = strftime_t(cfg->outputPath, spottime);
     std::stringstream csvpath;
-    csvpath << strftime_t(cfg->outputPath, spottime);
-    CreatePath(csvpath.str().c_str());
+    csvpath << csvfolder << FOLDER_SEP << cfg->plantname << "-Battery-" << strftime_t("%Y%m%d", spottime) << ".csv";
 
-    csvpath << FOLDER_SEP << cfg->plantname << "-Battery-" << strftime_t("%Y%m%d", spottime) << ".csv";
-
-    if ((csv = fopen(csvpath.str().c_str(), "a+")) == NULL)
+    bool empty;
+    if ((csv = batteryCSV.open(csvfolder, csvpath.str(), empty)) == NULL)
     {
         if (!cfg->quiet)
         {
@@ -684,13 +687,7 @@ int ExportBatteryDataToCSV(const Config *cfg, InverterData* const inverters[])
     else
     {
         //Write header when new file has been created
-#if defined(_WIN32)
-        if (filelength(fileno(csv)) == 0)
-#else
-        struct stat fStat;
-        stat(csvpath.str().c_str(), &fStat);
-        if (fStat.st_size == 0)
-#endif
+        if (empty)
         {
             if (cfg->SpotWebboxHeader)
                 WriteWebboxHeader(csv, cfg, inverters, 0);
@@ -699,7 +696,6 @@ int ExportBatteryDataToCSV(const Config *cfg, InverterData* const inverters[])
         }
 
         char FormattedFloat[32];
-        const char *strout = "%c%s";
 
         if (cfg->SpotWebboxHeader)
             fputs(strftime_t(cfg->DateTimeFormat, spottime).c_str(), csv);
@@ -711,40 +707,40 @@ int ExportBatteryDataToCSV(const Config *cfg, InverterData* const inverters[])
                 if (!cfg->SpotWebboxHeader)
                 {
                     fputs(strftime_t(cfg->DateTimeFormat, spottime).c_str(), csv);
-                    fprintf(csv, strout, cfg->delimiter, inverters[inv]->DeviceName.c_str());
-                    fprintf(csv, strout, cfg->delimiter, inverters[inv]->DeviceType.c_str());
+                    putfield(csv, cfg->delimiter, inverters[inv]->DeviceName.c_str());
+                    putfield(csv, cfg->delimiter, inverters[inv]->DeviceType.c_str());
                     fprintf(csv, "%c%lu", cfg->delimiter, inverters[inv]->Serial);
                 }
 
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac1), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac2), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac3), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac1) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac2) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac3) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac1) / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac2) / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac3) / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->TotalPac), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->EToday) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->ETotal) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->GridFreq) / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->OperationTime) / 3600, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->FeedInTime) / 3600, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, tagdefs.getDesc(inverters[inv]->DeviceStatus, "?").c_str());
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatChaStt), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatTmpVal) / 10, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatVol) / 100, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatAmp) / 1000, 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->MeteringGridMsTotWOut), 0, cfg->precision, cfg->decimalpoint));
-                fprintf(csv, strout, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->MeteringGridMsTotWIn), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac1), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac2), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Pac3), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac1) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac2) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Iac3) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac1) / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac2) / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->Uac3) / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->TotalPac), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->EToday) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->ETotal) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->GridFreq) / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatDouble(FormattedFloat, ((double)inverters[inv]->OperationTime) / 3600, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->FeedInTime) / 3600, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, tagdefs.getDesc(inverters[inv]->DeviceStatus, "?").c_str());
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatChaStt), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatTmpVal) / 10, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatVol) / 100, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->BatAmp) / 1000, 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->MeteringGridMsTotWOut), 0, cfg->precision, cfg->decimalpoint));
+                putfield(csv, cfg->delimiter, FormatFloat(FormattedFloat, ((float)inverters[inv]->MeteringGridMsTotWIn), 0, cfg->precision, cfg->decimalpoint));
                 if (!cfg->SpotWebboxHeader)
                     fputs("\n", csv);
             }
             if (cfg->SpotWebboxHeader)
                 fputs("\n", csv);
         }
-        fclose(csv);
+        batteryCSV.commit(cfg->CSV_FlushInterval);
     }
     return 0;
 }
@@ -10,7 +10,7 @@ CREATE Table Config (
 	PRIMARY KEY (`Key`)
 );
 
-INSERT INTO Config VALUES('SchemaVersion','2');
+INSERT INTO Config VALUES('SchemaVersion','3');
 
 CREATE Table Inverters (
 	Serial int unsigned NOT NULL,
@@ -57,7 +57,9 @@ CREATE Table SpotData (
 	Status varchar(10),
 	GridRelay varchar(10),
 	Temperature float,
-	PRIMARY KEY (TimeStamp, Serial)
+	Bucket int AS (TimeStamp+150-(TimeStamp+150)%300) VIRTUAL,
+	PRIMARY KEY (TimeStamp, Serial),
+	INDEX SpotData_Bucket (Serial, Bucket)
 );
 
 -- Fix 02-MAY-2016 See Issue 150
@@ -184,9 +186,10 @@ CREATE VIEW vwAvgConsumption AS
     FROM vwConsumption
     GROUP BY Nearest5Min;
 
+-- Bucket = Nearest5min of vwSpotData
 CREATE VIEW vwAvgSpotData AS
-       SELECT nearest5min,
-              serial,
+       SELECT From_UnixTime(Dat.Bucket) AS nearest5min,
+              Dat.Serial,
               cast(avg(Pdc1) as decimal(9)) AS Pdc1,
               cast(avg(Pdc2) as decimal(9)) AS Pdc2,
               cast(avg(Idc1) as decimal(9,3)) AS Idc1,
@@ -202,9 +205,10 @@ CREATE VIEW vwAvgSpotData AS
               cast(avg(Uac1) as decimal(9,2)) AS Uac1,
               cast(avg(Uac2) as decimal(9,2)) AS Uac2,
               cast(avg(Uac3) as decimal(9,2)) AS Uac3,
-              cast(avg(Temperature) as decimal(9,2)) AS Temperature
-        FROM vwSpotData
-        GROUP BY serial, nearest5min;
+              cast(avg(ROUND(Dat.Temperature,1)) as decimal(9,2)) AS Temperature
+        FROM SpotData Dat
+        INNER JOIN Inverters Inv ON Dat.Serial=Inv.Serial
+        GROUP BY Dat.Serial, Dat.Bucket;
 
 CREATE VIEW vwPvoData AS
        SELECT dd.Timestamp,
@@ -260,3 +264,39 @@ CREATE VIEW vwBatteryData AS
            INNER JOIN
            Inverters AS inv ON sdx.Serial = inv.`Serial`
      GROUP BY `5min`;
+
+-- Hourly ('H'), daily ('D') and monthly ('M') aggregates, maintained by SBFspot
+-- Average power = PacSum / Samples, Energy = ETotalMax - ETotalMin
+CREATE TABLE SpotDataRollup (
+	Period char(1) NOT NULL,
+	TimeStamp int NOT NULL,
+	Serial int unsigned NOT NULL,
+	Samples int,
+	PacMin int, PacMax int,
+	PacSum bigint, PdcSum bigint,
+	ETotalMin bigint, ETotalMax bigint,
+	PRIMARY KEY (Serial, Period, TimeStamp)
+);
+
+CREATE TABLE DayDataRollup (
+	Period char(1) NOT NULL,
+	TimeStamp int NOT NULL,
+	Serial int unsigned NOT NULL,
+	Samples int,
+	PowerMax bigint, PowerSum bigint,
+	TotalYieldMin bigint, TotalYieldMax bigint,
+	PRIMARY KEY (Serial, Period, TimeStamp)
+);
+
+-- vwPvoData rows (V1..V6) materialized by SBFspot when the DayData is stored
+-- SBFspotUploadDaemon reads the rows to upload from the PvoStaging_Upload index
+CREATE TABLE PvoStaging (
+	TimeStamp int NOT NULL,
+	Serial int unsigned NOT NULL,
+	V1 bigint, V2 bigint, V3 bigint, V4 bigint,
+	V5 decimal(9,2), V6 decimal(9,2),
+	V7 float, V8 float, V9 float, V10 float, V11 float, V12 float,
+	PVoutput int(1),
+	PRIMARY KEY (TimeStamp, Serial),
+	INDEX PvoStaging_Upload (Serial, PVoutput, TimeStamp)
+);
@@ -6,6 +6,8 @@ CREATE Table Config (
 	PRIMARY KEY (`Key`)
 );
 
+-- SBFspot updates the schema when it opens the database for the first time (e.g. SpotData.Bucket of version 2,
+-- a generated column when SBFspot is linked with SQLite 3.31 or later, a column filled by a trigger otherwise)
 INSERT INTO Config VALUES('SchemaVersion','1');
 
 CREATE Table Inverters (
@@ -259,3 +261,40 @@ CREATE VIEW vwBatteryData AS
            Inverters AS inv ON sdx.[Serial] = inv.[Serial]
      GROUP BY [5min];
 
+-- Hourly ('H'), daily ('D') and monthly ('M') aggregates, maintained by SBFspot
+-- Average power = PacSum / Samples, Energy = ETotalMax - ETotalMin
+CREATE TABLE SpotDataRollup (
+	Period char(1) NOT NULL,
+	TimeStamp datetime NOT NULL,
+	Serial int(4) NOT NULL,
+	Samples int(4),
+	PacMin int, PacMax int,
+	PacSum int(8), PdcSum int(8),
+	ETotalMin int(8), ETotalMax int(8),
+	PRIMARY KEY (Serial, Period, TimeStamp)
+);
+
+CREATE TABLE DayDataRollup (
+	Period char(1) NOT NULL,
+	TimeStamp datetime NOT NULL,
+	Serial int(4) NOT NULL,
+	Samples int(4),
+	PowerMax int(8), PowerSum int(8),
+	TotalYieldMin int(8), TotalYieldMax int(8),
+	PRIMARY KEY (Serial, Period, TimeStamp)
+);
+
+-- vwPvoData rows (V1..V6) materialized by SBFspot when the DayData is stored
+-- SBFspotUploadDaemon reads the rows to upload from the partial index
+CREATE TABLE PvoStaging (
+	TimeStamp datetime NOT NULL,
+	Serial int(4) NOT NULL,
+	V1 int(8), V2 int(8), V3 int(8), V4 int(8),
+	V5 float, V6 float,
+	V7 float, V8 float, V9 float, V10 float, V11 float, V12 float,
+	PVoutput int(1),
+	PRIMARY KEY (TimeStamp, Serial)
+);
+
+CREATE INDEX PvoStaging_Upload ON PvoStaging(Serial, TimeStamp) WHERE PVoutput IS NULL;
+
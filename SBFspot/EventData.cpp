@@ -150,9 +150,10 @@ std::string EventData::ToString(const char *datetimeformat) const
 
 std::string EventData::ToLocalTime(const time_t rawtime, const char *format) const
 {
-    struct tm* timeinfo = localtime(&rawtime);
+    struct tm timeinfo;
+    localtime_s(&timeinfo, &rawtime);
     std::ostringstream os;
-    os << std::put_time(timeinfo, format);
+    os << std::put_time(&timeinfo, format);
     return os.str();
 }
 
@@ -0,0 +1,143 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "ExportQueue.h"
+#include "misc.h"
+#include <iostream>
+
+extern int verbose;
+
+ExportQueue::ExportQueue(const std::string& name, unsigned int capacity, QUEUEFULLPOLICY policy)
+    : m_name(name)
+    , m_capacity(capacity)
+    , m_policy(policy)
+    , m_stopping(false)
+    , m_processed(0)
+    , m_dropped(0)
+    , m_highwater(0)
+{
+}
+
+ExportQueue::~ExportQueue()
+{
+    drain();
+}
+
+bool ExportQueue::push(Job job)
+{
+    // Synchronous mode
+    if (m_capacity == 0)
+    {
+        job();
+        m_processed++;
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_stopping)
+        return false;
+
+    // Worker is started on first use, so unused sinks don't cost a thread
+    if (!m_thread.joinable())
+        m_thread = std::thread(&ExportQueue::worker, this);
+
+    if (m_jobs.size() >= m_capacity)
+    {
+        if (m_policy == QFP_DROP)
+        {
+            m_dropped++;
+            if (VERBOSE_NORMAL)
+                std::cout << "Export queue [" << m_name << "] full - data dropped" << std::endl;
+            return false;
+        }
+
+        if (VERBOSE_HIGH)
+            std::cout << "Export queue [" << m_name << "] full - waiting..." << std::endl;
+
+        m_notFull.wait(lock, [this] { return m_jobs.size() < m_capacity; });
+    }
+
+    m_jobs.push_back(std::move(job));
+    if (m_jobs.size() > m_highwater)
+        m_highwater = (unsigned int)m_jobs.size();
+
+    lock.unlock();
+    m_notEmpty.notify_one();
+
+    return true;
+}
+
+// Stop accepting new jobs and wait until all queued jobs are processed
+void ExportQueue::drain()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+
+    m_notEmpty.notify_all();
+
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+
+        if (VERBOSE_HIGH)
+            std::cout << "Export queue [" << m_name << "] " << m_processed << " processed, " << m_dropped << " dropped, max depth " << m_highwater << std::endl;
+    }
+}
+
+void ExportQueue::worker()
+{
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_notEmpty.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+
+            // When stopping, the remaining jobs are still processed
+            if (m_jobs.empty())
+                break;
+
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        m_notFull.notify_one();
+
+        job();
+        m_processed++;
+    }
+}
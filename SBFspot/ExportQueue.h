@@ -0,0 +1,89 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Policy when a job is pushed to a full queue
+enum QUEUEFULLPOLICY
+{
+    QFP_BLOCK = 0,  // Wait until the worker has room for the job
+    QFP_DROP = 1    // Discard the job
+};
+
+// Bounded job queue, drained by its own worker thread
+// Used to decouple the (slow) export sinks from the inverter communication
+// A queue with capacity 0 runs the jobs synchronously in the caller's thread
+class ExportQueue
+{
+public:
+    typedef std::function<void()> Job;
+
+    ExportQueue(const std::string& name, unsigned int capacity, QUEUEFULLPOLICY policy);
+    ~ExportQueue();
+
+    bool push(Job job);
+    void drain();
+
+    unsigned int processed() const { return m_processed; }
+    unsigned int dropped() const { return m_dropped; }
+    unsigned int highWater() const { return m_highwater; }
+
+private:
+    ExportQueue(const ExportQueue&) = delete;
+    ExportQueue& operator=(const ExportQueue&) = delete;
+
+    void worker();
+
+    const std::string m_name;
+    const unsigned int m_capacity;
+    const QUEUEFULLPOLICY m_policy;
+
+    std::deque<Job> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+    std::thread m_thread;
+    bool m_stopping;
+
+    unsigned int m_processed;
+    unsigned int m_dropped;
+    unsigned int m_highwater;
+};
@@ -36,13 +36,49 @@ DISCLAIMER:
 
 #include "ArchData.h"
 #include "CSVexport.h"
+#include "SpotArchive.h"
+#include "UploadNotify.h"
 #include "mqtt.h"
 #include <vector>
 #include "mppt.h"
+#include "sunrise_sunset.h"
+#include <algorithm>
+#include <csignal>
+#include <memory>
+
+// Copy of the inverter data owned by an export job
+// The next day/month is read from the inverter while this copy is being exported
+struct InverterSnapshot
+{
+    explicit InverterSnapshot(const std::vector<InverterData>& data)
+        : inverterData(data)
+    {
+        for (auto &inv : inverterData)
+            pointers.push_back(&inv);
+        pointers.push_back(nullptr);
+    }
+
+    InverterData **inverters() { return pointers.data(); }
+
+    std::vector<InverterData> inverterData;
+    std::vector<InverterData *> pointers;
+};
 
 Inverter::Inverter(const Config& config)
     : m_config(config)
+    , m_mqtt(config)
+    , m_csvQueue("CSV", config.exportQueueSize, (QUEUEFULLPOLICY)config.exportQueueFullPolicy)
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+    , m_sqlQueue("SQL", config.exportQueueSize, (QUEUEFULLPOLICY)config.exportQueueFullPolicy)
+#endif
+    , m_mqttQueue("MQTT", config.exportQueueSize, (QUEUEFULLPOLICY)config.exportQueueFullPolicy)
+    , m_spotDedup(config)
 {
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+    m_sqlAvailable = false;
+    m_sqlMaintenance = false;
+#endif
+
     //Allocate array to hold InverterData structs
     m_inverters = new InverterData*[MAX_INVERTERS];
     for (uint32_t i=0; i<MAX_INVERTERS; m_inverters[i++]=NULL);
@@ -173,6 +209,65 @@ int Inverter::process()
         }
     }
 
+    // Open DB
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+    if (!m_config.nosql)
+        openSql();
+
+    // From here on, the database state belongs to the SQL worker
+    m_sqlAvailable = isSqlAvailable();
+#endif
+
+    rc = poll();
+
+    if (m_config.listen)
+        rc = listen();
+
+    if (m_config.ConnectionType == CT_BLUETOOTH)
+        logoffSMAInverter(m_inverters[0]);
+    else
+    {
+        logoffMultigateDevices(m_inverters);
+        for (uint32_t inv=0; m_inverters[inv]!=NULL && inv<MAX_INVERTERS; inv++)
+            logoffSMAInverter(m_inverters[inv]);
+    }
+
+    logOff();
+    bthClose();
+
+    // Wait for all sinks to finish their pending exports
+    m_csvQueue.drain();
+    m_mqttQueue.drain();
+
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+    m_sqlQueue.drain();
+
+#if defined(USE_MYSQL)
+    if (!m_config.nosql)
+        m_db.flush_spool();
+#endif
+
+    if ((!m_config.nosql) && m_db.isopen())
+    {
+        if (VERBOSE_HIGH)
+            std::cout << "SQL: " << m_db.write_stats() << std::endl;
+
+        m_db.close();
+    }
+#endif
+
+    return rc;
+}
+
+// Spot data, archived day/month data and events of all inverters, exported to all sinks
+int Inverter::poll()
+{
+    int rc = E_OK;
+
+    // A resident process (-listen) polls again: only export the events read by this poll
+    for (uint32_t inv = 0; m_inverters[inv] != NULL && inv < MAX_INVERTERS; inv++)
+        m_inverters[inv]->eventData.clear();
+
     if (hasBatteryDevice)
     {
         if ((rc = getInverterData(m_inverters, BatteryChargeStatus)) != E_OK)
@@ -419,18 +514,6 @@ int Inverter::process()
         }
     }
 
-    // Open DB
-#if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if (!m_config.nosql)
-    {
-#if defined(USE_MYSQL)
-        m_db.open(m_config.sqlHostname, m_config.sqlUsername, m_config.sqlUserPassword, m_config.sqlDatabase, m_config.sqlPort);
-#elif defined(USE_SQLITE)
-        m_db.open(m_config.sqlDatabase);
-#endif
-    }
-#endif
-
     exportSpotData();
 
     //SolarInverter -> Continue to get archive data
@@ -576,26 +659,147 @@ int Inverter::process()
         exportEventData(dt_range_csv);
     }
 
-    if (m_config.ConnectionType == CT_BLUETOOTH)
-        logoffSMAInverter(m_inverters[0]);
-    else
-    {
-        logoffMultigateDevices(m_inverters);
-        for (uint32_t inv=0; m_inverters[inv]!=NULL && inv<MAX_INVERTERS; inv++)
-            logoffSMAInverter(m_inverters[inv]);
-    }
+    return rc;
+}
 
-    logOff();
-    bthClose();
+static volatile sig_atomic_t stopListening = 0;
 
+static void onStopSignal(int)
+{
+    stopListening = 1;
+}
+
+// Resident mode (-listen): the inverter session, database and broker connection stay open
+// Regular polls every MQTT_PollInterval seconds, on-demand polls on MQTT_CommandTopic
+int Inverter::listen()
+{
+    int rc = E_OK;
+    const time_t interval = (time_t)m_config.mqtt_poll_interval;
+    time_t nextPoll = time(nullptr) + interval;
+    MqttCommand command;
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if ((!m_config.nosql) && m_db.isopen())
-        m_db.close();
+    // The partitions of today were maintained when the database was opened
+    time_t nextSqlCheck = time(nullptr) + 60;
+    struct tm tm_sql;
+    const time_t started = time(nullptr);
+    localtime_s(&tm_sql, &started);
+    int sqlDay = tm_sql.tm_yday;
 #endif
 
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+
+    if (VERBOSE_NORMAL) std::cout << "Listening for commands on " << m_config.mqtt_command_topic << std::endl;
+
+    while (!stopListening)
+    {
+        // Check the stop flag every second
+        const time_t now = time(nullptr);
+
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+        // Every minute, reconnect a lost database on the SQL worker; once a day, maintain the partitions
+        if (!m_config.nosql && (now >= nextSqlCheck) && !m_sqlMaintenance)
+        {
+            localtime_s(&tm_sql, &now);
+            const bool daily = (tm_sql.tm_yday != sqlDay);
+            nextSqlCheck = now + 60;
+            m_sqlMaintenance = true;
+            if (m_sqlQueue.push([this, daily]() { maintainSql(daily); }))
+                sqlDay = tm_sql.tm_yday;
+            else
+                m_sqlMaintenance = false;
+        }
+#endif
+        const time_t wait = (interval == 0) ? 1 : std::min((time_t)1, std::max((time_t)0, nextPoll - now));
+
+        if (m_mqtt.nextCommand(command, (unsigned int)wait * 1000))
+            execCommand(command);
+        else if ((interval > 0) && (time(nullptr) >= nextPoll))
+        {
+            nextPoll += interval;
+            if (nextPoll <= time(nullptr))
+                nextPoll = time(nullptr) + interval;
+
+            // Sleeping inverters are not polled, unless -finq
+            float sunrise, sunset;
+            if ((m_config.latitude != 0 || m_config.longitude != 0) && !m_config.forceInq &&
+                !sunrise_sunset(m_config.latitude, m_config.longitude, &sunrise, &sunset, (float)m_config.SunRSOffset / 3600))
+                continue;
+
+            // The session may have expired since the previous poll
+            if (logonSMAInverter(m_inverters, m_config.userGroup, m_config.SMA_Password) != E_OK)
+            {
+                print_error(stdout, PROC_WARNING, "Logon failed, poll skipped\n");
+                continue;
+            }
+
+            rc = poll();
+        }
+    }
+
+    if (VERBOSE_NORMAL) std::cout << "Stopped listening" << std::endl;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
     return rc;
 }
 
+// Out-of-band poll of the requested data, published right away instead of through the export queue
+int Inverter::execCommand(const MqttCommand& command)
+{
+    // Same order as a regular poll
+    static const getInverterDataType order[] =
+    {
+        BatteryChargeStatus, BatteryInfo, MeteringGridMsTotW, DeviceStatus, InverterTemperature, GridRelayStatus,
+        EnergyProduction, OperationTime, SpotDCPower, SpotDCVoltage, SpotACPower, SpotACVoltage, SpotACTotalPower,
+        SpotGridFrequency, TypeLabel, SoftwareVersion
+    };
+
+    // Selected inverters, null terminated like m_inverters
+    std::vector<InverterData *> selection;
+    for (uint32_t inv = 0; m_inverters[inv] != NULL && inv < MAX_INVERTERS; inv++)
+    {
+        if (command.serials.empty() || (std::find(command.serials.begin(), command.serials.end(), m_inverters[inv]->Serial) != command.serials.end()))
+            selection.push_back(m_inverters[inv]);
+    }
+    selection.push_back(nullptr);
+
+    int rc = (selection.size() > 1) ? E_OK : E_BADARG;
+
+    for (int attempt = 0; (attempt < 2) && (selection.size() > 1); attempt++)
+    {
+        // Logon again when the session expired
+        if ((attempt > 0) && (logonSMAInverter(m_inverters, m_config.userGroup, m_config.SMA_Password) != E_OK))
+            break;
+
+        rc = E_OK;
+        for (const auto type : order)
+        {
+            if ((command.dataTypes & type) == 0)
+                continue;
+
+            const int result = getInverterData(selection.data(), type);
+            if ((result != E_OK) && (result != E_LRINOTAVAIL) && (rc == E_OK))
+                rc = result;
+        }
+
+        if (rc == E_OK)
+            break;
+    }
+
+    for (uint32_t inv = 0; selection[inv] != NULL; inv++)
+    {
+        if (m_config.calcMissingSpot)
+            CalcMissingSpot(selection[inv]);
+
+        selection[inv]->calPacTot = selection[inv]->Pac1 + selection[inv]->Pac2 + selection[inv]->Pac3;
+        selection[inv]->calEfficiency = selection[inv]->calPdcTot == 0 ? 0.0f : 100.0f * (float)selection[inv]->calPacTot / (float)selection[inv]->calPdcTot;
+    }
+
+    return m_mqtt.publishResult(command, rc, toStdVector(selection.data()));
+}
+
 int Inverter::logOn()
 {
     char msg[80];
@@ -692,11 +896,36 @@ void Inverter::logOff()
 
 void Inverter::exportSpotData()
 {
-    if ((m_config.CSV_Export) && (!m_config.nospot))
-        ExportSpotDataToCSV(&m_config, m_inverters);
+    const time_t spottime = time(nullptr);
+
+    // Write-on-change: unchanged data goes to the CSV and SQL sinks at the heartbeat only
+    const bool changed = m_spotDedup.store(m_inverters, spottime);
+
+    if ((m_config.CSV_Export) && (!m_config.nospot) && changed)
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_csvQueue.push([this, snapshot]()
+        {
+            ExportSpotDataToCSV(&m_config, snapshot->inverters());
+
+            if (hasBatteryDevice)
+                ExportBatteryDataToCSV(&m_config, snapshot->inverters());
+        });
+    }
+
+    if (!m_config.spotArchivePath.empty() && !m_config.nospot)
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_csvQueue.push([this, snapshot, spottime]()
+        {
+            SpotArchive archive(m_config.spotArchivePath);
+            archive.append(snapshot->inverters(), spottime);
+        });
+    }
 
     // Undocumented - For 123Solar Web Solar logger usage only)
     // Currently, only data of first inverter is exported
+    // 123Solar reads stdout of this process, so this export remains synchronous
     if ((m_inverters[0]->DevClass == SolarInverter) || (m_inverters[0]->DevClass == BatteryInverter) || (m_inverters[0]->DevClass == HybridInverter))
     {
         if (m_config.s123 == S123_DATA)
@@ -707,18 +936,48 @@ void Inverter::exportSpotData()
             ExportStateDataTo123s(&m_config, m_inverters);
     }
 
-    if (hasBatteryDevice && (m_config.CSV_Export) && (!m_config.nospot))
-        ExportBatteryDataToCSV(&m_config, m_inverters);
-
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if (!m_config.nosql && m_db.isopen())
+    if (m_sqlAvailable && changed)
     {
-        time_t spottime = time(nullptr);
-        m_db.type_label(m_inverters);
-        m_db.device_status(m_inverters, spottime);
-        m_db.exportSpotData(m_inverters, spottime);
-        if (hasBatteryDevice)
-            m_db.exportBatteryData(m_inverters, spottime);
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+
+        m_sqlQueue.push([this, snapshot, spottime]()
+        {
+            InverterData **inverters = snapshot->inverters();
+
+#if defined(USE_MYSQL)
+            // Database not available: spot data goes to the spool
+            if (!m_db.isopen() || m_db.spooling())
+            {
+                m_db.exportSpotData(inverters, spottime);
+                if (hasBatteryDevice)
+                    m_db.exportBatteryData(inverters, spottime);
+                return;
+            }
+#endif
+
+            // Store all spot data of this poll cycle in a single unit of work
+            // Instead of a commit per statement, we have only one commit (and fsync) per cycle
+            int rc = m_db.begin_transaction();
+            if (rc == m_db.SQL_OK)
+            {
+                rc = m_db.type_label(inverters);
+                if (rc == m_db.SQL_OK)
+                    rc = m_db.device_status(inverters, spottime);
+                if (rc == m_db.SQL_OK)
+                    rc = m_db.exportSpotData(inverters, spottime);
+                if ((rc == m_db.SQL_OK) && hasBatteryDevice)
+                    rc = m_db.exportBatteryData(inverters, spottime);
+
+                if (rc == m_db.SQL_OK)
+                    m_db.commit_transaction();
+                else
+                {
+                    std::cout << "Spot data not stored. Rolling back now..." << std::endl;
+                    m_db.rollback_transaction();
+                }
+            }
+        });
     }
 #endif
 
@@ -727,48 +986,144 @@ void Inverter::exportSpotData()
     ********/
     if (m_config.mqtt) // MQTT enabled
     {
-        MqttExport mqtt(m_config);
-        auto rc = mqtt.exportInverterData(toStdVector(m_inverters));
-        if (rc != 0)
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_mqttQueue.push([this, snapshot]()
         {
-            std::cout << "Error " << rc << " while publishing to MQTT Broker" << std::endl;
-        }
+            auto rc = m_mqtt.exportInverterData(snapshot->inverterData);
+            if (rc != 0)
+            {
+                std::cout << "Error " << rc << " while publishing to MQTT Broker" << std::endl;
+            }
+        });
     }
 }
 
 void Inverter::exportDayData()
 {
     if (m_config.CSV_Export)
-        ExportDayDataToCSV(&m_config, m_inverters);
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_csvQueue.push([this, snapshot]() { ExportDayDataToCSV(&m_config, snapshot->inverters()); });
+    }
 
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if ((!m_config.nosql) && m_db.isopen())
-        m_db.exportDayData(m_inverters);
+    if (m_sqlAvailable)
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_sqlQueue.push([this, snapshot]()
+        {
+            // Let SBFspotUploadDaemon upload the new data right away
+            if ((m_db.exportDayData(snapshot->inverters()) == m_db.SQL_OK) && !m_config.sqlNotifySocket.empty())
+                UploadNotifier::notify(m_config.sqlNotifySocket);
+        });
+    }
 #endif
 }
 
 void Inverter::exportMonthData()
 {
     if (m_config.CSV_Export)
-        ExportMonthDataToCSV(&m_config, m_inverters);
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_csvQueue.push([this, snapshot]() { ExportMonthDataToCSV(&m_config, snapshot->inverters()); });
+    }
 
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if ((!m_config.nosql) && m_db.isopen())
-        m_db.exportMonthData(m_inverters);
+    if (m_sqlAvailable)
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_sqlQueue.push([this, snapshot]() { m_db.exportMonthData(snapshot->inverters()); });
+    }
 #endif
 }
 
 void Inverter::exportEventData(const std::string& dt_range_csv)
 {
     if ((m_config.CSV_Export) && (m_config.archEventMonths > 0))
-        ExportEventsToCSV(&m_config, m_inverters, dt_range_csv);
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_csvQueue.push([this, snapshot, dt_range_csv]() { ExportEventsToCSV(&m_config, snapshot->inverters(), dt_range_csv); });
+    }
 
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
-    if ((!m_config.nosql) && m_db.isopen())
-        m_db.exportEventData(m_inverters, tagdefs);
+    if (m_sqlAvailable)
+    {
+        auto snapshot = std::make_shared<InverterSnapshot>(toStdVector(m_inverters));
+        m_sqlQueue.push([this, snapshot]() { m_db.exportEventData(snapshot->inverters(), tagdefs); });
+    }
 #endif
 }
 
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+void Inverter::openSql()
+{
+#if defined(USE_MYSQL)
+    m_db.set_batch_size(m_config.sqlBatchSize);
+    m_db.set_spool(m_config.sqlSpoolFile);
+    m_db.open(m_config.sqlHostname, m_config.sqlUsername, m_config.sqlUserPassword, m_config.sqlDatabase, m_config.sqlPort);
+#elif defined(USE_SQLITE)
+    m_db.set_profile((SQLPROFILE)m_config.sqlProfile);
+    m_db.set_busy_timeout(m_config.sqlBusyTimeout);
+    m_db.set_checkpoint(m_config.sqlCheckpoint);
+    m_db.open(m_config.sqlDatabase);
+#endif
+    m_db.set_spot_heartbeat(m_config.spotHeartbeat);
+    if (m_db.isopen())
+    {
+        m_db.schema_update();
+        m_db.init_rollup();
+        m_db.init_pvo_staging();
+        if (m_config.sqlSpotPartitioning)
+            m_db.maintain_partitions(m_config.sqlSpotRetention);
+    }
+#if defined(USE_MYSQL)
+    // Store data spooled during previous runs, before any new data
+    m_db.replay_spool();
+#endif
+}
+
+// Resident mode: reopen a database that was lost or never opened, store the spooled data
+// and, once a day, maintain the partitions
+// Runs on the SQL worker
+void Inverter::maintainSql(bool daily)
+{
+    if (m_db.isopen() && (m_db.ping() != m_db.SQL_OK))
+    {
+        print_error(stdout, PROC_WARNING, "Lost connection to the database, reconnecting...\n");
+        m_db.close();
+    }
+
+    // Opening also maintains the partitions
+    if (!m_db.isopen())
+        openSql();
+    else
+    {
+#if defined(USE_MYSQL)
+        if (m_db.spooling())
+            m_db.replay_spool();
+#endif
+        if (daily && m_config.sqlSpotPartitioning)
+            m_db.maintain_partitions(m_config.sqlSpotRetention);
+    }
+
+    m_sqlAvailable = isSqlAvailable();
+    m_sqlMaintenance = false;
+}
+
+bool Inverter::isSqlAvailable()
+{
+    if (m_config.nosql)
+        return false;
+
+#if defined(USE_MYSQL)
+    // Data is spooled when the database is down
+    return m_db.isopen() || m_db.spooling();
+#else
+    return m_db.isopen();
+#endif
+}
+#endif
+
 std::vector<InverterData> Inverter::toStdVector(InverterData* const* const inverters)
 {
     std::vector<InverterData> inverterData;
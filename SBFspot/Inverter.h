@@ -35,6 +35,10 @@ DISCLAIMER:
 #pragma once
 
 #include "SQLselect.h"
+#include "ExportQueue.h"
+#include "SpotDedup.h"
+#include "mqtt.h"
+#include <atomic>
 
 struct Config;
 struct InverterData;
@@ -51,6 +55,10 @@ private:
     int logOn();
     void logOff();
 
+    int poll();
+    int listen();
+    int execCommand(const MqttCommand& command);
+
     void exportSpotData();
     void exportDayData();
     void exportMonthData();
@@ -68,6 +76,23 @@ private:
 
 #if defined(USE_SQLITE) || defined(USE_MYSQL)
     db_SQL_Export m_db;
+    void openSql();
+    void maintainSql(bool daily);
+    bool isSqlAvailable();
+    std::atomic<bool> m_sqlAvailable;   // Set by the SQL worker, m_db is only used by that worker once it started
+    std::atomic<bool> m_sqlMaintenance; // maintainSql() is queued
+#endif
+
+    // Keeps its broker connection for all inverters and poll cycles
+    MqttExport m_mqtt;
+
+    // Each export sink has its own worker, so a slow sink doesn't stall the inverter communication
+    ExportQueue m_csvQueue;
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+    ExportQueue m_sqlQueue;
 #endif
+    ExportQueue m_mqttQueue;
+
+    SpotDedup m_spotDedup;
 };
 
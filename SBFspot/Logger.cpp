@@ -0,0 +1,376 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2024, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "Logger.h"
+#include "osselect.h"
+#include <ctime>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#define pipe(fds) _pipe(fds, LOG_BUFFER_SIZE, _O_BINARY)
+#else
+#include <unistd.h>
+#include <zlib.h>
+#endif
+
+int LogStreambuf::overflow(int c)
+{
+    if (c == EOF)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (c == '\n')
+    {
+        m_sink(m_line);
+        m_line.clear();
+    }
+    else
+        m_line += (char)c;
+
+    return c;
+}
+
+Logger::Logger()
+{
+    m_maxSize = 0;
+    m_compress = false;
+    m_file = NULL;
+    m_size = 0;
+    m_flushNow = false;
+    m_stop = false;
+    m_appended = 0;
+    m_written = 0;
+    m_coutbuf = NULL;
+    m_cerrbuf = NULL;
+    m_stdout = -1;
+    m_stderr = -1;
+}
+
+Logger::~Logger()
+{
+    close();
+}
+
+void Logger::open(const std::string &dir, const std::string &prefix, unsigned long maxSize, bool compress)
+{
+    if (isOpen())
+        return;
+
+    m_dir = dir;
+    m_prefix = prefix;
+    m_maxSize = maxSize;
+    m_compress = compress;
+    m_stop = false;
+    m_thread = std::thread(&Logger::flusher, this);
+}
+
+void Logger::redirect(const LogSink &out, const LogSink &err)
+{
+    if (!isOpen() || (m_coutbuf != NULL))
+        return;
+
+    m_out.sink(out);
+    m_err.sink(err);
+    m_coutbuf = std::cout.rdbuf(&m_out);
+    m_cerrbuf = std::cerr.rdbuf(&m_err);
+}
+
+bool Logger::capture(const LogSink &sink)
+{
+    if (!isOpen() || (m_stdout >= 0))
+        return false;
+
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    fflush(stdout);
+    fflush(stderr);
+    m_stdout = dup(fileno(stdout));
+    m_stderr = dup(fileno(stderr));
+    dup2(fds[1], fileno(stdout));
+    dup2(fds[1], fileno(stderr));
+    ::close(fds[1]);
+
+    // A pipe makes stdout fully buffered
+#if defined(_WIN32)
+    setvbuf(stdout, NULL, _IONBF, 0);
+#else
+    setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+#endif
+
+    m_reader = std::thread(&Logger::reader, this, sink, fds[0]);
+    return true;
+}
+
+// Undo redirect() and capture()
+void Logger::release(void)
+{
+    if (m_coutbuf != NULL)
+    {
+        std::cout.rdbuf(m_coutbuf);
+        std::cerr.rdbuf(m_cerrbuf);
+        m_coutbuf = NULL;
+        m_cerrbuf = NULL;
+    }
+
+    if (m_stdout >= 0)
+    {
+        // The reader stops when the last write end of the pipe is closed
+        std::cout.flush();
+        fflush(stdout);
+        fflush(stderr);
+        dup2(m_stdout, fileno(stdout));
+        dup2(m_stderr, fileno(stderr));
+        ::close(m_stdout);
+        ::close(m_stderr);
+        m_reader.join();
+        m_stdout = -1;
+        m_stderr = -1;
+    }
+}
+
+void Logger::reader(LogSink sink, int fd)
+{
+    char buf[4096];
+    std::string line;
+    int len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            if (buf[i] == '\n')
+            {
+                sink(line);
+                line.clear();
+            }
+            else if (buf[i] != '\r')
+                line += buf[i];
+        }
+    }
+
+    if (!line.empty())
+        sink(line);
+
+    ::close(fd);
+}
+
+void Logger::close(void)
+{
+    if (!isOpen())
+        return;
+
+    release();
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+}
+
+void Logger::write(const std::string &line, bool urgent)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Don't lose lines, wait until the flusher caught up
+    m_flushed.wait(lock, [this] { return m_stop || (m_pending.length() < LOG_BUFFER_SIZE); });
+
+    m_pending += line;
+    m_appended += line.length();
+    if (urgent || (m_pending.length() >= LOG_BUFFER_SIZE / 2))
+    {
+        m_flushNow = true;
+        m_wake.notify_one();
+    }
+}
+
+// Wait until all pending lines are written
+void Logger::flush(void)
+{
+    if (!isOpen())
+        return;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const unsigned long long appended = m_appended;
+    m_flushNow = true;
+    m_wake.notify_one();
+    m_flushed.wait(lock, [this, appended] { return m_stop || (m_written >= appended); });
+}
+
+void Logger::flusher(void)
+{
+    std::string data;
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        // Write at least every second
+        m_wake.wait_for(lock, std::chrono::seconds(1), [this] { return m_stop || m_flushNow; });
+        m_flushNow = false;
+
+        data.swap(m_pending);
+        const unsigned long long appended = m_appended;
+        const bool stop = m_stop;
+
+        lock.unlock();
+        if (!data.empty())
+            writeFile(data);
+        data.clear();
+        lock.lock();
+
+        m_written = appended;
+        m_flushed.notify_all();
+
+        if (stop && m_pending.empty())
+            break;
+    }
+
+    lock.unlock();
+    closeFile(false);
+}
+
+void Logger::writeFile(const std::string &data)
+{
+    char buff[32];
+    time_t now = time(nullptr);
+    struct tm tm_now;
+    localtime_s(&tm_now, &now);
+    strftime(buff, sizeof(buff), "%Y%m%d", &tm_now);
+    const std::string day = m_dir + m_prefix + buff;
+    const std::string filename = day + ".log";
+
+    // New day or size limit reached
+    if (m_file && (filename != m_filename))
+        closeFile(true);
+    else if (m_file && (m_maxSize > 0) && (m_size >= m_maxSize))
+    {
+        closeFile(false);
+
+        // Keep the numbered parts apart from the file of the day
+        std::string part;
+        for (int n = 1; ; n++)
+        {
+            part = day + "." + std::to_string(n) + ".log";
+            FILE *fp = fopen(part.c_str(), "r");
+            if (fp == NULL)
+            {
+                fp = fopen((part + ".gz").c_str(), "r");
+                if (fp == NULL)
+                    break;
+            }
+            fclose(fp);
+        }
+
+        if (rename(m_filename.c_str(), part.c_str()) == 0)
+            compress(part);
+    }
+
+    if (m_file == NULL)
+    {
+        m_filename = filename;
+        if ((m_file = fopen(m_filename.c_str(), "a")) == NULL)
+        {
+            report("Unable to write to logfile [" + m_filename + "]\n");
+            return;
+        }
+        fseek(m_file, 0, SEEK_END);
+        m_size = ftell(m_file);
+    }
+
+    fwrite(data.c_str(), 1, data.length(), m_file);
+    fflush(m_file);
+    m_size += data.length();
+}
+
+void Logger::closeFile(bool rotated)
+{
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+
+        // File of a past day is complete
+        if (rotated)
+            compress(m_filename);
+    }
+}
+
+// Tell the console, which may be redirected to ourselves
+void Logger::report(const std::string &msg)
+{
+    if (m_stderr >= 0)
+    {
+        if (::write(m_stderr, msg.c_str(), (unsigned int)msg.length()) < 0)
+            return;
+    }
+    else
+    {
+        std::ostream err(m_cerrbuf != NULL ? m_cerrbuf : std::cerr.rdbuf());
+        err << msg << std::flush;
+    }
+}
+
+// Replace a rotated logfile by <path>.gz (not on Windows)
+void Logger::compress(const std::string &path)
+{
+#if !defined(_WIN32)
+    if (!m_compress)
+        return;
+
+    FILE *src = fopen(path.c_str(), "rb");
+    if (src == NULL)
+        return;
+
+    bool ok = false;
+    gzFile dst = gzopen((path + ".gz").c_str(), "wb6");
+    if (dst != NULL)
+    {
+        char buf[16384];
+        size_t len;
+        ok = true;
+        while (ok && ((len = fread(buf, 1, sizeof(buf), src)) > 0))
+            ok = gzwrite(dst, buf, (unsigned int)len) == (int)len;
+        ok = (gzclose(dst) == Z_OK) && ok;
+    }
+    fclose(src);
+
+    if (ok)
+        remove(path.c_str());
+    else
+        remove((path + ".gz").c_str());
+#endif
+}
@@ -0,0 +1,132 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2024, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#define LOG_BUFFER_SIZE     65536   // Writers wait for the flusher when this much is pending
+
+// Receives a line written to a redirected stream, without the newline
+typedef std::function<void(const std::string &line)> LogSink;
+
+// Sends the lines written to std::cout/std::cerr to a sink
+class LogStreambuf : public std::streambuf
+{
+public:
+    LogStreambuf() {}
+    void sink(const LogSink &sink) { m_sink = sink; }
+
+protected:
+    int overflow(int c) override;
+
+private:
+    LogSink m_sink;
+    std::string m_line;
+    std::mutex m_mutex;
+};
+
+// Buffered logfile writer
+// Lines are collected in memory and written by a background thread, which keeps
+// the logfile of the day open. Urgent lines are written right away.
+// Files are rotated by date (<prefix>YYYYMMDD.log) and optionally by size
+// (<prefix>YYYYMMDD.<n>.log), rotated files can be gzip'ed
+class Logger
+{
+public:
+    Logger();
+    ~Logger();
+
+    void open(const std::string &dir, const std::string &prefix, unsigned long maxSize, bool compress);
+    bool isOpen() const { return m_thread.joinable(); }
+    void write(const std::string &line, bool urgent);
+    void flush(void);
+    void close(void);
+
+    // Send the lines written to std::cout and std::cerr to a sink, until close()
+    void redirect(const LogSink &out, const LogSink &err);
+
+    // Send everything written to stdout and stderr (printf, std::cout, ...) to a sink, until close()
+    // The lines are read from a pipe by another background thread
+    bool capture(const LogSink &sink);
+
+private:
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void flusher(void);
+    void reader(LogSink sink, int fd);
+    void release(void);
+    void writeFile(const std::string &data);
+    void closeFile(bool rotated);
+    void compress(const std::string &path);
+    void report(const std::string &msg);
+
+    std::string m_dir;
+    std::string m_prefix;
+    unsigned long m_maxSize;    // Bytes, 0=rotate by date only
+    bool m_compress;
+
+    // Owned by the flusher thread
+    FILE *m_file;
+    std::string m_filename;
+    unsigned long m_size;
+
+    std::string m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_flushed;
+    bool m_flushNow;
+    bool m_stop;
+    unsigned long long m_appended;  // Bytes passed to write()
+    unsigned long long m_written;   // Bytes written to the logfile
+    std::thread m_thread;
+
+    // redirect()
+    LogStreambuf m_out;
+    LogStreambuf m_err;
+    std::streambuf *m_coutbuf;
+    std::streambuf *m_cerrbuf;
+
+    // capture()
+    int m_stdout;               // Original stdout/stderr, -1 when not captured
+    int m_stderr;
+    std::thread m_reader;
+};
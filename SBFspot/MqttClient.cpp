@@ -0,0 +1,574 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "MqttClient.h"
+#include "misc.h"
+#include <chrono>
+#include <iostream>
+
+#if defined(_WIN32)
+#include <ws2tcpip.h>
+#define MSG_NOSIGNAL 0
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define closesocket ::close
+#endif
+
+extern int debug;
+extern int verbose;
+
+// MQTT control packet types
+enum
+{
+    MQTT_CONNECT    = 0x10,
+    MQTT_CONNACK    = 0x20,
+    MQTT_PUBLISH    = 0x30,
+    MQTT_PUBACK     = 0x40,
+    MQTT_SUBSCRIBE  = 0x82,
+    MQTT_SUBACK     = 0x90,
+    MQTT_PINGREQ    = 0xC0,
+    MQTT_PINGRESP   = 0xD0,
+    MQTT_DISCONNECT = 0xE0
+};
+
+// connect() that gives up after timeout milliseconds, instead of the TCP connect timeout of the system
+static bool connect_timeout(SOCKET sock, const struct sockaddr *addr, int addrlen, unsigned int timeout)
+{
+#if defined(_WIN32)
+    u_long nonblocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+#else
+    const int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+
+    bool connected = (::connect(sock, addr, addrlen) == 0);
+#if defined(_WIN32)
+    if (!connected && (WSAGetLastError() == WSAEWOULDBLOCK))
+#else
+    if (!connected && (errno == EINPROGRESS))
+#endif
+    {
+        // Writable when connected, or when the connection failed (Windows: exception)
+        fd_set writefds, exceptfds;
+        FD_ZERO(&writefds);
+        FD_ZERO(&exceptfds);
+        FD_SET(sock, &writefds);
+        FD_SET(sock, &exceptfds);
+
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        if ((select((int)sock + 1, NULL, &writefds, &exceptfds, &tv) > 0) && FD_ISSET(sock, &writefds))
+        {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            connected = (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == 0) && (error == 0);
+        }
+    }
+
+#if defined(_WIN32)
+    nonblocking = 0;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+#else
+    fcntl(sock, F_SETFL, flags);
+#endif
+
+    return connected;
+}
+
+static void put_length(std::string &buf, size_t len)
+{
+    do
+    {
+        uint8_t b = len & 0x7F;
+        len >>= 7;
+        if (len > 0) b |= 0x80;
+        buf += (char)b;
+    } while (len > 0);
+}
+
+static void put_uint16(std::string &buf, uint16_t val)
+{
+    buf += (char)(val >> 8);
+    buf += (char)(val & 0xFF);
+}
+
+static void put_string(std::string &buf, const std::string &str)
+{
+    put_uint16(buf, (uint16_t)str.length());
+    buf += str;
+}
+
+static long long now_ms(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+MqttClient::MqttClient()
+{
+#if defined(_WIN32)
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    m_socket = INVALID_MQTT_SOCKET;
+    m_port = "1883";
+    m_keepAlive = 60;
+    m_lastSent = 0;
+    m_connack = -1;
+    m_pingPending = false;
+    m_packetId = 0;
+}
+
+MqttClient::~MqttClient()
+{
+    disconnect();
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+}
+
+void MqttClient::setServer(const std::string &host, const std::string &port)
+{
+    m_host = host;
+    if (!port.empty())
+        m_port = port;
+}
+
+void MqttClient::setCredentials(const std::string &username, const std::string &password)
+{
+    m_username = username;
+    m_password = password;
+}
+
+int MqttClient::connect(void)
+{
+    if (isConnected())
+        return 0;
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &res);
+    if (rc != 0)
+    {
+        std::cout << "MQTT: Unable to resolve " << m_host << " (" << gai_strerror(rc) << ")" << std::endl;
+        return -1;
+    }
+
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        m_socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (m_socket == INVALID_MQTT_SOCKET)
+            continue;
+        if (connect_timeout(m_socket, ai->ai_addr, (int)ai->ai_addrlen, MQTT_TIMEOUT))
+            break;
+        closesocket(m_socket);
+        m_socket = INVALID_MQTT_SOCKET;
+    }
+    freeaddrinfo(res);
+
+    if (!isConnected())
+    {
+        std::cout << "MQTT: Unable to connect to " << m_host << ':' << m_port << std::endl;
+        return -1;
+    }
+
+    // Small packets, don't wait for more data
+    int nodelay = 1;
+    setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+
+    m_rxbuf.clear();
+    m_connack = -1;
+    m_pingPending = false;
+
+    uint8_t flags = 0x02;   // Clean session
+    if (!m_username.empty()) flags |= 0x80;
+    if (!m_password.empty()) flags |= 0x40;
+
+    std::string body;
+    put_string(body, "MQTT");
+    body += (char)4;        // Protocol level 3.1.1
+    body += (char)flags;
+    put_uint16(body, (uint16_t)m_keepAlive);
+    put_string(body, m_clientId);
+    if (!m_username.empty()) put_string(body, m_username);
+    if (!m_password.empty()) put_string(body, m_password);
+
+    m_packet.clear();
+    m_packet += (char)MQTT_CONNECT;
+    put_length(m_packet, body.length());
+    m_packet += body;
+
+    if (send(m_packet) != 0)
+        return -1;
+
+    const long long deadline = now_ms() + MQTT_TIMEOUT;
+    while (isConnected() && (m_connack < 0) && (now_ms() < deadline))
+        receive((unsigned int)(deadline - now_ms()));
+
+    if (m_connack != 0)
+    {
+        if (m_connack > 0)
+            std::cout << "MQTT: Connection refused by " << m_host << " (rc=" << m_connack << ")" << std::endl;
+        else
+            std::cout << "MQTT: No response from " << m_host << ':' << m_port << std::endl;
+        close();
+        return -1;
+    }
+
+    if (VERBOSE_HIGH) std::cout << "MQTT: Connected to " << m_host << ':' << m_port << " as " << m_clientId << std::endl;
+
+    // Clean session, subscriptions don't survive the connection
+    for (const auto &sub : m_subscriptions)
+    {
+        if (sendSubscribe(sub.first, sub.second) != 0)
+            return -1;
+    }
+
+    // Retransmit messages not acknowledged before the connection was lost
+    for (auto &msg : m_inflight)
+    {
+        msg.second[0] |= 0x08;  // DUP
+        if (send(msg.second) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int MqttClient::subscribe(const std::string &topic, int qos)
+{
+    qos = (qos > 0) ? 1 : 0;
+    m_subscriptions[topic] = qos;
+
+    // Sent by connect() when not connected yet
+    if (!isConnected())
+        return connect();
+
+    return sendSubscribe(topic, qos);
+}
+
+int MqttClient::sendSubscribe(const std::string &topic, int qos)
+{
+    if (++m_packetId == 0) m_packetId = 1;
+
+    std::string packet;
+    packet += (char)MQTT_SUBSCRIBE;
+    put_length(packet, 2 + 2 + topic.length() + 1);
+    put_uint16(packet, m_packetId);
+    put_string(packet, topic);
+    packet += (char)qos;
+
+    if (VERBOSE_HIGH) std::cout << "MQTT: Subscribing to " << topic << std::endl;
+
+    return send(packet);
+}
+
+bool MqttClient::message(std::string &topic, std::string &payload)
+{
+    if (m_received.empty())
+        return false;
+
+    topic.swap(m_received.front().first);
+    payload.swap(m_received.front().second);
+    m_received.pop_front();
+
+    return true;
+}
+
+// Waits for pending acknowledgements and closes the connection
+void MqttClient::disconnect(void)
+{
+    if (!isConnected())
+        return;
+
+    flush(MQTT_TIMEOUT);
+
+    if (isConnected())
+    {
+        m_packet.clear();
+        m_packet += (char)MQTT_DISCONNECT;
+        m_packet += (char)0;
+        send(m_packet);
+        close();
+    }
+}
+
+void MqttClient::close(void)
+{
+    if (m_socket != INVALID_MQTT_SOCKET)
+    {
+        closesocket(m_socket);
+        m_socket = INVALID_MQTT_SOCKET;
+    }
+}
+
+// QoS 2 is not supported, it's handled as QoS 1
+int MqttClient::publish(const std::string &topic, const std::string &payload, int qos, bool retain)
+{
+    // Pick up acknowledgements and detect a connection closed by the broker
+    if (isConnected())
+        loop(0);
+
+    if (!isConnected() && (connect() != 0))
+        return -1;
+
+    qos = (qos > 0) ? 1 : 0;
+
+    // Wait for room in the in-flight window
+    if (qos > 0)
+    {
+        const long long deadline = now_ms() + MQTT_TIMEOUT;
+        while (isConnected() && (m_inflight.size() >= MQTT_MAX_INFLIGHT) && (now_ms() < deadline))
+            receive((unsigned int)(deadline - now_ms()));
+
+        if (m_inflight.size() >= MQTT_MAX_INFLIGHT)
+        {
+            std::cout << "MQTT: No acknowledgement from " << m_host << std::endl;
+            close();
+            return -1;
+        }
+    }
+
+    m_packet.clear();
+    m_packet += (char)(MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0));
+    put_length(m_packet, 2 + topic.length() + (qos > 0 ? 2 : 0) + payload.length());
+    put_string(m_packet, topic);
+    if (qos > 0)
+    {
+        if (++m_packetId == 0) m_packetId = 1;
+        put_uint16(m_packet, m_packetId);
+    }
+    m_packet += payload;
+
+    if (qos > 0)
+    {
+        // Sent again by connect() when the connection fails before PUBACK
+        m_inflight[m_packetId] = m_packet;
+        if ((send(m_packet) != 0) && (connect() != 0))
+            return -1;
+    }
+    else if (send(m_packet) != 0)
+    {
+        // Retry once on a new connection
+        std::string packet(m_packet);
+        if ((connect() != 0) || (send(packet) != 0))
+            return -1;
+    }
+
+    return 0;
+}
+
+// Processes incoming packets for at most <timeout> milliseconds and keeps the connection alive
+int MqttClient::loop(unsigned int timeout)
+{
+    if (!isConnected())
+        return -1;
+
+    if (receive(timeout) < 0)
+        return -1;
+
+    if ((m_keepAlive > 0) && (time(NULL) - m_lastSent >= (time_t)m_keepAlive))
+    {
+        if (m_pingPending)
+        {
+            std::cout << "MQTT: Connection to " << m_host << " timed out" << std::endl;
+            close();
+            return -1;
+        }
+
+        m_packet.clear();
+        m_packet += (char)MQTT_PINGREQ;
+        m_packet += (char)0;
+        m_pingPending = true;
+        return send(m_packet);
+    }
+
+    return 0;
+}
+
+// Waits until all QoS 1 messages are acknowledged
+int MqttClient::flush(unsigned int timeout)
+{
+    const long long deadline = now_ms() + timeout;
+    while (isConnected() && !m_inflight.empty() && (now_ms() < deadline))
+        receive((unsigned int)(deadline - now_ms()));
+
+    return m_inflight.empty() ? 0 : -1;
+}
+
+int MqttClient::send(const std::string &packet)
+{
+    const char *data = packet.data();
+    size_t remaining = packet.length();
+
+    while (remaining > 0)
+    {
+        int sent = ::send(m_socket, data, (int)remaining, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            if (VERBOSE_NORMAL) std::cout << "MQTT: Connection to " << m_host << " lost" << std::endl;
+            close();
+            return -1;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+
+    m_lastSent = time(NULL);
+    return 0;
+}
+
+// Returns the number of packets handled, -1 when the connection is closed
+int MqttClient::receive(unsigned int timeout)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(m_socket, &readfds);
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    int rc = select((int)m_socket + 1, &readfds, NULL, NULL, &tv);
+    if (rc <= 0)
+        return rc;
+
+    char buf[1024];
+    int bytes_read = recv(m_socket, buf, sizeof(buf), 0);
+    if (bytes_read <= 0)
+    {
+        if (VERBOSE_NORMAL) std::cout << "MQTT: Connection closed by " << m_host << std::endl;
+        close();
+        return -1;
+    }
+
+    if (DEBUG_HIGHEST) HexDump((uint8_t *)buf, bytes_read, 10);
+
+    m_rxbuf.append(buf, bytes_read);
+
+    // Handle all complete packets
+    int packets = 0;
+    size_t pos = 0;
+    while (m_rxbuf.length() - pos >= 2)
+    {
+        const uint8_t *p = (const uint8_t *)m_rxbuf.data() + pos;
+        const size_t avail = m_rxbuf.length() - pos;
+
+        size_t length = 0, hdrlen = 1;
+        int shift = 0;
+        bool complete = false;
+        while (hdrlen < avail && hdrlen <= 4)
+        {
+            uint8_t b = p[hdrlen++];
+            length |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+            if ((b & 0x80) == 0)
+            {
+                complete = true;
+                break;
+            }
+        }
+
+        if (!complete || (avail < hdrlen + length))
+            break;
+
+        handle(p[0], p + hdrlen, length);
+        pos += hdrlen + length;
+        packets++;
+    }
+    m_rxbuf.erase(0, pos);
+
+    return packets;
+}
+
+void MqttClient::handle(uint8_t type, const uint8_t *body, size_t length)
+{
+    switch (type & 0xF0)
+    {
+    case MQTT_CONNACK:
+        if (length >= 2)
+            m_connack = body[1];
+        break;
+    case MQTT_PUBACK:
+        if (length >= 2)
+            m_inflight.erase((uint16_t)((body[0] << 8) | body[1]));
+        break;
+    case MQTT_PUBLISH:
+    {
+        // Topic, packet identifier (QoS 1 and 2) and payload
+        if (length < 2)
+            break;
+        const size_t topiclen = (body[0] << 8) | body[1];
+        const int qos = (type >> 1) & 0x03;
+        const size_t hdrlen = 2 + topiclen + (qos > 0 ? 2 : 0);
+        if (length < hdrlen)
+            break;
+
+        m_received.emplace_back(std::string((const char *)body + 2, topiclen), std::string((const char *)body + hdrlen, length - hdrlen));
+
+        // QoS 2 is not supported, acknowledged as QoS 1
+        if (qos > 0)
+        {
+            std::string puback;
+            puback += (char)MQTT_PUBACK;
+            puback += (char)2;
+            puback.append((const char *)body + 2 + topiclen, 2);
+            send(puback);
+        }
+        break;
+    }
+    case MQTT_SUBACK:
+        if ((length >= 3) && (body[2] == 0x80))
+            std::cout << "MQTT: Subscription refused by " << m_host << std::endl;
+        break;
+    case MQTT_PINGRESP:
+        m_pingPending = false;
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,109 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include "osselect.h"
+#include <deque>
+#include <map>
+#include <string>
+
+#if defined(_WIN32)
+#include <WinSock2.h>
+#endif
+
+#define MQTT_MAX_INFLIGHT   16      // Unacknowledged QoS 1 messages before publish() waits for the broker
+#define MQTT_TIMEOUT        5000    // Milliseconds to wait for the TCP connection, CONNACK and PUBACK
+
+// Minimal MQTT 3.1.1 client
+// Keeps a single TCP connection to the broker for the lifetime of the object,
+// reconnects on demand, retransmits unacknowledged QoS 1 messages and renews subscriptions
+// No TLS, use MQTT_Client=publisher (mosquitto_pub) for secured brokers
+class MqttClient
+{
+public:
+    MqttClient();
+    ~MqttClient();
+
+    void setServer(const std::string &host, const std::string &port);
+    void setCredentials(const std::string &username, const std::string &password);
+    void setClientId(const std::string &clientId) { m_clientId = clientId; }
+    void setKeepAlive(unsigned int keepAlive) { m_keepAlive = keepAlive; }
+
+    int connect(void);
+    void disconnect(void);
+    bool isConnected() const { return m_socket != INVALID_MQTT_SOCKET; }
+
+    int publish(const std::string &topic, const std::string &payload, int qos, bool retain);
+    int loop(unsigned int timeout);
+    int flush(unsigned int timeout);
+
+    // Messages on subscribed topics are kept until they are picked up by message()
+    int subscribe(const std::string &topic, int qos);
+    bool message(std::string &topic, std::string &payload);
+
+private:
+    MqttClient(const MqttClient&) = delete;
+    MqttClient& operator=(const MqttClient&) = delete;
+
+#if defined(_WIN32)
+    static const SOCKET INVALID_MQTT_SOCKET = INVALID_SOCKET;
+#else
+    static const SOCKET INVALID_MQTT_SOCKET = -1;
+#endif
+
+    int send(const std::string &packet);
+    int sendSubscribe(const std::string &topic, int qos);
+    int receive(unsigned int timeout);
+    void handle(uint8_t type, const uint8_t *body, size_t length);
+    void close(void);
+
+    SOCKET m_socket;
+    std::string m_host;
+    std::string m_port;
+    std::string m_clientId;
+    std::string m_username;
+    std::string m_password;
+    unsigned int m_keepAlive;   // Seconds
+    time_t m_lastSent;
+    int m_connack;              // CONNACK return code, -1=waiting
+    bool m_pingPending;
+
+    uint16_t m_packetId;
+    std::map<uint16_t, std::string> m_inflight;   // QoS 1 PUBLISH packets waiting for PUBACK
+    std::map<std::string, int> m_subscriptions;   // Topic filter, QoS
+    std::deque<std::pair<std::string, std::string>> m_received;
+    std::string m_packet;                         // Reused to build outgoing packets
+    std::string m_rxbuf;
+};
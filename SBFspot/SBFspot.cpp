@@ -67,6 +67,8 @@ DISCLAIMER:
 #include <boost/asio/ip/address.hpp>
 #include "mqtt.h"
 #include "mppt.h"
+#include "ExportQueue.h"
+#include "SpotDedup.h"
 
 int MAX_CommBuf = 0;
 int MAX_pcktBuf = 0;
@@ -79,7 +81,7 @@ char DateTimeFormat[32];
 char DateFormat[32];
 CONNECTIONTYPE ConnType = CT_NONE;
 TagDefs tagdefs = TagDefs();
-bool hasBatteryDevice = false; // Plant has 1 or more battery device(s)
+std::atomic<bool> hasBatteryDevice(false); // Plant has 1 or more battery device(s), read by the export workers
 
 //Free memory allocated by initialiseSMAConnection()
 void freemem(InverterData *inverters[])
@@ -1156,6 +1158,7 @@ int parseCmdline(int argc, char **argv, Config *cfg)
     cfg->settime = false;
     cfg->settime2 = false;
     cfg->mqtt = false;
+    cfg->listen = false;
     cfg->decode_file = false;
 
     bool help_requested = false;
@@ -1463,6 +1466,9 @@ int parseCmdline(int argc, char **argv, Config *cfg)
         else if (stricmp(argv[i], "-mqtt") == 0)
             cfg->mqtt = true;
 
+        else if (stricmp(argv[i], "-listen") == 0)
+            cfg->listen = true;
+
         //Show Help
         else if (stricmp(argv[i], "-?") == 0)
         {
@@ -1544,6 +1550,8 @@ void SayHello(int ShowHelp)
         std::cout << " -startdate:YYYYMMDD Set start date for historic data retrieval\n";
         std::cout << " -settime            Sync inverter time with host time\n";
         std::cout << " -mqtt               Publish spot data to MQTT broker\n";
+        std::cout << " -listen             Stay resident, poll every MQTT_PollInterval seconds\n";
+        std::cout << "                     and on request (MQTT_CommandTopic) - requires -mqtt\n";
         std::cout << " -version            Show SBFspot version number\n";
 
         std::cout << "\nLibraries used:\n";
@@ -1614,14 +1622,29 @@ int GetConfig(Config *cfg, bool isInclude)
         cfg->CSV_ExtendedHeader = true;
         cfg->CSV_Header = true;
         cfg->CSV_SaveZeroPower = true;
+        cfg->CSV_FlushInterval = 0;
         cfg->SunRSOffset = 900;
         cfg->SpotTimeSource = false;
         cfg->SpotWebboxHeader = false;
+        cfg->spotHeartbeat = 0;
         cfg->MIS_Enabled = false;
         strcpy(cfg->locale, "en-US");
         cfg->synchTimeLow = 1;
         cfg->synchTimeHigh = 3600;
         cfg->sqlPort = 3306;
+        cfg->sqlBatchSize = 5000;
+        cfg->sqlSpotPartitioning = 0;
+        cfg->sqlSpotRetention = 0;
+        cfg->sqlProfile = 0;
+        cfg->sqlBusyTimeout = 10000;
+        cfg->sqlCheckpoint = 1000;
+        cfg->exportQueueSize = 16;
+        cfg->exportQueueFullPolicy = QFP_BLOCK;
+        cfg->mqtt_builtin = true;
+        cfg->mqtt_heartbeat = 0;
+        cfg->mqtt_poll_interval = 300;
+        cfg->logMaxSize = 0;
+        cfg->logCompress = false;
         cfg->sunrise = 0;
         cfg->sunset = 0;
         cfg->isLight = false;
@@ -1718,6 +1741,30 @@ int GetConfig(Config *cfg, bool isInclude)
                     memset(cfg->outputPath_Events, 0, sizeof(cfg->outputPath_Events));
                     strncpy(cfg->outputPath_Events, value, sizeof(cfg->outputPath_Events) - 1);
                 }
+                else if (stricmp(key, "SpotArchivePath") == 0)
+                    cfg->spotArchivePath = value;
+                else if (stricmp(key, "SpotHeartbeat") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 60) && (*pEnd == 0))
+                        cfg->spotHeartbeat = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-60)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "SpotDeadbands") == 0)
+                {
+                    double deadband[SPD_COUNT];
+                    if (SpotDedup::parseDeadbands(value, deadband))
+                        cfg->spotDeadbands = value;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(Field:deadband,...)");
+                        rc = -2;
+                    }
+                }
                 else if(stricmp(key, "Latitude") == 0)
                     cfg->latitude = (float)atof(value);
                 else if(stricmp(key, "Longitude") == 0)
@@ -1808,6 +1855,29 @@ int GetConfig(Config *cfg, bool isInclude)
                         rc = -2;
                     }
                 }
+                else if(stricmp(key, "Export_QueueSize") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 1000) && (*pEnd == 0))
+                        cfg->exportQueueSize = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-1000)");
+                        rc = -2;
+                    }
+                }
+                else if(stricmp(key, "Export_QueueFullPolicy") == 0)
+                {
+                    if (stricmp(value, "block") == 0)
+                        cfg->exportQueueFullPolicy = QFP_BLOCK;
+                    else if (stricmp(value, "drop") == 0)
+                        cfg->exportQueueFullPolicy = QFP_DROP;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(block|drop)");
+                        rc = -2;
+                    }
+                }
                 else if(stricmp(key, "CSV_Export") == 0)
                 {
                     lValue = strtol(value, &pEnd, 10);
@@ -1852,6 +1922,17 @@ int GetConfig(Config *cfg, bool isInclude)
                         rc = -2;
                     }
                 }
+                else if(stricmp(key, "CSV_FlushInterval") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 3600) && (*pEnd == 0))
+                        cfg->CSV_FlushInterval = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-3600)");
+                        rc = -2;
+                    }
+                }
                 else if(stricmp(key, "SunRSOffset") == 0)
                 {
                     lValue = strtol(value, &pEnd, 10);
@@ -1972,7 +2053,93 @@ int GetConfig(Config *cfg, bool isInclude)
                             rc = -2;
                             break;
                         }
+                else if (stricmp(key, "SQL_Spool") == 0)
+                    cfg->sqlSpoolFile = value;
+                else if (stricmp(key, "SQL_BatchSize") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 1) && (lValue <= 100000) && (*pEnd == 0))
+                        cfg->sqlBatchSize = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(1-100000)");
+                        rc = -2;
+                    }
+                }
+#endif
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+                else if (stricmp(key, "SQL_SpotPartitioning") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if (((lValue == 0) || (lValue == 1)) && (*pEnd == 0))
+                        cfg->sqlSpotPartitioning = (int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, CFG_Boolean);
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "SQL_SpotRetention") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 1200) && (*pEnd == 0))
+                        cfg->sqlSpotRetention = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-1200)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "SQL_NotifySocket") == 0)
+                    cfg->sqlNotifySocket = value;
+#endif
+#if defined(USE_SQLITE)
+                else if (stricmp(key, "SQL_Profile") == 0)
+                {
+                    SQLPROFILE profile;
+                    if (db_SQL_Base::parse_profile(value, profile))
+                        cfg->sqlProfile = profile;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(default|flash|durable)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "SQL_BusyTimeout") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 600000) && (*pEnd == 0))
+                        cfg->sqlBusyTimeout = (int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-600000)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "SQL_Checkpoint") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 100000) && (*pEnd == 0))
+                        cfg->sqlCheckpoint = (int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-100000)");
+                        rc = -2;
+                    }
+                }
 #endif
+                else if (stricmp(key, "MQTT_Client") == 0)
+                {
+                    if (stricmp(value, "builtin") == 0)
+                        cfg->mqtt_builtin = true;
+                    else if (stricmp(value, "publisher") == 0)
+                        cfg->mqtt_builtin = false;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(builtin|publisher)");
+                        rc = -2;
+                    }
+                }
                 else if (stricmp(key, "MQTT_Host") == 0)
                     cfg->mqtt_host = value;
                 else if (stricmp(key, "MQTT_Port") == 0)
@@ -2003,6 +2170,67 @@ int GetConfig(Config *cfg, bool isInclude)
                         rc = -2;
                     }
                 }
+                else if (stricmp(key, "MQTT_FieldTopic") == 0)
+                    cfg->mqtt_field_topic = value;
+                else if (stricmp(key, "MQTT_Heartbeat") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 86400) && (*pEnd == 0))
+                        cfg->mqtt_heartbeat = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-86400)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "MQTT_CommandTopic") == 0)
+                    cfg->mqtt_command_topic = value;
+                else if (stricmp(key, "MQTT_PollInterval") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 86400) && (*pEnd == 0))
+                        cfg->mqtt_poll_interval = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-86400)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "LogPath") == 0)
+                    cfg->logPath = value;
+                else if (stricmp(key, "LogMaxSize") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if ((lValue >= 0) && (lValue <= 1000) && (*pEnd == 0))
+                        cfg->logMaxSize = (unsigned int)lValue;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(0-1000)");
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "LogCompress") == 0)
+                {
+                    lValue = strtol(value, &pEnd, 10);
+                    if (((lValue == 0) || (lValue == 1)) && (*pEnd == 0))
+                        cfg->logCompress = (lValue == 1);
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, CFG_Boolean);
+                        rc = -2;
+                    }
+                }
+                else if (stricmp(key, "MQTT_Deadbands") == 0)
+                {
+                    std::map<std::string, std::pair<double, bool>> deadbands;
+                    if (MqttExport::parseDeadbands(value, deadbands))
+                        cfg->mqtt_deadbands = value;
+                    else
+                    {
+                        fprintf(stdout, CFG_InvalidValue, key, "(Key:deadband[%],...)");
+                        rc = -2;
+                    }
+                }
 
                 // Include another config file with common settings
                 else if (stricmp(key, "Include") == 0)
@@ -2067,6 +2295,18 @@ int GetConfig(Config *cfg, bool isInclude)
             rc = -2;
         }
 
+        if (!cfg->mqtt_field_topic.empty() && !cfg->mqtt_builtin)
+        {
+            fprintf(stdout, "'MQTT_FieldTopic' requires MQTT_Client=builtin.\n");
+            rc = -2;
+        }
+
+        if (cfg->listen && (!cfg->mqtt || !cfg->mqtt_builtin || cfg->mqtt_command_topic.empty()))
+        {
+            fprintf(stdout, "-listen requires -mqtt, MQTT_Client=builtin and MQTT_CommandTopic.\n");
+            rc = -2;
+        }
+
         if (rc == 0)
         {
             if (strlen(cfg->plantname) == 0)
@@ -2140,6 +2380,9 @@ void ShowConfig(Config *cfg)
         "\nPlantname=" << cfg->plantname << \
         "\nOutputPath=" << cfg->outputPath << \
         "\nOutputPathEvents=" << cfg->outputPath_Events << \
+        "\nSpotArchivePath=" << cfg->spotArchivePath << \
+        "\nSpotHeartbeat=" << cfg->spotHeartbeat << \
+        "\nSpotDeadbands=" << cfg->spotDeadbands << \
         "\nLatitude=" << cfg->latitude << \
         "\nLongitude=" << cfg->longitude << \
         "\nTimezone=" << cfg->timezone << \
@@ -2160,28 +2403,56 @@ void ShowConfig(Config *cfg)
         "\nCSV_Header=" << cfg->CSV_Header << \
         "\nCSV_SaveZeroPower=" << cfg->CSV_SaveZeroPower << \
         "\nCSV_Spot_TimeSource=" << cfg->SpotTimeSource << \
-        "\nCSV_Spot_WebboxHeader=" << cfg->SpotWebboxHeader;
+        "\nCSV_Spot_WebboxHeader=" << cfg->SpotWebboxHeader << \
+        "\nCSV_FlushInterval=" << cfg->CSV_FlushInterval << \
+        "\nExport_QueueSize=" << cfg->exportQueueSize << \
+        "\nExport_QueueFullPolicy=" << (cfg->exportQueueFullPolicy == QFP_DROP ? "drop" : "block");
 
 #if defined(USE_MYSQL) || defined(USE_SQLITE)
-    std::cout << "\nSQL_Database=" << cfg->sqlDatabase;
+    std::cout << "\nSQL_Database=" << cfg->sqlDatabase << \
+        "\nSQL_SpotPartitioning=" << cfg->sqlSpotPartitioning << \
+        "\nSQL_SpotRetention=" << cfg->sqlSpotRetention << \
+        "\nSQL_NotifySocket=" << cfg->sqlNotifySocket;
+#endif
+
+#if defined(USE_SQLITE)
+    const char *profiles[] = { "default", "flash", "durable" };
+    std::cout << "\nSQL_Profile=" << profiles[cfg->sqlProfile] << \
+        "\nSQL_BusyTimeout=" << cfg->sqlBusyTimeout << \
+        "\nSQL_Checkpoint=" << cfg->sqlCheckpoint;
 #endif
 
 #if defined(USE_MYSQL)
     std::cout << "\nSQL_Hostname=" << cfg->sqlHostname << \
         "\nSQL_Port=" << cfg->sqlPort << \
         "\nSQL_Username=" << cfg->sqlUsername << \
-        "\nSQL_Password=<undisclosed>";
+        "\nSQL_Password=<undisclosed>" << \
+        "\nSQL_BatchSize=" << cfg->sqlBatchSize << \
+        "\nSQL_Spool=" << cfg->sqlSpoolFile;
 #endif
 
     if (cfg->mqtt)
     {
-        std::cout << "\nMQTT_Host=" << cfg->mqtt_host << \
+        std::cout << "\nMQTT_Client=" << (cfg->mqtt_builtin ? "builtin" : "publisher") << \
+            "\nMQTT_Host=" << cfg->mqtt_host << \
             "\nMQTT_Port=" << cfg->mqtt_port << \
             "\nMQTT_Topic=" << cfg->mqtt_topic << \
             "\nMQTT_Publisher=" << cfg->mqtt_publish_exe << \
             "\nMQTT_PublisherArgs=" << cfg->mqtt_publish_args << \
             "\nMQTT_Data=" << cfg->mqtt_publish_data << \
-            "\nMQTT_ItemFormat=" << cfg->mqtt_item_format;
+            "\nMQTT_ItemFormat=" << cfg->mqtt_item_format << \
+            "\nMQTT_FieldTopic=" << cfg->mqtt_field_topic << \
+            "\nMQTT_Heartbeat=" << cfg->mqtt_heartbeat << \
+            "\nMQTT_Deadbands=" << cfg->mqtt_deadbands << \
+            "\nMQTT_CommandTopic=" << cfg->mqtt_command_topic << \
+            "\nMQTT_PollInterval=" << cfg->mqtt_poll_interval;
+    }
+
+    if (cfg->listen)
+    {
+        std::cout << "\nLogPath=" << cfg->logPath << \
+            "\nLogMaxSize=" << cfg->logMaxSize << \
+            "\nLogCompress=" << cfg->logCompress;
     }
 
     std::cout << "\nEnd of Config\n" << std::endl;
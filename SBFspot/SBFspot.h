@@ -42,6 +42,7 @@ DISCLAIMER:
 #include "Types.h"
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include "boost_ext.h"
 #include "boost/date_time/posix_time/posix_time.hpp"
@@ -130,4 +131,4 @@ extern TagDefs tagdefs;
 
 extern char DateTimeFormat[32];
 extern char DateFormat[32];
-extern bool hasBatteryDevice;
+extern std::atomic<bool> hasBatteryDevice;
@@ -0,0 +1,756 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "SpotArchive.h"
+#include "SBFspot.h"
+#include "misc.h"
+#include "mppt.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+/*
+ * Block layout (little endian)
+ *  0  "SPA1"
+ *  4  uint16 number of samples
+ *  6  uint16 number of columns
+ *  8  int64  first timestamp
+ * 16  int64  last timestamp
+ * 24  uint32 size of each stream, timestamps first
+ *     streams
+ *
+ * Timestamps and counters are stored as delta-of-delta, measurements as
+ * the XOR of the previous value (Gorilla) and status codes run-length encoded
+ */
+static const char SPA_MAGIC[] = "SPA1";
+static const size_t SPA_HEADER = 24;
+static const size_t SPA_STREAMS = SPC_COUNT + 1;
+
+enum SPACODEC
+{
+    SPA_XOR,
+    SPA_DOD,
+    SPA_RLE
+};
+
+static SPACODEC column_codec(int column)
+{
+    if (column >= SPC_DeviceStatus)
+        return SPA_RLE;
+    if (column >= SPC_EToday)
+        return SPA_DOD;
+    return SPA_XOR;
+}
+
+static void put_le(std::vector<uint8_t> &buf, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        buf.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static uint64_t get_le(const uint8_t *buf, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)buf[i] << (8 * i);
+    return value;
+}
+
+static int leading_zeros(uint64_t x)
+{
+    int n = 0;
+    for (uint64_t mask = 1ULL << 63; mask && !(x & mask); mask >>= 1)
+        n++;
+    return n;
+}
+
+static int trailing_zeros(uint64_t x)
+{
+    int n = 0;
+    for (; n < 64 && !(x & 1); x >>= 1)
+        n++;
+    return n;
+}
+
+static uint64_t double_bits(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static double bits_double(uint64_t bits)
+{
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+class BitWriter
+{
+public:
+    // Append the lowest count bits, most significant first
+    void write(uint64_t bits, int count)
+    {
+        while (count > 0)
+        {
+            if (m_free == 0)
+            {
+                m_data.push_back(0);
+                m_free = 8;
+            }
+            const int n = std::min(count, m_free);
+            m_data.back() |= (uint8_t)(((bits >> (count - n)) & ((1U << n) - 1)) << (m_free - n));
+            m_free -= n;
+            count -= n;
+        }
+    }
+
+    void varint(uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            write((value & 0x7F) | 0x80, 8);
+        write(value, 8);
+    }
+
+    const std::vector<uint8_t> &data() const { return m_data; }
+
+private:
+    std::vector<uint8_t> m_data;
+    int m_free = 0;
+};
+
+class BitReader
+{
+public:
+    BitReader(const uint8_t *data, size_t size) : m_data(data), m_bits(size * 8) {}
+
+    uint64_t read(int count)
+    {
+        uint64_t bits = 0;
+        while (count > 0)
+        {
+            if (m_pos >= m_bits)
+            {
+                m_overrun = true;
+                return 0;
+            }
+            const int used = m_pos % 8;
+            const int n = std::min(count, 8 - used);
+            bits = (bits << n) | ((m_data[m_pos / 8] >> (8 - used - n)) & ((1U << n) - 1));
+            m_pos += n;
+            count -= n;
+        }
+        return bits;
+    }
+
+    uint64_t varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            const uint64_t byte = read(8);
+            value |= (byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        return value;
+    }
+
+    bool overrun() const { return m_overrun; }
+
+private:
+    const uint8_t *m_data;
+    const size_t m_bits;
+    size_t m_pos = 0;
+    bool m_overrun = false;
+};
+
+// Delta-of-delta buckets: 0 | 10+7 bits | 110+9 bits | 1110+12 bits | 1111+64 bits
+static void encode_dod(BitWriter &out, const std::vector<int64_t> &values)
+{
+    int64_t delta = 0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        if (i == 0)
+        {
+            out.write((uint64_t)values[0], 64);
+            continue;
+        }
+
+        const uint64_t dod = zigzag((values[i] - values[i-1]) - delta);
+        delta = values[i] - values[i-1];
+
+        if (dod == 0)
+            out.write(0, 1);
+        else if (dod < (1 << 7))
+        {
+            out.write(0x2, 2);
+            out.write(dod, 7);
+        }
+        else if (dod < (1 << 9))
+        {
+            out.write(0x6, 3);
+            out.write(dod, 9);
+        }
+        else if (dod < (1 << 12))
+        {
+            out.write(0xE, 4);
+            out.write(dod, 12);
+        }
+        else
+        {
+            out.write(0xF, 4);
+            out.write(dod, 64);
+        }
+    }
+}
+
+static void decode_dod(BitReader &in, std::vector<int64_t> &values, size_t count)
+{
+    int64_t delta = 0;
+    for (size_t i = 0; (i < count) && !in.overrun(); i++)
+    {
+        if (i == 0)
+        {
+            values.push_back((int64_t)in.read(64));
+            continue;
+        }
+
+        int prefix = 0;
+        while ((prefix < 4) && in.read(1))
+            prefix++;
+
+        static const int width[] = { 0, 7, 9, 12, 64 };
+        delta += unzigzag(in.read(width[prefix]));
+        values.push_back(values.back() + delta);
+    }
+}
+
+// Gorilla XOR: 0 (same value) | 10+bits within previous window | 11+5 bits leading+6 bits length+bits
+static void encode_xor(BitWriter &out, const std::vector<double> &values)
+{
+    uint64_t prev = 0;
+    int leading = -1, trailing = 0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        const uint64_t bits = double_bits(values[i]);
+        if (i == 0)
+        {
+            out.write(bits, 64);
+            prev = bits;
+            continue;
+        }
+
+        const uint64_t x = bits ^ prev;
+        prev = bits;
+
+        if (x == 0)
+        {
+            out.write(0, 1);
+            continue;
+        }
+
+        const int lz = std::min(leading_zeros(x), 31);
+        const int tz = trailing_zeros(x);
+        if ((leading >= 0) && (lz >= leading) && (tz >= trailing))
+        {
+            out.write(0x2, 2);
+            out.write(x >> trailing, 64 - leading - trailing);
+        }
+        else
+        {
+            leading = lz;
+            trailing = tz;
+            const int length = 64 - lz - tz;
+            out.write(0x3, 2);
+            out.write(lz, 5);
+            out.write(length & 0x3F, 6);
+            out.write(x >> tz, length);
+        }
+    }
+}
+
+static void decode_xor(BitReader &in, std::vector<double> &values, size_t count)
+{
+    uint64_t prev = 0;
+    int leading = 0, trailing = 0;
+    for (size_t i = 0; (i < count) && !in.overrun(); i++)
+    {
+        if (i == 0)
+            prev = in.read(64);
+        else if (in.read(1))
+        {
+            if (in.read(1))
+            {
+                leading = (int)in.read(5);
+                const int length = (int)in.read(6);
+                trailing = 64 - leading - (length == 0 ? 64 : length);
+            }
+            prev ^= in.read(64 - leading - trailing) << trailing;
+        }
+
+        values.push_back(bits_double(prev));
+    }
+}
+
+// Runs of (value, length)
+static void encode_rle(BitWriter &out, const std::vector<int64_t> &values)
+{
+    for (size_t i = 0; i < values.size();)
+    {
+        size_t run = 1;
+        while ((i + run < values.size()) && (values[i + run] == values[i]))
+            run++;
+
+        out.varint(zigzag(values[i]));
+        out.varint(run);
+        i += run;
+    }
+}
+
+static void decode_rle(BitReader &in, std::vector<int64_t> &values, size_t count)
+{
+    while ((values.size() < count) && !in.overrun())
+    {
+        const int64_t value = unzigzag(in.varint());
+        const uint64_t run = in.varint();
+        for (uint64_t i = 0; (i < run) && (values.size() < count); i++)
+            values.push_back(value);
+    }
+}
+
+static std::vector<uint8_t> encode_block(const std::vector<SpotSample> &samples)
+{
+    std::vector<BitWriter> streams(SPA_STREAMS);
+
+    std::vector<int64_t> timestamps;
+    for (const auto &sample : samples)
+        timestamps.push_back((int64_t)sample.TimeStamp);
+    encode_dod(streams[0], timestamps);
+
+    for (int col = 0; col < SPC_COUNT; col++)
+    {
+        std::vector<double> values;
+        std::vector<int64_t> integers;
+        for (const auto &sample : samples)
+        {
+            values.push_back(sample.value[col]);
+            integers.push_back((int64_t)sample.value[col]);
+        }
+
+        switch (column_codec(col))
+        {
+        case SPA_XOR: encode_xor(streams[col + 1], values); break;
+        case SPA_DOD: encode_dod(streams[col + 1], integers); break;
+        case SPA_RLE: encode_rle(streams[col + 1], integers); break;
+        }
+    }
+
+    std::vector<uint8_t> block(SPA_MAGIC, SPA_MAGIC + 4);
+    put_le(block, samples.size(), 2);
+    put_le(block, SPC_COUNT, 2);
+    put_le(block, (uint64_t)samples.front().TimeStamp, 8);
+    put_le(block, (uint64_t)samples.back().TimeStamp, 8);
+    for (const auto &stream : streams)
+        put_le(block, stream.data().size(), 4);
+    for (const auto &stream : streams)
+        block.insert(block.end(), stream.data().begin(), stream.data().end());
+
+    return block;
+}
+
+struct BlockInfo
+{
+    long offset;
+    size_t size;
+    size_t count;
+    time_t first;
+    time_t last;
+};
+
+// Read and validate the header of the block at the current file position
+static bool read_block_info(FILE *fp, long filesize, BlockInfo &info)
+{
+    uint8_t header[SPA_HEADER + 4 * SPA_STREAMS];
+
+    info.offset = ftell(fp);
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header))
+        return false;
+
+    if ((memcmp(header, SPA_MAGIC, 4) != 0) || (get_le(header + 6, 2) != SPC_COUNT))
+        return false;
+
+    info.count = (size_t)get_le(header + 4, 2);
+    info.first = (time_t)get_le(header + 8, 8);
+    info.last = (time_t)get_le(header + 16, 8);
+    info.size = sizeof(header);
+    for (size_t i = 0; i < SPA_STREAMS; i++)
+        info.size += (size_t)get_le(header + SPA_HEADER + 4 * i, 4);
+
+    return (info.count > 0) && (info.offset + (long)info.size <= filesize) && (fseek(fp, info.offset + (long)info.size, SEEK_SET) == 0);
+}
+
+static bool read_block(FILE *fp, const BlockInfo &info, std::vector<SpotSample> &samples)
+{
+    std::vector<uint8_t> block(info.size);
+    if ((fseek(fp, info.offset, SEEK_SET) != 0) || (fread(block.data(), 1, block.size(), fp) != block.size()))
+        return false;
+
+    const uint8_t *stream = block.data() + SPA_HEADER + 4 * SPA_STREAMS;
+    const size_t first = samples.size();
+    samples.resize(first + info.count);
+
+    for (size_t s = 0; s < SPA_STREAMS; s++)
+    {
+        const size_t size = (size_t)get_le(block.data() + SPA_HEADER + 4 * s, 4);
+        BitReader in(stream, size);
+        std::vector<int64_t> integers;
+        std::vector<double> values;
+
+        if (s == 0)
+            decode_dod(in, integers, info.count);
+        else
+        {
+            switch (column_codec((int)s - 1))
+            {
+            case SPA_XOR: decode_xor(in, values, info.count); break;
+            case SPA_DOD: decode_dod(in, integers, info.count); break;
+            case SPA_RLE: decode_rle(in, integers, info.count); break;
+            }
+        }
+
+        if (in.overrun() || (integers.size() + values.size() != info.count))
+        {
+            samples.resize(first);
+            return false;
+        }
+
+        for (size_t i = 0; i < info.count; i++)
+        {
+            if (s == 0)
+                samples[first + i].TimeStamp = (time_t)integers[i];
+            else
+                samples[first + i].value[s - 1] = values.empty() ? (double)integers[i] : values[i];
+        }
+
+        stream += size;
+    }
+
+    return true;
+}
+
+// Valid blocks of a file, end is the offset after the last one
+// Returns false when the file doesn't exist
+static bool scan_blocks(const std::string &filename, std::vector<BlockInfo> &blocks, long &end)
+{
+    end = 0;
+
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL)
+        return false;
+
+    fseek(fp, 0, SEEK_END);
+    const long filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    BlockInfo info = {};
+    while (read_block_info(fp, filesize, info))
+    {
+        blocks.push_back(info);
+        end = info.offset + (long)info.size;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+// Add the samples with from <= TimeStamp < to and TimeStamp > after
+// Only blocks overlapping the range are decoded. Returns the timestamp of the last sample in the file
+static time_t read_file(const std::string &filename, time_t from, time_t to, time_t after, std::vector<SpotSample> &samples)
+{
+    time_t last = 0;
+
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == NULL)
+        return last;
+
+    fseek(fp, 0, SEEK_END);
+    const long filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    BlockInfo info = {};
+    std::vector<SpotSample> block;
+    while (read_block_info(fp, filesize, info))
+    {
+        last = std::max(last, info.last);
+
+        if ((info.last >= from) && (info.first < to) && (info.last > after))
+        {
+            block.clear();
+            if (!read_block(fp, info, block))
+                break;
+
+            for (const auto &sample : block)
+            {
+                if ((sample.TimeStamp >= from) && (sample.TimeStamp < to) && (sample.TimeStamp > after))
+                    samples.push_back(sample);
+            }
+
+            fseek(fp, info.offset + (long)info.size, SEEK_SET);
+        }
+    }
+
+    fclose(fp);
+    return last;
+}
+
+SpotSample::SpotSample(const InverterData *inv, time_t timestamp) : TimeStamp(timestamp), value()
+{
+    const auto mpp1 = inv->mpp.find(1);
+    const auto mpp2 = inv->mpp.find(2);
+    const mppt dc1 = (mpp1 != inv->mpp.end()) ? mpp1->second : mppt();
+    const mppt dc2 = (mpp2 != inv->mpp.end()) ? mpp2->second : mppt();
+
+    value[SPC_Pdc1] = dc1.Pdc();
+    value[SPC_Pdc2] = dc2.Pdc();
+    value[SPC_Idc1] = dc1.Idc();
+    value[SPC_Idc2] = dc2.Idc();
+    value[SPC_Udc1] = dc1.Udc();
+    value[SPC_Udc2] = dc2.Udc();
+    value[SPC_Pac1] = inv->Pac1;
+    value[SPC_Pac2] = inv->Pac2;
+    value[SPC_Pac3] = inv->Pac3;
+    value[SPC_Iac1] = inv->Iac1;
+    value[SPC_Iac2] = inv->Iac2;
+    value[SPC_Iac3] = inv->Iac3;
+    value[SPC_Uac1] = inv->Uac1;
+    value[SPC_Uac2] = inv->Uac2;
+    value[SPC_Uac3] = inv->Uac3;
+    value[SPC_GridFreq] = inv->GridFreq;
+    value[SPC_BT_Signal] = inv->BT_Signal;
+    value[SPC_Temperature] = inv->Temperature;
+    value[SPC_EToday] = (double)inv->EToday;
+    value[SPC_ETotal] = (double)inv->ETotal;
+    value[SPC_OperationTime] = (double)inv->OperationTime;
+    value[SPC_FeedInTime] = (double)inv->FeedInTime;
+    value[SPC_DeviceStatus] = inv->DeviceStatus;
+    value[SPC_GridRelayStatus] = inv->GridRelayStatus;
+}
+
+SpotArchive::SpotArchive(const std::string &path) : m_path(path)
+{
+}
+
+std::string SpotArchive::day_file(uint32_t serial, time_t timestamp) const
+{
+    return m_path + FOLDER_SEP + std::to_string(serial) + FOLDER_SEP + strftime_t("%Y%m%d", timestamp) + SPA_EXTENSION;
+}
+
+int SpotArchive::append(uint32_t serial, const SpotSample &sample)
+{
+    char msg[80 + MAX_PATH];
+    const std::string filename = day_file(serial, sample.TimeStamp);
+    const std::string openname = filename + SPA_OPEN_EXTENSION;
+
+    std::vector<BlockInfo> sealed, open;
+    long sealedend = 0, openend = 0;
+    scan_blocks(filename, sealed, sealedend);
+    scan_blocks(openname, open, openend);
+
+    // The open file only counts for the samples after the sealed ones
+    const time_t lastsealed = sealed.empty() ? 0 : sealed.back().last;
+    size_t opencount = 0;
+    time_t last = lastsealed;
+    for (const auto &info : open)
+    {
+        if (info.last > lastsealed)
+        {
+            opencount += info.count;
+            last = std::max(last, info.last);
+        }
+    }
+
+    // Samples are stored in time order only
+    if (sample.TimeStamp <= last)
+        return 0;
+
+    if (opencount + 1 >= SPA_BLOCK_SAMPLES)
+        return seal(filename, &sample);
+
+    if (opencount == 0)
+    {
+        // First sample of a day: the last block of the previous day is complete
+        struct tm day;
+        localtime_s(&day, &sample.TimeStamp);
+        day.tm_hour = 12;
+        day.tm_min = day.tm_sec = 0;
+        day.tm_mday--;
+        day.tm_isdst = -1;
+        const std::string previous = day_file(serial, mktime(&day));
+        std::vector<BlockInfo> previousopen;
+        long previousend = 0;
+        if (sealed.empty() && scan_blocks(previous + SPA_OPEN_EXTENSION, previousopen, previousend))
+            seal(previous, NULL);
+
+        // The open file of a block that was sealed starts over
+        openend = 0;
+    }
+
+    // An interrupted write leaves an incomplete block at the end, which is overwritten
+    FILE *fp = fopen(openname.c_str(), openend > 0 ? "r+b" : "w+b");
+    if (fp == NULL)
+    {
+        CreatePath((m_path + FOLDER_SEP + std::to_string(serial)).c_str());
+        fp = fopen(openname.c_str(), "w+b");
+    }
+
+    if (fp == NULL)
+    {
+        snprintf(msg, sizeof(msg), "Unable to open archive file %s\n", openname.c_str());
+        print_error(stdout, PROC_ERROR, msg);
+        return -1;
+    }
+
+    int rc = 0;
+    const std::vector<uint8_t> block = encode_block(std::vector<SpotSample>(1, sample));
+    if ((fseek(fp, openend, SEEK_SET) != 0) || (fwrite(block.data(), 1, block.size(), fp) != block.size()))
+        rc = -1;
+    if (fclose(fp) != 0)
+        rc = -1;
+
+    if (rc != 0)
+    {
+        snprintf(msg, sizeof(msg), "Unable to write archive file %s\n", openname.c_str());
+        print_error(stdout, PROC_ERROR, msg);
+    }
+
+    return rc;
+}
+
+// Store the samples of the open file (and the new sample) as one block of the day file
+// The open file is removed afterwards; until then, a reader ignores its samples that were sealed
+int SpotArchive::seal(const std::string &filename, const SpotSample *sample)
+{
+    char msg[80 + MAX_PATH];
+    const std::string openname = filename + SPA_OPEN_EXTENSION;
+
+    std::vector<BlockInfo> sealed;
+    long sealedend = 0;
+    scan_blocks(filename, sealed, sealedend);
+
+    std::vector<SpotSample> samples;
+    read_file(openname, 0, std::numeric_limits<time_t>::max(), sealed.empty() ? 0 : sealed.back().last, samples);
+    if (sample != NULL)
+        samples.push_back(*sample);
+
+    int rc = 0;
+
+    if (!samples.empty())
+    {
+        const std::vector<uint8_t> block = encode_block(samples);
+
+        FILE *fp = fopen(filename.c_str(), sealedend > 0 ? "r+b" : "w+b");
+        if (fp == NULL)
+            rc = -1;
+        else
+        {
+            if ((fseek(fp, sealedend, SEEK_SET) != 0) || (fwrite(block.data(), 1, block.size(), fp) != block.size()))
+                rc = -1;
+            if (fclose(fp) != 0)
+                rc = -1;
+        }
+
+        if (rc != 0)
+        {
+            snprintf(msg, sizeof(msg), "Unable to write archive file %s\n", filename.c_str());
+            print_error(stdout, PROC_ERROR, msg);
+            return rc;
+        }
+    }
+
+    remove(openname.c_str());
+
+    return rc;
+}
+
+int SpotArchive::append(InverterData *const inverters[], time_t timestamp)
+{
+    int rc = 0;
+    for (uint32_t i = 0; inverters[i] != NULL && i < MAX_INVERTERS; i++)
+    {
+        if (append(inverters[i]->Serial, SpotSample(inverters[i], timestamp)) != 0)
+            rc = -1;
+    }
+
+    return rc;
+}
+
+int SpotArchive::read(uint32_t serial, time_t from, time_t to, std::vector<SpotSample> &samples) const
+{
+    if (to <= from)
+        return 0;
+
+    // Walk the days at noon, avoiding DST transitions
+    struct tm day;
+    localtime_s(&day, &from);
+    day.tm_hour = 12;
+    day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+
+    const std::string lastfile = day_file(serial, to - 1);
+    for (std::string filename = day_file(serial, mktime(&day));; filename = day_file(serial, mktime(&day)))
+    {
+        // The open file holds the samples after the sealed ones
+        const time_t lastsealed = read_file(filename, from, to, 0, samples);
+        read_file(filename + SPA_OPEN_EXTENSION, from, to, lastsealed, samples);
+
+        if (filename == lastfile)
+            break;
+
+        day.tm_mday++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include "osselect.h"
+#include "Types.h"
+#include <string>
+#include <vector>
+
+// Compressed columnar archive of spot data
+// One file per inverter and day: <SpotArchive_Path>/<serial>/<YYYYMMDD>.spa
+// A file is a sequence of blocks of SPA_BLOCK_SAMPLES samples (the last block of a day may be smaller)
+// New samples are appended to <YYYYMMDD>.spa.open, a block per sample, until they fill a block
+// Stored data is never rewritten, so an interrupted write can only lose the sample being written
+#define SPA_BLOCK_SAMPLES   256
+#define SPA_EXTENSION       ".spa"
+#define SPA_OPEN_EXTENSION  ".open"
+
+// Archived columns, in the units of InverterData (e.g. Uac in 1/100 V)
+enum SPOTCOLUMN
+{
+    SPC_Pdc1 = 0,
+    SPC_Pdc2,
+    SPC_Idc1,
+    SPC_Idc2,
+    SPC_Udc1,
+    SPC_Udc2,
+    SPC_Pac1,
+    SPC_Pac2,
+    SPC_Pac3,
+    SPC_Iac1,
+    SPC_Iac2,
+    SPC_Iac3,
+    SPC_Uac1,
+    SPC_Uac2,
+    SPC_Uac3,
+    SPC_GridFreq,
+    SPC_BT_Signal,
+    SPC_Temperature,
+    SPC_EToday,
+    SPC_ETotal,
+    SPC_OperationTime,
+    SPC_FeedInTime,
+    SPC_DeviceStatus,
+    SPC_GridRelayStatus,
+    SPC_COUNT
+};
+
+struct SpotSample
+{
+    time_t TimeStamp;
+    double value[SPC_COUNT];
+
+    SpotSample() : TimeStamp(0), value() {}
+    SpotSample(const InverterData *inv, time_t timestamp);
+};
+
+class SpotArchive
+{
+public:
+    explicit SpotArchive(const std::string &path);
+
+    // Add the sample of an inverter to the file of its day
+    int append(uint32_t serial, const SpotSample &sample);
+    int append(InverterData *const inverters[], time_t timestamp);
+
+    // All samples of an inverter with from <= TimeStamp < to, in time order
+    int read(uint32_t serial, time_t from, time_t to, std::vector<SpotSample> &samples) const;
+
+private:
+    std::string day_file(uint32_t serial, time_t timestamp) const;
+    int seal(const std::string &filename, const SpotSample *sample);
+
+    const std::string m_path;
+};
@@ -0,0 +1,255 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "SpotDedup.h"
+#include "SBFspot.h"
+#include "misc.h"
+#include "mppt.h"
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+struct DeadbandField
+{
+    const char *name;
+    double scale;       // Raw InverterData units per unit of the deadband
+    int column;         // First column of the field
+    int count;          // Number of mppt/phases
+};
+
+static const DeadbandField DeadbandFields[] =
+{
+    { "Pdc", 1, SPC_Pdc1, 2 },
+    { "Idc", 1000, SPC_Idc1, 2 },
+    { "Udc", 100, SPC_Udc1, 2 },
+    { "Pac", 1, SPC_Pac1, 3 },
+    { "Iac", 1000, SPC_Iac1, 3 },
+    { "Uac", 100, SPC_Uac1, 3 },
+    { "Frequency", 100, SPC_GridFreq, 1 },
+    { "BT_Signal", 1, SPC_BT_Signal, 1 },
+    { "Temperature", 100, SPC_Temperature, 1 },
+    { "OperatingTime", 3600, SPC_OperationTime, 1 },
+    { "FeedInTime", 3600, SPC_FeedInTime, 1 },
+    { "BatCharge", 1, SPD_BatChaStt, 1 },
+    { "BatTemperature", 10, SPD_BatTmpVal, 1 },
+    { "BatVoltage", 100, SPD_BatVol, 1 },
+    { "BatCurrent", 1000, SPD_BatAmp, 1 },
+    { "GridPower", 1, SPD_MeteringGridMsTotWOut, 2 }
+};
+
+SpotDedup::SpotDedup(const Config &config)
+    : m_config(config)
+    , m_heartbeat((time_t)config.spotHeartbeat * 60)
+{
+    // Energy counters and status codes are always compared, without deadband
+    for (int col = 0; col < SPD_COUNT; col++)
+        m_deadband[col] = -1;
+    m_deadband[SPC_EToday] = 0;
+    m_deadband[SPC_ETotal] = 0;
+    m_deadband[SPC_DeviceStatus] = 0;
+    m_deadband[SPC_GridRelayStatus] = 0;
+
+    // Battery and metering values are stored with the spot data, compare them for any change
+    for (int col = SPC_COUNT; col < SPD_COUNT; col++)
+        m_deadband[col] = 0;
+
+    parseDeadbands(SPOT_DEADBANDS, m_deadband);
+    parseDeadbands(config.spotDeadbands, m_deadband);
+}
+
+bool SpotDedup::parseDeadbands(const std::string &list, double deadband[SPD_COUNT])
+{
+    std::istringstream items(list);
+    for (std::string item; std::getline(items, item, ',');)
+    {
+        const size_t sep = item.find(':');
+        if (sep == std::string::npos)
+            return false;
+
+        const std::string name = item.substr(0, sep);
+        const std::string value = item.substr(sep + 1);
+        char *pEnd = NULL;
+        const double band = strtod(value.c_str(), &pEnd);
+        if (value.empty() || (*pEnd != 0))
+            return false;
+
+        bool found = false;
+        for (const auto &field : DeadbandFields)
+        {
+            if (stricmp(name.c_str(), field.name) == 0)
+            {
+                for (int col = field.column; col < field.column + field.count; col++)
+                    deadband[col] = (band < 0) ? -1 : band * field.scale;
+                found = true;
+            }
+        }
+
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
+
+bool SpotDedup::store(InverterData *const inverters[], time_t spottime)
+{
+    if (!enabled())
+        return true;
+
+    // The state starts over when the expanded OutputPath changes
+    const std::string file = stateFile(spottime);
+    if (file != m_loaded)
+        load(file);
+
+    bool changed = false;
+    for (uint32_t i = 0; inverters[i] != NULL && i < MAX_INVERTERS && !changed; i++)
+    {
+        const auto last = m_last.find(inverters[i]->Serial);
+        if ((last == m_last.end()) || (spottime < last->second.TimeStamp) || (spottime - last->second.TimeStamp >= m_heartbeat))
+            changed = true;
+        else
+        {
+            std::vector<double> value;
+            values(inverters[i], spottime, value);
+
+            // A tracker was added or removed
+            changed = (value.size() != last->second.value.size());
+            for (size_t col = 0; col < value.size() && !changed; col++)
+                changed = (deadband(col) >= 0) && (fabs(value[col] - last->second.value[col]) > deadband(col));
+        }
+    }
+
+    if (changed)
+    {
+        for (uint32_t i = 0; inverters[i] != NULL && i < MAX_INVERTERS; i++)
+        {
+            Stored &last = m_last[inverters[i]->Serial];
+            last.TimeStamp = spottime;
+            values(inverters[i], spottime, last.value);
+        }
+
+        save(file);
+    }
+    else if (VERBOSE_NORMAL)
+        puts("Spot data unchanged, not stored");
+
+    return changed;
+}
+
+// All values stored by the spot data exports:
+// the archived columns, battery and metering, then Pdc, Idc and Udc of the trackers after the second one
+void SpotDedup::values(const InverterData *inv, time_t spottime, std::vector<double> &value)
+{
+    const SpotSample sample(inv, spottime);
+    value.assign(sample.value, sample.value + SPC_COUNT);
+    value.push_back(inv->BatChaStt);
+    value.push_back(inv->BatTmpVal);
+    value.push_back(inv->BatVol);
+    value.push_back(inv->BatAmp);
+    value.push_back(inv->MeteringGridMsTotWOut);
+    value.push_back(inv->MeteringGridMsTotWIn);
+
+    for (const auto &mpp : inv->mpp)
+    {
+        if (mpp.first > 2)
+        {
+            value.push_back(mpp.second.Pdc());
+            value.push_back(mpp.second.Idc());
+            value.push_back(mpp.second.Udc());
+        }
+    }
+}
+
+// Trackers after the second one use the Pdc, Idc and Udc deadbands
+double SpotDedup::deadband(size_t column) const
+{
+    if (column < SPD_COUNT)
+        return m_deadband[column];
+
+    static const int mppcolumn[] = { SPC_Pdc1, SPC_Idc1, SPC_Udc1 };
+    return m_deadband[mppcolumn[(column - SPD_COUNT) % 3]];
+}
+
+std::string SpotDedup::stateFile(time_t spottime) const
+{
+    return strftime_t(m_config.outputPath, spottime) + FOLDER_SEP + m_config.plantname + "-Spot.state";
+}
+
+// One line per inverter: serial, timestamp, number of values and the values of the last stored poll
+// An unreadable line leaves the inverter without state, so its next poll is stored
+void SpotDedup::load(const std::string &file)
+{
+    m_last.clear();
+    m_loaded = file;
+
+    std::ifstream state(file);
+    for (std::string line; std::getline(state, line);)
+    {
+        std::istringstream fields(line);
+        uint32_t serial;
+        Stored last;
+        size_t count;
+        if (!(fields >> serial >> last.TimeStamp >> count) || (count < SPD_COUNT))
+            continue;
+
+        last.value.resize(count);
+        for (size_t col = 0; col < count && fields; col++)
+            fields >> last.value[col];
+
+        if (fields)
+            m_last[serial] = last;
+    }
+}
+
+void SpotDedup::save(const std::string &file) const
+{
+    CreatePath(strftime_t(m_config.outputPath, m_last.begin()->second.TimeStamp).c_str());
+
+    std::ofstream state(file, std::ios::trunc);
+    state.precision(17);
+    for (const auto &last : m_last)
+    {
+        state << last.first << ' ' << last.second.TimeStamp << ' ' << last.second.value.size();
+        for (const double value : last.second.value)
+            state << ' ' << value;
+        state << '\n';
+    }
+
+    if (!state)
+    {
+        char msg[80 + MAX_PATH];
+        snprintf(msg, sizeof(msg), "Unable to write %s\n", file.c_str());
+        print_error(stdout, PROC_WARNING, msg);
+    }
+}
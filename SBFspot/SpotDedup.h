@@ -0,0 +1,95 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include "SpotArchive.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// Default deadbands, in the units of the CSV export
+#define SPOT_DEADBANDS  "Pac:0,Pdc:0,Udc:5,Idc:0.1,Uac:2,Iac:0.1,Frequency:0.05,Temperature:1"
+
+// Compared values that are not archived: battery and grid metering
+// The values of the trackers after the second one follow (Pdc, Idc and Udc of each tracker)
+enum SPOTDEDUPCOLUMN
+{
+    SPD_BatChaStt = SPC_COUNT,
+    SPD_BatTmpVal,
+    SPD_BatVol,
+    SPD_BatAmp,
+    SPD_MeteringGridMsTotWOut,
+    SPD_MeteringGridMsTotWIn,
+    SPD_COUNT
+};
+
+// Write-on-change filter for spot data
+// A poll is stored when a value of any inverter moved beyond its deadband,
+// when a status or energy counter changed, or when the heartbeat expired.
+// All spot data exports (SpotData, SpotDataX, battery and CSV) follow this decision,
+// so every value they store is compared.
+// The last stored values are kept in <OutputPath>/<Plantname>-Spot.state, with the date specifiers
+// of OutputPath expanded: the state (and the first poll stored) only starts over when that path changes
+class SpotDedup
+{
+public:
+    explicit SpotDedup(const Config &config);
+
+    // Parse "Field:deadband,..." into deadbands per column
+    // Columns that are not compared get a negative deadband
+    static bool parseDeadbands(const std::string &list, double deadband[SPD_COUNT]);
+
+    bool enabled() const { return m_heartbeat > 0; }
+    bool store(InverterData *const inverters[], time_t spottime);
+
+private:
+    struct Stored
+    {
+        time_t TimeStamp;
+        std::vector<double> value;
+    };
+
+    static void values(const InverterData *inv, time_t spottime, std::vector<double> &value);
+    double deadband(size_t column) const;
+    std::string stateFile(time_t spottime) const;
+    void load(const std::string &file);
+    void save(const std::string &file) const;
+
+    const Config &m_config;
+    const time_t m_heartbeat;
+    double m_deadband[SPD_COUNT];
+    std::map<uint32_t, Stored> m_last;
+    std::string m_loaded;
+};
@@ -79,12 +79,23 @@ struct Config
     char    decimalpoint;           //CSV decimal point
     char    outputPath[MAX_PATH];
     char    outputPath_Events[MAX_PATH];
+    std::string spotArchivePath;    // Compressed spot data archive, empty=disabled (default)
+    unsigned int spotHeartbeat;     // Store unchanged spot data every N minutes, 0=store every poll (default)
+    std::string spotDeadbands;      // Per field changes ignored by SpotHeartbeat, e.g. "Uac:2,Pac:5"
     char    plantname[32];
     std::string sqlDatabase;
     std::string sqlHostname;
     std::string sqlUsername;
     std::string sqlUserPassword;
     unsigned int sqlPort;
+    unsigned int sqlBatchSize;      // Max number of rows per INSERT statement (MySQL only)
+    std::string sqlSpoolFile;       // Spool for data that couldn't be stored when the db is down (MySQL only)
+    int     sqlSpotPartitioning;    // 1=Partition SpotData by time (MySQL: month, SQLite: year) (default=0)
+    unsigned int sqlSpotRetention;  // Months of SpotData to keep, 0=keep forever (default=0)
+    std::string sqlNotifySocket;    // Socket of SBFspotUploadDaemon, notified when DayData is stored (default=empty)
+    int     sqlProfile;             // Performance profile (SQLite only)
+    int     sqlBusyTimeout;         // Max time (ms) to wait for a lock (SQLite only)
+    int     sqlCheckpoint;          // WAL pages that trigger a checkpoint, 0=leave to SBFspotUploadDaemon (SQLite only)
     int     synchTime;              // 1=Synch inverter time with computer time (default=0)
     float   sunrise;
     float   sunset;
@@ -97,6 +108,7 @@ struct Config
     bool    CSV_Header;
     bool    CSV_ExtendedHeader;
     bool    CSV_SaveZeroPower;
+    unsigned int CSV_FlushInterval; // Seconds between writes of buffered spot CSV data (0=each export)
     int     SunRSOffset;            // Offset to start before sunrise and end after sunset
     int     userGroup;              // USER|INSTALLER
     char    prgVersion[16];         // SBFspot Version
@@ -108,8 +120,11 @@ struct Config
     boost::local_time::time_zone_ptr tz;
     int     synchTimeLow;           // settime low limit
     int     synchTimeHigh;          // settime high limit
+    unsigned int exportQueueSize;   // Max number of pending exports per sink (0=synchronous export)
+    int     exportQueueFullPolicy;  // QFP_BLOCK|QFP_DROP
 
                                     // MQTT Stuff -- Using mosquitto (https://mosquitto.org/)
+    bool    mqtt_builtin;           // MQTT_Client=builtin (default) or publisher (mosquitto_pub)
     std::string mqtt_publish_exe;   // default /usr/bin/mosquitto_pub ("%ProgramFiles%\mosquitto\mosquitto_pub.exe" on Windows)
     std::string mqtt_host;          // default localhost
     std::string mqtt_port;          // default 1883 (8883 for MQTT over TLS)
@@ -118,6 +133,14 @@ struct Config
     std::string mqtt_publish_data;  // comma delimited list of spot data to publish (Timestamp,Serial,MeteringDyWhOut,GridMsTotW,...)
     std::string mqtt_item_format;   // default "{key}": {value}
     std::string mqtt_item_delimiter;// default comma
+    std::string mqtt_field_topic;   // one retained topic per value (sbfspot/{serial}/{key}), default empty (one message per inverter)
+    unsigned int mqtt_heartbeat;    // 0 (default): publish each poll - else only publish changes, and unchanged values after mqtt_heartbeat seconds
+    std::string mqtt_deadbands;     // comma delimited list of Key:deadband[%] (PACTot:10,UDC:2%)
+    std::string mqtt_command_topic; // -listen: topic for on-demand polls, results on {topic}/result
+    unsigned int mqtt_poll_interval;// -listen: seconds between regular polls (0=commands only), default 300
+    std::string logPath;            // -listen: folder of the logfiles, empty=console (default)
+    unsigned int logMaxSize;        // -listen: rotate the daily logfile above N MB, 0=no limit (default)
+    bool    logCompress;            // -listen: gzip rotated logfiles (Linux only)
 
     std::string decode_path;        // undocumented
 
@@ -138,6 +161,7 @@ struct Config
     bool    settime;                // -settime     Set plant time
     bool    settime2;               // -settime2    Set plant time of V2.1.0 as mentioned in #442 (Failed to get current plant time)
     bool    mqtt;                   // -mqtt        Publish spot data to mqtt broker
+    bool    listen;                 // -listen      Stay resident, poll every MQTT_PollInterval and on MQTT commands
     bool    decode_file;            // -decode      Undocumented
 };
 
@@ -0,0 +1,142 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "UploadNotify.h"
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool socket_address(const std::string &path, struct sockaddr_un &addr)
+{
+    if (path.empty() || (path.length() >= sizeof(addr.sun_path)))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+#endif
+
+UploadNotifier::UploadNotifier()
+{
+    m_socket = -1;
+}
+
+UploadNotifier::~UploadNotifier()
+{
+#if !defined(_WIN32)
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        unlink(m_path.c_str());
+    }
+#endif
+}
+
+// Called by SBFspot
+// Never blocks, when the daemon isn't listening the datagram is lost
+void UploadNotifier::notify(const std::string &path)
+{
+#if !defined(_WIN32)
+    struct sockaddr_un addr;
+    if (!socket_address(path, addr))
+        return;
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd >= 0)
+    {
+        sendto(fd, "DayData", 7, MSG_DONTWAIT, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+    }
+#endif
+}
+
+// Called by the daemon
+bool UploadNotifier::listen(const std::string &path)
+{
+#if !defined(_WIN32)
+    struct sockaddr_un addr;
+    if ((m_socket >= 0) || !socket_address(path, addr))
+        return false;
+
+    // Remove the socket of a previous run
+    unlink(path.c_str());
+
+    if ((m_socket = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+        return false;
+
+    if (bind(m_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    // SBFspot may run as another user
+    chmod(path.c_str(), 0666);
+    m_path = path;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Sleep until notified or timeout (seconds) elapsed, also returns when interrupted by a signal
+// Returns true when notified
+bool UploadNotifier::wait(unsigned int timeout)
+{
+#if !defined(_WIN32)
+    struct pollfd pfd;
+    pfd.fd = m_socket;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, timeout * 1000) <= 0)
+        return false;
+
+    // Several writes are handled by a single run
+    char buf[64];
+    while (recv(m_socket, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+
+    return true;
+#else
+    return false;
+#endif
+}
@@ -37,6 +37,10 @@ DISCLAIMER:
 #include "db_MySQL.h"
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <type_traits>
+
+// my_bool (MariaDB, MySQL 5.x) or bool (MySQL 8)
+typedef std::remove_pointer<decltype(MYSQL_BIND::is_null)>::type sql_bool;
 
 std::string db_SQL_Base::status_text(int status)
 {
@@ -83,6 +87,11 @@ int db_SQL_Base::open(const std::string server, const std::string user, const st
             print_error("Can't open MySQL db [" + m_database + "]");
             m_dbHandle = NULL;
         }
+        else
+        {
+            m_txlevel = 0;
+            m_commits = 0;
+        }
     }
 
     return result;
@@ -92,8 +101,15 @@ int db_SQL_Base::close(void)
 {
     int result = SQL_OK;
 
+    if (m_archdaydata)
+    {
+        mysql_stmt_close(m_archdaydata);
+        m_archdaydata = NULL;
+    }
+
     mysql_close(m_dbHandle);
     m_dbHandle = NULL;
+    m_txlevel = 0;
 
     return result;
 }
@@ -123,6 +139,80 @@ int db_SQL_Base::exec_query_multi(const std::string &qry, bool free_results)
     return result;
 }
 
+// Start a (nested) transaction
+// The outermost level starts a transaction, inner levels are mapped to savepoints
+// This allows a caller to group several exports in a single unit of work (one commit)
+// while the exports keep their own transaction handling
+int db_SQL_Base::begin_transaction(void)
+{
+    int rc = SQL_OK;
+
+    if (!m_dbHandle)
+        return SQL_ERROR; // Not connected
+
+    if (m_txlevel == 0)
+        rc = exec_query("START TRANSACTION");
+    else
+        rc = exec_query("SAVEPOINT sp" + std::to_string(m_txlevel));
+
+    if (rc == SQL_OK)
+        m_txlevel++;
+    else
+        print_error("begin_transaction() failed");
+
+    return rc;
+}
+
+int db_SQL_Base::commit_transaction(void)
+{
+    int rc = SQL_OK;
+
+    if (m_txlevel == 0)
+        return SQL_ERROR; // No transaction active
+
+    if (--m_txlevel == 0)
+    {
+        if ((rc = exec_query("COMMIT")) == SQL_OK)
+            m_commits++;
+        else
+        {
+            print_error("Commit failed. Rolling back now...");
+            exec_query("ROLLBACK");
+        }
+    }
+    else
+        rc = exec_query("RELEASE SAVEPOINT sp" + std::to_string(m_txlevel));
+
+    return rc;
+}
+
+int db_SQL_Base::rollback_transaction(void)
+{
+    int rc = SQL_OK;
+
+    if (m_txlevel == 0)
+        return SQL_ERROR; // No transaction active
+
+    if (--m_txlevel == 0)
+        rc = exec_query("ROLLBACK");
+    else
+    {
+        // Undo the changes since the savepoint and remove it from the transaction stack
+        const std::string sp = "sp" + std::to_string(m_txlevel);
+        if ((rc = exec_query("ROLLBACK TO SAVEPOINT " + sp)) == SQL_OK)
+            rc = exec_query("RELEASE SAVEPOINT " + sp);
+    }
+
+    return rc;
+}
+
+std::string db_SQL_Base::write_stats(void) const
+{
+    std::ostringstream stats;
+    stats << m_commits << " commit" << (m_commits == 1 ? "" : "s");
+    return stats.str();
+}
+
 int db_SQL_Base::type_label(InverterData *inverters[])
 {
     std::stringstream sql;
@@ -192,64 +282,122 @@ int db_SQL_Base::device_status(InverterData *inverters[], time_t spottime)
 
 int db_SQL_Base::batch_get_archdaydata(std::string &data, unsigned int Serial, int datelimit, int statuslimit, int& recordcount)
 {
-    std::stringstream sql;
     int rc = SQL_OK;
     recordcount = 0;
 
-    sql << "SELECT DATE_FORMAT(Timestamp,'%Y%m%d,%H:%i'),V1,V2,V3,V4,V5,V6,V7,V8,V9,V10,V11,V12 FROM vwPvoData "
-        "WHERE TimeStamp>NOW()-INTERVAL " << datelimit - 1 << " DAY "
+    // PvoStaging is filled by SBFspot when the DayData is stored
+    // Un-uploaded rows of a device are read from the PvoStaging_Upload index
+    // The statement is prepared once per connection
+    const char *sql = "SELECT DATE_FORMAT(FROM_UNIXTIME(TimeStamp),'%Y%m%d,%H:%i'),V1,V2,V3,V4,V5,V6,V7,V8,V9,V10,V11,V12 FROM PvoStaging "
+        "WHERE TimeStamp>UNIX_TIMESTAMP(NOW()-INTERVAL ? DAY) "
         "AND PVoutput IS NULL "
-        "AND Serial=" << Serial << " "
+        "AND Serial=? "
         "ORDER BY TimeStamp "
-        "LIMIT " << statuslimit;
+        "LIMIT ?";
 
-    rc = mysql_query(m_dbHandle, sql.str().c_str());
+    if (m_archdaydata == NULL)
+    {
+        if (((m_archdaydata = mysql_stmt_init(m_dbHandle)) == NULL) || (mysql_stmt_prepare(m_archdaydata, sql, strlen(sql)) != 0))
+        {
+            print_error("mysql_stmt_prepare() returned", sql);
+            if (m_archdaydata)
+            {
+                mysql_stmt_close(m_archdaydata);
+                m_archdaydata = NULL;
+            }
+            return SQL_ERROR;
+        }
+    }
 
-    if (rc == SQL_OK)
+    int days = datelimit - 1;
+    MYSQL_BIND param[3];
+    memset(param, 0, sizeof(param));
+    param[0].buffer_type = MYSQL_TYPE_LONG;
+    param[0].buffer = &days;
+    param[1].buffer_type = MYSQL_TYPE_LONG;
+    param[1].buffer = &Serial;
+    param[1].is_unsigned = 1;
+    param[2].buffer_type = MYSQL_TYPE_LONG;
+    param[2].buffer = &statuslimit;
+
+    // All columns are fetched as text, like mysql_fetch_row() does
+    char value[13][32];
+    unsigned long length[13];
+    sql_bool isnull[13];
+    MYSQL_BIND col[13];
+    memset(col, 0, sizeof(col));
+    for (int Vx = 0; Vx <= 12; Vx++)
     {
-        std::stringstream result;
-        MYSQL_RES *sqlResult = mysql_store_result(m_dbHandle);
-        MYSQL_ROW sqlRow = mysql_fetch_row(sqlResult);
+        col[Vx].buffer_type = MYSQL_TYPE_STRING;
+        col[Vx].buffer = value[Vx];
+        col[Vx].buffer_length = sizeof(value[Vx]);
+        col[Vx].length = &length[Vx];
+        col[Vx].is_null = &isnull[Vx];
+    }
 
-        while (sqlRow)
-        {
-            result.str("");
+    if ((mysql_stmt_bind_param(m_archdaydata, param) != 0) || (mysql_stmt_execute(m_archdaydata) != 0) || (mysql_stmt_bind_result(m_archdaydata, col) != 0))
+    {
+        print_error("mysql_stmt_execute() returned", sql);
+        return SQL_ERROR;
+    }
 
-            // from 2nd record, add a record separator
-            if (!data.empty()) result << ";";
+    // Rows are formatted straight into data, trailing empty values are left out
+    data.reserve(data.length() + statuslimit * PVO_BATCH_ROWSIZE);
+    while (mysql_stmt_fetch(m_archdaydata) == 0)
+    {
+        // from 2nd record, add a record separator
+        if (!data.empty()) data += ';';
 
-            // Date
-            result << sqlRow[0];
+        // Date
+        data.append(value[0], length[0]);
 
-            // Energy Generation, Power Generation, Energy Consumption, Power Consumption, Temperature, Voltage and Extended values
-            for (int Vx = 1; Vx <= 12; Vx++)
+        // Energy Generation, Power Generation, Energy Consumption, Power Consumption, Temperature, Voltage and Extended values
+        size_t end = data.length();
+        for (int Vx = 1; Vx <= 12; Vx++)
+        {
+            data += ',';
+            if (!isnull[Vx])
             {
-                result << ",";
-                if (sqlRow[Vx] != NULL)
-                    result << sqlRow[Vx];
+                data.append(value[Vx], length[Vx]);
+                end = data.length();
             }
+        }
+        data.resize(end);
 
-            const std::string& str = result.str();
-            int end = str.length();
+        recordcount++;
+    }
 
-            for (std::string::const_reverse_iterator it = str.rbegin(); it != str.rend(); ++it, end--)
-            {
-                if ((*it) != ',')
-                    break;
-            }
+    mysql_stmt_free_result(m_archdaydata);
 
-            data.append(result.str().substr(0, end));
-            recordcount++;
+    return rc;
+}
 
-            //Get next record
-            sqlRow = mysql_fetch_row(sqlResult);
+// Number of datapoints of a device waiting to be uploaded,
+// and the number that's too old to be uploaded (outside the datelimit window)
+int db_SQL_Base::batch_get_backlog(unsigned int Serial, int datelimit, int &count, int &expired)
+{
+    std::stringstream sql;
+    int rc = SQL_OK;
+    count = 0;
+    expired = 0;
+
+    sql << "SELECT IFNULL(SUM(TimeStamp>UNIX_TIMESTAMP(NOW()-INTERVAL " << datelimit - 1 << " DAY)),0),COUNT(*) FROM PvoStaging "
+        "WHERE PVoutput IS NULL "
+        "AND Serial=" << Serial;
+
+    if ((rc = mysql_query(m_dbHandle, sql.str().c_str())) == SQL_OK)
+    {
+        MYSQL_RES *sqlResult = mysql_store_result(m_dbHandle);
+        MYSQL_ROW sqlRow = sqlResult ? mysql_fetch_row(sqlResult) : NULL;
+
+        if (sqlRow && sqlRow[0] && sqlRow[1])
+        {
+            count = atoi(sqlRow[0]);
+            expired = atoi(sqlRow[1]) - count;
         }
 
         if (sqlResult)
-        {
             mysql_free_result(sqlResult);
-            sqlResult = NULL;
-        }
     }
     else
         print_error("mysql_query() returned", sql.str());
@@ -257,44 +405,67 @@ int db_SQL_Base::batch_get_archdaydata(std::string &data, unsigned int Serial, i
     return rc;
 }
 
-int db_SQL_Base::batch_set_pvoflag(const std::string &data, unsigned int Serial)
+// flagged: number of DayData rows accepted by PVOutput
+int db_SQL_Base::batch_set_pvoflag(const std::string &data, unsigned int Serial, int &flagged)
 {
-    std::stringstream sql;
     int rc = SQL_OK;
+    flagged = 0;
+
+    // Items of the response are YYYYMMDD,HH:MM,<0|1>
+    // The local date/time of the accepted items (1) is converted to unix time,
+    // so the rows are found by primary key
+    std::string timestamps;
+    timestamps.reserve(data.length() / 16 * 56);
+    for (size_t pos = 0; pos < data.length(); )
+    {
+        size_t next = data.find(';', pos);
+        if (next == std::string::npos) next = data.length();
 
-    std::vector<std::string> items;
-    boost::split(items, data, boost::is_any_of(";"));
+        if ((next - pos == 16) && (data[pos + 15] == '1'))
+        {
+            if (!timestamps.empty())
+                timestamps += ',';
+            timestamps += "UNIX_TIMESTAMP(STR_TO_DATE('";
+            timestamps.append(data, pos, 14);
+            timestamps += "','%Y%m%d,%H:%i'))";
+        }
+
+        pos = next + 1;
+    }
 
-    exec_query("START TRANSACTION");
+    if (timestamps.empty())
+        return rc;
 
-    sql << "UPDATE DayData "
-        "SET PVoutput=1 "
-        "WHERE Serial=" << Serial << " "
-        "AND DATE_FORMAT(FROM_UNIXTIME(Timestamp),'%Y%m%d,%H:%i') "
-        "IN (";
+    const bool tx = (begin_transaction() == SQL_OK);
 
-    bool firstitem = true;
-    for (const auto &item : items)
+    std::string sql;
+    for (const char *table : { "PvoStaging", "DayData" })
     {
-        if ((item.size() == 16) && (item.back() == '1'))
+        sql = "UPDATE ";
+        sql += table;
+        sql += " SET PVoutput=1 WHERE Serial=" + std::to_string(Serial) + " AND TimeStamp IN (" + timestamps + ")";
+
+        if ((rc = exec_query(sql)) != SQL_OK)
         {
-            if (!firstitem)
-                sql << ",";
-            else
-                firstitem = false;
-            sql << s_quoted(item.substr(0, 14));
+            print_error("exec_query() returned", sql);
+            break;
         }
     }
 
-    sql << ")";
+    // Rows of DayData changed by the last statement
+    if (rc == SQL_OK)
+        flagged = (int)mysql_affected_rows(m_dbHandle);
 
-    if ((rc = exec_query(sql.str())) != SQL_OK)
+    if (tx)
     {
-        print_error("exec_query() returned", sql.str());
-        exec_query("ROLLBACK");
+        if (rc == SQL_OK)
+            commit_transaction();
+        else
+        {
+            rollback_transaction();
+            flagged = 0;
+        }
     }
-    else
-        exec_query("COMMIT");
 
     return rc;
 }
@@ -52,8 +52,10 @@ extern int verbose;
 #define SQL_BATCH_DATELIMIT		"Batch_DateLimit"
 #define SQL_BATCH_STATUSLIMIT	"Batch_StatusLimit"
 
+#define PVO_BATCH_ROWSIZE       64      // Typical length of a row formatted by batch_get_archdaydata()
+
 #define SQL_MINIMUM_SCHEMA_VERSION 1
-#define SQL_RECOMMENDED_SCHEMA_VERSION 1
+#define SQL_RECOMMENDED_SCHEMA_VERSION 3
 
 class db_SQL_Base
 {
@@ -70,20 +72,30 @@ private:
 protected:
     MYSQL *m_dbHandle;
     std::string m_database;
+    int m_txlevel;              // Transaction nesting level (0=autocommit)
+    unsigned int m_commits;     // Number of committed transactions since open()
+    MYSQL_STMT *m_archdaydata;  // Prepared by batch_get_archdaydata(), closed by close()
 
 public:
-    db_SQL_Base() { m_dbHandle = NULL; }
+    db_SQL_Base() { m_dbHandle = NULL; m_txlevel = 0; m_commits = 0; m_archdaydata = NULL; }
     ~db_SQL_Base() { if (m_dbHandle) close(); }
     int open(const std::string server, const std::string user, const std::string pass, const std::string database, const unsigned int port);
     int close(void);
     int exec_query(const std::string &qry);
     int exec_query_multi(const std::string &qry, bool free_results = true);
+    int begin_transaction(void);
+    int commit_transaction(void);
+    int rollback_transaction(void);
+    bool in_transaction(void) const { return m_txlevel > 0; }
+    std::string write_stats(void) const;
     std::string errortext(void) const { return m_errortext; }
     bool isopen(void) { return (m_dbHandle != NULL); }
+    int ping(void) { return ((m_dbHandle != NULL) && (mysql_ping(m_dbHandle) == 0)) ? SQL_OK : SQL_ERROR; }
     int type_label(InverterData *inverters[]);
     int device_status(InverterData *inverters[], time_t spottime);
     int batch_get_archdaydata(std::string &data, unsigned int Serial, int datelimit, int statuslimit, int& recordcount);
-    int batch_set_pvoflag(const std::string &data, unsigned int Serial);
+    int batch_set_pvoflag(const std::string &data, unsigned int Serial, int &flagged);
+    int batch_get_backlog(unsigned int Serial, int datelimit, int &count, int &expired);
     int set_config(const std::string key, const std::string value);
     int get_config(const std::string key, std::string &value);
     int get_config(const std::string key, int &value);
@@ -36,195 +36,607 @@ DISCLAIMER:
 
 #include "db_MySQL_Export.h"
 #include "mppt.h"
+#include <mysql/errmsg.h>
+#include <boost/algorithm/string/join.hpp>
 
-int db_SQL_Export::exportDayData(InverterData *inverters[])
+// Insert rows in the database, or in the spool when the database is not available
+int db_SQL_Export::insert_rows(const std::string &insert, const std::vector<std::string> &rows, const std::string &upsert)
 {
-    const char *sql = "INSERT INTO DayData(TimeStamp,Serial,TotalYield,Power,PVoutput) VALUES(?,?,?,?,?) ON DUPLICATE KEY UPDATE Serial=Serial";
-    int rc = SQL_OK;
+    if (!m_spooling)
+    {
+        int rc = write_rows(insert, rows, upsert);
+
+        // Connection lost: keep this and all following rows in the spool
+        if ((rc == SQL_OK) || !connection_lost())
+        {
+            if ((rc == SQL_OK) && in_transaction() && m_spool.enabled())
+                m_unitofwork.push_back({ insert, upsert, rows });
+            return rc;
+        }
+
+        spool_unitofwork();
+    }
+
+    m_spool.append(insert, upsert, rows);
 
-    MYSQL_BIND values[5];
+    return SQL_OK;
+}
 
-    MYSQL_STMT *pStmt = mysql_stmt_init(m_dbHandle);
-    if (!pStmt)
+bool db_SQL_Export::connection_lost(void)
+{
+    const unsigned int err = (m_dbHandle != NULL) ? mysql_errno(m_dbHandle) : 0;
+    return m_spool.enabled() && ((err == CR_SERVER_GONE_ERROR) || (err == CR_SERVER_LOST));
+}
+
+// The server rolls back the open transaction when the connection is lost
+// Its rows go to the spool, together with all rows that follow
+void db_SQL_Export::spool_unitofwork(void)
+{
+    std::cout << "Connection to MySQL server lost. Data is spooled..." << std::endl;
+    m_spooling = true;
+
+    for (const auto &uow : m_unitofwork)
+        m_spool.append(uow.insert, uow.upsert, uow.rows);
+    m_unitofwork.clear();
+}
+
+// A new unit of work starts with the outermost transaction
+int db_SQL_Export::begin_transaction(void)
+{
+    if (!in_transaction())
+        m_unitofwork.clear();
+
+    return db_SQL_Base::begin_transaction();
+}
+
+// When the COMMIT doesn't make it to the server, the rows are spooled
+// The replay ignores rows that were stored after all
+int db_SQL_Export::commit_transaction(void)
+{
+    const bool outermost = (m_txlevel == 1);
+
+    int rc = db_SQL_Base::commit_transaction();
+    if (outermost)
     {
-        print_error("Out of memory");
-        return SQL_ERROR;
+        if ((rc != SQL_OK) && !m_spooling && connection_lost())
+            spool_unitofwork();
+        m_unitofwork.clear();
     }
 
-    if ((rc = mysql_stmt_prepare(pStmt, sql, strlen(sql))) == SQL_OK)
+    return rc;
+}
+
+// Write rows with multi-row INSERT statements
+// Each statement contains at most m_batchsize rows and SQL_MAX_BATCH_BYTES characters
+// This avoids a round trip to the server for each single row
+int db_SQL_Export::write_rows(const std::string &insert, const std::vector<std::string> &rows, const std::string &upsert)
+{
+    int rc = SQL_OK;
+    std::string sql;
+    unsigned int rowcount = 0;
+
+    sql.reserve(SQL_MAX_BATCH_BYTES);
+
+    for (auto row = rows.begin(); row != rows.end(); ++row)
     {
-        exec_query("START TRANSACTION");
+        if (rowcount == 0)
+            sql = insert;
+        else
+            sql += ',';
+
+        sql += *row;
+        rowcount++;
 
-        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+        const auto next = row + 1;
+        if ((next == rows.end()) || (rowcount >= m_batchsize) || (sql.size() + next->size() + upsert.size() >= SQL_MAX_BATCH_BYTES))
         {
-            const unsigned int numelements = sizeof(inverters[inv]->dayData) / sizeof(DayData);
-            unsigned int first_rec, last_rec;
-            // Find first record with production data
-            for (first_rec = 0; first_rec < numelements; first_rec++)
-            {
-                if ((inverters[inv]->dayData[first_rec].datetime == 0) || (inverters[inv]->dayData[first_rec].watt != 0))
-                {
-                    // Include last zero record, just before production starts
-                    if (first_rec > 0) first_rec--;
-                    break;
-                }
-            }
+            sql += upsert;
 
-            // Find last record with production data
-            for (last_rec = numelements - 1; last_rec > first_rec; last_rec--)
+            if ((rc = exec_query(sql)) != SQL_OK)
             {
-                if ((inverters[inv]->dayData[last_rec].datetime != 0) && (inverters[inv]->dayData[last_rec].watt != 0))
-                    break;
+                print_error("exec_query() returned", sql);
+                break;
             }
 
-            // Include zero record, just after production stopped
-            if ((last_rec < numelements - 1) && (inverters[inv]->dayData[last_rec + 1].datetime != 0))
-                last_rec++;
+            if (isverbose(4))
+                std::cout << "Inserted " << rowcount << " row" << (rowcount == 1 ? "" : "s") << " in one statement" << std::endl;
 
-            if (first_rec < last_rec) // Production data found or all zero?
-            {
-                // Store data from first to last record
-                for (unsigned int idx = first_rec; idx <= last_rec; idx++)
-                {
-                    // Invalid dates are not written to db
-                    if (inverters[inv]->dayData[idx].datetime != 0)
-                    {
-                        memset(values, 0, sizeof(values));
+            rowcount = 0;
+        }
+    }
 
-                        // Timestamp
-                        values[0].buffer_type = MYSQL_TYPE_LONG;
-                        values[0].buffer = (void *)&inverters[inv]->dayData[idx].datetime;
-                        values[0].is_unsigned = false;
+    return rc;
+}
 
-                        // Serial
-                        values[1].buffer_type = MYSQL_TYPE_LONG;
-                        values[1].buffer = (void *)&inverters[inv]->Serial;
-                        values[1].is_unsigned = true;
+// Write the spooled rows to the database, before any new data is stored
+// As long as this fails, new data is added to the spool to keep the rows in order
+int db_SQL_Export::replay_spool(void)
+{
+    if (!m_spool.enabled())
+        return SQL_OK;
 
-                        // Total Yield
-                        values[2].buffer_type = MYSQL_TYPE_LONGLONG;
-                        values[2].buffer = (void *)&inverters[inv]->dayData[idx].totalWh;
-                        values[2].is_unsigned = true;
+    if (!isopen())
+    {
+        m_spooling = true;
+        return SQL_ERROR;
+    }
 
-                        // Power
-                        values[3].buffer_type = MYSQL_TYPE_LONGLONG;
-                        values[3].buffer = (void *)&inverters[inv]->dayData[idx].watt;
-                        values[3].is_unsigned = true;
+    if (m_spool.empty())
+    {
+        m_spooling = false;
+        return SQL_OK;
+    }
 
-                        // PVOutput
-                        values[4].buffer_type = MYSQL_TYPE_NULL;
+    // Rows may have been (partially) stored before the connection was lost
+    // Duplicate rows are ignored to make the replay idempotent
+    auto replay = [this](const std::string &insert, const std::string &upsert, const std::vector<std::string> &rows)
+    {
+        return write_rows(insert, rows, upsert.empty() ? " ON DUPLICATE KEY UPDATE Serial=Serial" : upsert);
+    };
 
-                        mysql_stmt_bind_param(pStmt, values);
+    unsigned int rowcount = 0;
+    int rc = begin_transaction();
+    if (rc == SQL_OK)
+    {
+        if (m_spool.replay(replay, m_batchsize, rowcount) == 0)
+            rc = commit_transaction();
+        else
+        {
+            rc = SQL_ERROR;
+            rollback_transaction();
+        }
+    }
 
-                        rc = mysql_stmt_execute(pStmt);
+    if ((rc == SQL_OK) && (m_spool.clear() == 0))
+    {
+        m_spooling = false;
+        // Spooled DayData is not staged yet
+        stage_pvodata(0, time(NULL) - pvo_datelimit() * 86400, time(NULL));
+        if (isverbose(2))
+            std::cout << rowcount << " spooled row" << (rowcount == 1 ? "" : "s") << " stored in database" << std::endl;
+    }
+    else
+    {
+        m_spooling = true;
+        std::cout << "Failed to store spooled data. New data is spooled..." << std::endl;
+    }
 
-                        if (rc != SQL_OK)
-                        {
-                            print_error("[day_data]mysql_stmt_execute() returned");
-                            break;
-                        }
+    return rc;
+}
 
-                        //mysql_stmt_reset(pStmt);
+// Create the rollup tables in databases created by a previous version
+int db_SQL_Export::init_rollup(void)
+{
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS SpotDataRollup ("
+        "Period char(1) NOT NULL,TimeStamp int NOT NULL,Serial int unsigned NOT NULL,Samples int,"
+        "PacMin int,PacMax int,PacSum bigint,PdcSum bigint,ETotalMin bigint,ETotalMax bigint,"
+        "PRIMARY KEY (Serial, Period, TimeStamp));"
+        "CREATE TABLE IF NOT EXISTS DayDataRollup ("
+        "Period char(1) NOT NULL,TimeStamp int NOT NULL,Serial int unsigned NOT NULL,Samples int,"
+        "PowerMax bigint,PowerSum bigint,TotalYieldMin bigint,TotalYieldMax bigint,"
+        "PRIMARY KEY (Serial, Period, TimeStamp));";
+
+    int rc = exec_query_multi(sql);
+    if (rc != SQL_OK)
+        print_error("Rollup tables not available", sql);
 
-                        rc = SQL_OK;
-                    }
-                }
+    m_rollup = (rc == SQL_OK);
+
+    return rc;
+}
+
+// Refresh the rollup buckets of the devices
+// A failure is reported, but doesn't undo the export of the raw data
+// Spooled rows are not rolled up until their buckets are refreshed again
+int db_SQL_Export::rollup(const RollupDef &def, const std::vector<RollupRange> &ranges)
+{
+    int rc = SQL_OK;
+
+    if (!m_rollup || m_spooling)
+        return rc;
+
+    for (const auto &range : ranges)
+    {
+        for (const auto &sql : rollup_statements(def, "REPLACE INTO", range.serial, range.from, range.to))
+        {
+            if ((rc = exec_query(sql)) != SQL_OK)
+            {
+                print_error("[rollup]exec_query() returned", sql);
+                return rc;
             }
         }
+    }
+
+    return rc;
+}
 
-        mysql_stmt_close(pStmt);
+// Create the PVOutput staging table in databases created by a previous version
+// A new table is filled with the data that is still to be uploaded
+int db_SQL_Export::init_pvo_staging(void)
+{
+    const bool created = !table_exists("PvoStaging");
 
-        if (rc == SQL_OK)
-            exec_query("COMMIT");
-        else
-            exec_query("ROLLBACK");
-    }
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS PvoStaging ("
+        "TimeStamp int NOT NULL,Serial int unsigned NOT NULL,"
+        "V1 bigint,V2 bigint,V3 bigint,V4 bigint,V5 decimal(9,2),V6 decimal(9,2),"
+        "V7 float,V8 float,V9 float,V10 float,V11 float,V12 float,PVoutput int(1),"
+        "PRIMARY KEY (TimeStamp, Serial),"
+        "INDEX PvoStaging_Upload (Serial, PVoutput, TimeStamp))";
+
+    int rc = exec_query(sql);
+    if (rc != SQL_OK)
+        print_error("PVOutput staging table not available", sql);
+
+    m_pvostaging = (rc == SQL_OK);
+
+    if (m_pvostaging && created)
+        rc = stage_pvodata(0, time(NULL) - pvo_datelimit() * 86400, time(NULL));
 
     return rc;
 }
 
-int db_SQL_Export::exportMonthData(InverterData *inverters[])
+// Number of days PVOutput accepts uploads of (set by SBFspotUploadDaemon)
+int db_SQL_Export::pvo_datelimit(void)
+{
+    int datelimit = 90;
+    get_config(SQL_BATCH_DATELIMIT, datelimit);
+    return datelimit;
+}
+
+// Copy the DayData rows that are not yet uploaded to PVOutput to the staging table,
+// together with the consumption and spot data averaged over the same 5 minutes (see vwPvoData)
+// serial=0 stages the rows of all devices
+// Average of a spot data column over the 5 minutes of dd.TimeStamp
+// With write-on-change, a window without spot data has the values of the last stored sample
+static std::string spot_average(const std::string &expr, time_t heartbeat)
+{
+    const std::string average = "(SELECT AVG(" + expr + ") FROM SpotData s WHERE s.TimeStamp>=dd.TimeStamp-150 AND s.TimeStamp<dd.TimeStamp+150 AND s.Serial=dd.Serial)";
+    if (heartbeat == 0)
+        return average;
+
+    return "COALESCE(" + average + ",(SELECT " + expr + " FROM SpotData s WHERE s.TimeStamp<dd.TimeStamp-150 AND s.TimeStamp>=dd.TimeStamp-150-" + std::to_string(heartbeat) +
+        " AND s.Serial=dd.Serial ORDER BY s.TimeStamp DESC LIMIT 1))";
+}
+
+int db_SQL_Export::stage_pvodata(uint32_t serial, time_t from, time_t to)
+{
+    int rc = SQL_OK;
+
+    if (!m_pvostaging || m_spooling)
+        return rc;
+
+    std::ostringstream sql;
+    sql << "REPLACE INTO PvoStaging(TimeStamp,Serial,V1,V2,V3,V4,V5,V6) "
+        "SELECT dd.TimeStamp,dd.Serial,dd.TotalYield,dd.Power,"
+        "(SELECT CAST(AVG(c.EnergyUsed) AS decimal(9)) FROM Consumption c WHERE c.TimeStamp>=dd.TimeStamp-150 AND c.TimeStamp<dd.TimeStamp+150),"
+        "(SELECT CAST(AVG(c.PowerUsed) AS decimal(9)) FROM Consumption c WHERE c.TimeStamp>=dd.TimeStamp-150 AND c.TimeStamp<dd.TimeStamp+150),"
+        << spot_average("ROUND(s.Temperature,1)", m_spotheartbeat) << ',' << spot_average("s.Uac1", m_spotheartbeat) <<
+        " FROM DayData dd WHERE dd.TimeStamp BETWEEN " << from << " AND " << to << " AND dd.PVoutput IS NULL";
+    if (serial != 0)
+        sql << " AND dd.Serial=" << serial;
+
+    if ((rc = exec_query(sql.str())) != SQL_OK)
+        print_error("[pvo_staging]exec_query() returned", sql.str());
+
+    return rc;
+}
+
+// Name of the partition holding the month starting at 'month' (local time)
+static std::string partition_name(time_t month)
 {
-    const char *sql = "INSERT INTO MonthData(TimeStamp,Serial,TotalYield,DayYield) VALUES(?,?,?,?)";
+    struct tm month_tm;
+    localtime_s(&month_tm, &month);
+    std::ostringstream name;
+    name << 'p' << std::put_time(&month_tm, "%Y%m");
+    return name.str();
+}
+
+// Monthly partitions from the month of 'from' up to the month after 'to', followed by pmax
+static std::string partition_list(time_t from, time_t to)
+{
+    std::ostringstream parts;
+    const time_t end = bucket_start(to, 'M', 2);
 
+    for (time_t month = bucket_start(from, 'M'); month < end; month = bucket_start(month, 'M', 1))
+        parts << "PARTITION " << partition_name(month) << " VALUES LESS THAN (" << bucket_start(month, 'M', 1) << "),";
+
+    parts << "PARTITION pmax VALUES LESS THAN MAXVALUE";
+    return parts.str();
+}
+
+// Store SpotData and SpotDataX in monthly partitions (local time)
+// and drop the partitions older than 'retention' months (0=keep all)
+// An existing table is partitioned by an online migration, which may take several runs
+int db_SQL_Export::maintain_partitions(unsigned int retention)
+{
     int rc = SQL_OK;
 
-    MYSQL_BIND values[4];
+    if (!isopen() || m_spooling)
+        return rc;
+
+    // The aggregates of the dropped spot data are kept in the rollups
+    if ((retention > 0) && !m_rollup)
+    {
+        std::cout << "SQL_SpotRetention ignored: rollup tables are not available" << std::endl;
+        retention = 0;
+    }
+
+    set_migration_timeout(SQL_MIGRATION_TIMEOUT);
 
-    MYSQL_STMT *pStmt = mysql_stmt_init(m_dbHandle);
-    if (!pStmt)
+    for (const std::string table : { "SpotData", "SpotDataX" })
     {
-        print_error("Out of memory");
+        bool completed = true;
+        int64_t partitions = 0;
+
+        select_int("SELECT COUNT(*) FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='" + table + "' AND PARTITION_NAME IS NOT NULL", partitions);
+
+        if (partitions == 0)
+            rc = partition_table(table, completed);
+        else
+        {
+            cleanup_migration(table + "_Partitions", table);
+            rc = add_partitions(table);
+        }
+
+        if ((rc == SQL_OK) && completed && (retention > 0))
+            rc = drop_partitions(table, bucket_start(time(NULL), 'M', -(int)retention));
+
+        if ((rc != SQL_OK) || !completed)
+            break;
+    }
+
+    return rc;
+}
+
+// Copy a table to a partitioned table with the same definition
+int db_SQL_Export::partition_table(const std::string &table, bool &completed)
+{
+    std::vector<std::string> ddl, columns, keys;
+    int64_t first = time(NULL);
+
+    select_column("SHOW CREATE TABLE " + table, ddl, 1);
+    select_column("SELECT CONCAT('`',COLUMN_NAME,'`') FROM information_schema.COLUMNS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='" + table + "' AND EXTRA NOT LIKE '%GENERATED%' ORDER BY ORDINAL_POSITION", columns);
+    select_column("SELECT CONCAT('`',COLUMN_NAME,'`') FROM information_schema.KEY_COLUMN_USAGE WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='" + table + "' AND CONSTRAINT_NAME='PRIMARY' ORDER BY ORDINAL_POSITION", keys);
+    select_int("SELECT MIN(TimeStamp) FROM " + table, first);
+
+    if (ddl.empty() || columns.empty() || keys.empty())
+    {
+        print_error("Unable to read the definition of table " + table);
         return SQL_ERROR;
     }
 
-    if ((rc = mysql_stmt_prepare(pStmt, sql, strlen(sql))) == SQL_OK)
+    std::string create = ddl[0];
+    create.replace(0, create.find('('), "CREATE TABLE IF NOT EXISTS `" + table + "_new` ");
+    create += " PARTITION BY RANGE (TimeStamp) (" + partition_list(first, time(NULL)) + ")";
+
+    const std::string name = table + "_Partitions";
+    const std::string cols = boost::algorithm::join(columns, ",");
+    const std::string key = boost::algorithm::join(keys, ",");
+    const TableMigration def = { name.c_str(), table.c_str(), create.c_str(), cols.c_str(), cols.c_str(), key.c_str() };
+
+    int rc = migrate_table(def, completed);
+    if ((rc == SQL_OK) && completed)
+        clear_checkpoint(name);
+
+    return rc;
+}
+
+// Split the partitions of the current and next month off pmax
+// pmax is normally empty, so this takes no time
+int db_SQL_Export::add_partitions(const std::string &table)
+{
+    int64_t last = 0;
+
+    select_int("SELECT MAX(CAST(PARTITION_DESCRIPTION AS UNSIGNED)) FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='" + table + "' AND PARTITION_DESCRIPTION<>'MAXVALUE'", last);
+
+    if ((last == 0) || (last >= bucket_start(time(NULL), 'M', 2)))
+        return SQL_OK;
+
+    const std::string sql = "ALTER TABLE " + table + " REORGANIZE PARTITION pmax INTO (" + partition_list(last, time(NULL)) + ")";
+
+    int rc = exec_query(sql);
+    if (rc != SQL_OK)
+        print_error("[partitions]exec_query() returned", sql);
+
+    return rc;
+}
+
+// Drop the partitions holding data older than cutoff
+// The rollups of the spot data are refreshed first, a partition is kept as long as that fails
+int db_SQL_Export::drop_partitions(const std::string &table, time_t cutoff)
+{
+    std::vector<std::string> names, bounds;
+    const std::string sql = "SELECT PARTITION_NAME,PARTITION_DESCRIPTION FROM information_schema.PARTITIONS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='" + table +
+        "' AND PARTITION_DESCRIPTION<>'MAXVALUE' AND CAST(PARTITION_DESCRIPTION AS UNSIGNED)<=" + std::to_string(cutoff) + " ORDER BY PARTITION_ORDINAL_POSITION";
+
+    select_column(sql, names, 0);
+    select_column(sql, bounds, 1);
+
+    int rc = SQL_OK;
+
+    for (size_t i = 0; (i < names.size()) && (i < bounds.size()); i++)
     {
-        exec_query("START TRANSACTION");
+        if (table == "SpotData")
+        {
+            std::vector<std::string> serials;
+            std::vector<RollupRange> ranges;
+            const time_t to = strtoll(bounds[i].c_str(), NULL, 10) - 1;
+
+            select_column("SELECT DISTINCT Serial FROM SpotData PARTITION (" + names[i] + ")", serials);
+            for (const auto &serial : serials)
+                ranges.push_back({ (uint32_t)strtoul(serial.c_str(), NULL, 10), bucket_start(to, 'M'), to });
 
-        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+            if ((rc = rollup(SpotDataRollup, ranges)) != SQL_OK)
+                break;
+        }
+
+        if ((rc = exec_query("ALTER TABLE " + table + " DROP PARTITION " + names[i])) != SQL_OK)
         {
-            // Fix #74 / #701: Double data in Monthdata table
-            tm *ptm = localtime(&inverters[inv]->monthData[0].datetime);
+            print_error("[partitions]exec_query() returned");
+            break;
+        }
 
-            std::stringstream rmvsql;
-            rmvsql << "DELETE FROM MonthData WHERE Serial=" << inverters[inv]->Serial << " AND DATE_FORMAT(CONVERT_TZ(FROM_UNIXTIME(TimeStamp),@@time_zone,'+00:00'), '%Y-%m')='" << std::put_time(ptm, "%Y-%m") << "';";
+        if (isverbose(2))
+            std::cout << "Dropped partition " << table << "." << names[i] << std::endl;
+    }
 
-            if ((rc = exec_query(rmvsql.str())) != SQL_OK)
+    return rc;
+}
+
+std::string db_SQL_Export::s_escaped(const std::string &str)
+{
+    std::string escaped(str.size() * 2 + 1, '\0');
+    if (m_dbHandle != NULL)
+        escaped.resize(mysql_real_escape_string(m_dbHandle, &escaped[0], str.c_str(), str.size()));
+    else // Spooling without connection
+        escaped.resize(mysql_escape_string(&escaped[0], str.c_str(), str.size()));
+    return s_quoted(escaped);
+}
+
+int db_SQL_Export::exportDayData(InverterData *inverters[])
+{
+    const char *sql = "INSERT INTO DayData(TimeStamp,Serial,TotalYield,Power,PVoutput) VALUES";
+    std::vector<std::string> rows;
+    std::vector<RollupRange> ranges;
+    std::ostringstream row;
+
+    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+    {
+        const unsigned int numelements = sizeof(inverters[inv]->dayData) / sizeof(DayData);
+        unsigned int first_rec, last_rec;
+        // Find first record with production data
+        for (first_rec = 0; first_rec < numelements; first_rec++)
+        {
+            if ((inverters[inv]->dayData[first_rec].datetime == 0) || (inverters[inv]->dayData[first_rec].watt != 0))
             {
-                print_error("exec_query() returned", rmvsql.str());
+                // Include last zero record, just before production starts
+                if (first_rec > 0) first_rec--;
                 break;
             }
+        }
+
+        // Find last record with production data
+        for (last_rec = numelements - 1; last_rec > first_rec; last_rec--)
+        {
+            if ((inverters[inv]->dayData[last_rec].datetime != 0) && (inverters[inv]->dayData[last_rec].watt != 0))
+                break;
+        }
 
-            for (unsigned int idx = 0; idx < sizeof(inverters[inv]->monthData) / sizeof(MonthData); idx++)
+        // Include zero record, just after production stopped
+        if ((last_rec < numelements - 1) && (inverters[inv]->dayData[last_rec + 1].datetime != 0))
+            last_rec++;
+
+        if (first_rec < last_rec) // Production data found or all zero?
+        {
+            RollupRange range = { (uint32_t)inverters[inv]->Serial, 0, 0 };
+
+            // Store data from first to last record
+            for (unsigned int idx = first_rec; idx <= last_rec; idx++)
             {
-                if (inverters[inv]->monthData[idx].datetime != 0)
+                // Invalid dates are not written to db
+                if (inverters[inv]->dayData[idx].datetime != 0)
                 {
-                    memset(values, 0, sizeof(values));
+                    if (range.from == 0) range.from = inverters[inv]->dayData[idx].datetime;
+                    range.to = inverters[inv]->dayData[idx].datetime;
+
+                    row.str("");
+                    row << '(' <<
+                        inverters[inv]->dayData[idx].datetime << ',' <<
+                        inverters[inv]->Serial << ',' <<
+                        inverters[inv]->dayData[idx].totalWh << ',' <<
+                        inverters[inv]->dayData[idx].watt << ",NULL)";
+                    rows.push_back(row.str());
+                }
+            }
 
-                    // Timestamp
-                    values[0].buffer_type = MYSQL_TYPE_LONG;
-                    values[0].buffer = (void *)&inverters[inv]->monthData[idx].datetime;
-                    values[0].is_unsigned = false;
+            if (range.from != 0)
+                ranges.push_back(range);
+        }
+    }
 
-                    // Serial
-                    values[1].buffer_type = MYSQL_TYPE_LONG;
-                    values[1].buffer = (void *)&inverters[inv]->Serial;
-                    values[1].is_unsigned = true;
+    int rc = SQL_OK;
 
-                    // Total Yield
-                    values[2].buffer_type = MYSQL_TYPE_LONGLONG;
-                    values[2].buffer = (void *)&inverters[inv]->monthData[idx].totalWh;
-                    values[2].is_unsigned = true;
+    if (!rows.empty())
+    {
+        const bool tx = (begin_transaction() == SQL_OK);
 
-                    // Day Yield
-                    values[3].buffer_type = MYSQL_TYPE_LONGLONG;
-                    values[3].buffer = (void *)&inverters[inv]->monthData[idx].dayWh;
-                    values[3].is_unsigned = true;
+        if ((rc = insert_rows(sql, rows, " ON DUPLICATE KEY UPDATE Serial=Serial")) != SQL_OK)
+            print_error("[day_data]insert_rows() returned");
+        else
+        {
+            // Recalculate the aggregates of the stored periods (also for archive data arriving late)
+            if (rollup(DayDataRollup, ranges) != SQL_OK)
+                print_error("[day_data]rollup() returned");
+            for (const auto &range : ranges)
+                stage_pvodata(range.serial, range.from, range.to);
+        }
 
-                    mysql_stmt_bind_param(pStmt, values);
+        if (tx)
+        {
+            if (rc == SQL_OK)
+                commit_transaction();
+            else
+                rollback_transaction();
+        }
+    }
 
-                    rc = mysql_stmt_execute(pStmt);
+    return rc;
+}
 
-                    if (rc != SQL_OK)
-                    {
-                        print_error("[month_data]mysql_stmt_execute() returned");
-                        break;
-                    }
+int db_SQL_Export::exportMonthData(InverterData *inverters[])
+{
+    const char *sql = "INSERT INTO MonthData(TimeStamp,Serial,TotalYield,DayYield) VALUES";
+    std::vector<std::string> rows;
+    std::ostringstream rmvsql;
+    std::ostringstream row;
 
-                    //mysql_stmt_reset(pStmt);
+    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+    {
+        // Fix #74 / #701: Double data in Monthdata table
+        tm month_tm;
+        localtime_s(&month_tm, &inverters[inv]->monthData[0].datetime);
 
-                    rc = SQL_OK;
-                }
+        rmvsql << "DELETE FROM MonthData WHERE Serial=" << inverters[inv]->Serial << " AND DATE_FORMAT(CONVERT_TZ(FROM_UNIXTIME(TimeStamp),@@time_zone,'+00:00'), '%Y-%m')='" << std::put_time(&month_tm, "%Y-%m") << "';";
+
+        for (unsigned int idx = 0; idx < sizeof(inverters[inv]->monthData) / sizeof(MonthData); idx++)
+        {
+            if (inverters[inv]->monthData[idx].datetime != 0)
+            {
+                row.str("");
+                row << '(' <<
+                    inverters[inv]->monthData[idx].datetime << ',' <<
+                    inverters[inv]->Serial << ',' <<
+                    inverters[inv]->monthData[idx].totalWh << ',' <<
+                    inverters[inv]->monthData[idx].dayWh << ')';
+                rows.push_back(row.str());
             }
         }
+    }
 
-        mysql_stmt_close(pStmt);
+    int rc = SQL_OK;
 
-        if (rc == SQL_OK)
-            exec_query("COMMIT");
-        else
-            exec_query("ROLLBACK");
+    if (!rmvsql.str().empty())
+    {
+        const bool tx = (begin_transaction() == SQL_OK);
+
+        // Remove the months to be refreshed in one round trip
+        // When spooling, the replay overwrites the rows already in the database instead
+        if (m_spooling)
+            rc = insert_rows(sql, rows, " ON DUPLICATE KEY UPDATE TotalYield=VALUES(TotalYield),DayYield=VALUES(DayYield)");
+        else if ((rc = exec_query_multi(rmvsql.str())) != SQL_OK)
+            print_error("exec_query_multi() returned", rmvsql.str());
+        else if ((rc = insert_rows(sql, rows)) != SQL_OK)
+            print_error("[month_data]insert_rows() returned");
+
+        if (tx)
+        {
+            if (rc == SQL_OK)
+                commit_transaction();
+            else
+                rollback_transaction();
+        }
     }
 
     return rc;
@@ -232,13 +644,18 @@ int db_SQL_Export::exportMonthData(InverterData *inverters[])
 
 int db_SQL_Export::exportSpotData(InverterData *inv[], time_t spottime)
 {
-    std::stringstream sql;
+    const char *sql = "INSERT INTO SpotData(TimeStamp,Serial,Pdc1,Pdc2,Idc1,Idc2,Udc1,Udc2,Pac1,Pac2,Pac3,Iac1,Iac2,Iac3,Uac1,Uac2,Uac3,EToday,ETotal,Frequency,OperatingTime,FeedInTime,BT_Signal,Status,GridRelay,Temperature) VALUES";
+    const char *sqlx = "INSERT INTO SpotDataX(`TimeStamp`,`Serial`,`Key`,`Value`) VALUES";
+    std::vector<std::string> rows;
+    std::vector<std::string> rowsx;
+    std::vector<RollupRange> ranges;
+    std::ostringstream row;
     int rc = SQL_OK;
 
     for (uint32_t i = 0; inv[i] != NULL && i<MAX_INVERTERS; i++)
     {
-        sql.str("");
-        sql << "INSERT INTO SpotData VALUES(" <<
+        row.str("");
+        row << '(' <<
             spottime << ',' <<
             inv[i]->Serial << ',' <<
             inv[i]->mpp.at(1).Pdc() << ',' <<
@@ -266,276 +683,156 @@ int db_SQL_Export::exportSpotData(InverterData *inv[], time_t spottime)
             s_quoted(status_text(inv[i]->GridRelayStatus)) << ',' <<
             null_if_nan(inv[i]->Temperature, 2) <<
             ')';
-
-        if ((rc = exec_query(sql.str())) != SQL_OK)
-        {
-            print_error("[spot_data]exec_query() returned", sql.str());
-            break;
-        }
+        rows.push_back(row.str());
+        ranges.push_back({ (uint32_t)inv[i]->Serial, spottime, spottime });
 
         // If inverter has more than 2 mppt, use SpotDataX table to store the data
         if (inv[i]->mpp.size() > 2)
         {
-            const char* INSERT_SpotDataX = "INSERT INTO SpotDataX VALUES(";
-            sql.str("");
             for (const auto &mpp : inv[i]->mpp)
             {
-                sql << INSERT_SpotDataX << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsWatt | mpp.first) << ',' << mpp.second.Pdc() << ");";
-                sql << INSERT_SpotDataX << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsVol | mpp.first) << ',' << mpp.second.Udc() << ");";
-                sql << INSERT_SpotDataX << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsAmp | mpp.first) << ',' << mpp.second.Idc() << ");";
-            }
-
-            if ((rc = exec_query_multi(sql.str())) != SQL_OK)
-            {
-                print_error("[spot_data]exec_query() returned", sql.str());
-                break;
+                row.str("");
+                row << '(' << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsWatt | mpp.first) << ',' << mpp.second.Pdc() << ')';
+                rowsx.push_back(row.str());
+                row.str("");
+                row << '(' << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsVol | mpp.first) << ',' << mpp.second.Udc() << ')';
+                rowsx.push_back(row.str());
+                row.str("");
+                row << '(' << spottime << ',' << inv[i]->Serial << ',' << (LriDef::DcMsAmp | mpp.first) << ',' << mpp.second.Idc() << ')';
+                rowsx.push_back(row.str());
             }
         }
     }
 
+    if ((rc = insert_rows(sql, rows)) != SQL_OK)
+        print_error("[spot_data]insert_rows() returned");
+    else if (!rowsx.empty() && ((rc = insert_rows(sqlx, rowsx)) != SQL_OK))
+        print_error("[spot_data]insert_rows() returned");
+    else if (rollup(SpotDataRollup, ranges) != SQL_OK)
+        print_error("[spot_data]rollup() returned");
+
     return rc;
 }
 
 int db_SQL_Export::exportEventData(InverterData *inv[], TagDefs& tags)
 {
-    const char *sql = "INSERT INTO EventData(EntryID,TimeStamp,Serial,SusyID,EventCode,EventType,Category,EventGroup,Tag,OldValue,NewValue,UserGroup) VALUES(?,?,?,?,?,?,?,?,?,?,?,?) ON DUPLICATE KEY UPDATE Serial=Serial";
-    int rc = SQL_OK;
-
-    MYSQL_BIND values[12];
+    const char *sql = "INSERT INTO EventData(EntryID,TimeStamp,Serial,SusyID,EventCode,EventType,Category,EventGroup,Tag,OldValue,NewValue,UserGroup) VALUES";
+    std::vector<std::string> rows;
+    std::ostringstream row;
 
-    MYSQL_STMT *pStmt = mysql_stmt_init(m_dbHandle);
-    if (!pStmt)
-    {
-        print_error("Out of memory");
-        return SQL_ERROR;
-    }
-
-    if ((rc = mysql_stmt_prepare(pStmt, sql, strlen(sql))) == SQL_OK)
+    for (uint32_t i = 0; inv[i] != NULL && i<MAX_INVERTERS; i++)
     {
-        exec_query("START TRANSACTION");
-
-        for (uint32_t i = 0; inv[i] != NULL && i<MAX_INVERTERS; i++)
+        for (const auto &event : inv[i]->eventData)
         {
-            for (const auto &event : inv[i]->eventData)
-            {
-                std::string grp = tags.getDesc(event.Group());
-                std::string desc = event.EventDescription();
-                std::string usrgrp = tags.getDesc(event.UserGroupTagID());
-                std::stringstream oldval;
-                std::stringstream newval;
+            std::string grp = tags.getDesc(event.Group());
+            std::string desc = event.EventDescription();
+            std::string usrgrp = tags.getDesc(event.UserGroupTagID());
+            std::stringstream oldval;
+            std::stringstream newval;
 
-                switch (event.DataType())
-                {
-                case DT_STATUS:
-                    oldval << tags.getDesc(event.OldVal() & 0xFFFF);
-                    newval << tags.getDesc(event.NewVal() & 0xFFFF);
-                    break;
-
-                case DT_STRING:
-                    newval << event.EventStrPara();
-                    break;
-
-                default:
-                    oldval << event.OldVal();
-                    newval << event.NewVal();
-                }
-
-                memset(values, 0, sizeof(values));
-
-                // Entry ID
-                uint16_t EntryID = event.EntryID();
-                values[0].buffer_type = MYSQL_TYPE_SHORT;
-                values[0].buffer = &EntryID;
-                values[0].is_unsigned = true;
-
-                // Timestamp
-                int32_t DateTime = (int32_t)event.DateTime();
-                values[1].buffer_type = MYSQL_TYPE_LONG;
-                values[1].buffer = &DateTime;
-                values[1].is_unsigned = false;
-
-                // Serial
-                uint32_t SerNo = event.SerNo();
-                values[2].buffer_type = MYSQL_TYPE_LONG;
-                values[2].buffer = &SerNo;
-                values[2].is_unsigned = true;
-
-                // SUSy ID
-                uint16_t SUSyID = event.SUSyID();
-                values[3].buffer_type = MYSQL_TYPE_SHORT;
-                values[3].buffer = &SUSyID;
-                values[3].is_unsigned = true;
-
-                // Event Code
-                uint16_t EventCode = event.EventCode();
-                values[4].buffer_type = MYSQL_TYPE_SHORT;
-                values[4].buffer = &EventCode;
-                values[4].is_unsigned = true;
-
-                // Event Type
-                std::string EventType = event.EventType();
-                values[5].buffer_type = MYSQL_TYPE_STRING;
-                values[5].buffer = (char *)EventType.c_str();
-                values[5].buffer_length = EventType.size();
-
-                // Event Category
-                std::string EventCategory = event.EventCategory();
-                values[6].buffer_type = MYSQL_TYPE_STRING;
-                values[6].buffer = (char *)EventCategory.c_str();
-                values[6].buffer_length = EventCategory.size();
-
-                // Event Group
-                values[7].buffer_type = MYSQL_TYPE_STRING;
-                values[7].buffer = (char *)grp.c_str();
-                values[7].buffer_length = grp.size();
-
-                // Event Tag
-                values[8].buffer_type = MYSQL_TYPE_STRING;
-                values[8].buffer = (char *)desc.c_str();
-                values[8].buffer_length = desc.size();
-
-                // Old Value
-                std::string OldValue = oldval.str();
-                if (OldValue.empty())
-                    values[9].buffer_type = MYSQL_TYPE_NULL; // Fix #545/#548
-                else
-                {
-                    values[9].buffer_type = MYSQL_TYPE_STRING;
-                    values[9].buffer = (char *)OldValue.c_str();
-                    values[9].buffer_length = OldValue.size();
-                }
+            switch (event.DataType())
+            {
+            case DT_STATUS:
+                oldval << tags.getDesc(event.OldVal() & 0xFFFF);
+                newval << tags.getDesc(event.NewVal() & 0xFFFF);
+                break;
 
-                // New Value
-                std::string NewValue = newval.str();
-                if (NewValue.empty())
-                    values[10].buffer_type = MYSQL_TYPE_NULL; // Fix #545/#548
-                else
-                {
-                    values[10].buffer_type = MYSQL_TYPE_STRING;
-                    values[10].buffer = (char *)NewValue.c_str();
-                    values[10].buffer_length = NewValue.size();
-                }
+            case DT_STRING:
+                newval << event.EventStrPara();
+                break;
 
-                // User Group
-                values[11].buffer_type = MYSQL_TYPE_STRING;
-                values[11].buffer = (char *)usrgrp.c_str();
-                values[11].buffer_length = usrgrp.size();
+            default:
+                oldval << event.OldVal();
+                newval << event.NewVal();
+            }
 
-                mysql_stmt_bind_param(pStmt, values);
+            row.str("");
+            row << '(' <<
+                event.EntryID() << ',' <<
+                (int32_t)event.DateTime() << ',' <<
+                event.SerNo() << ',' <<
+                event.SUSyID() << ',' <<
+                event.EventCode() << ',' <<
+                s_escaped(event.EventType()) << ',' <<
+                s_escaped(event.EventCategory()) << ',' <<
+                s_escaped(grp) << ',' <<
+                s_escaped(desc) << ',' <<
+                (oldval.str().empty() ? "NULL" : s_escaped(oldval.str())) << ',' << // Fix #545/#548
+                (newval.str().empty() ? "NULL" : s_escaped(newval.str())) << ',' <<
+                s_escaped(usrgrp) << ')';
+            rows.push_back(row.str());
+        }
+    }
 
-                rc = mysql_stmt_execute(pStmt);
+    int rc = SQL_OK;
 
-                if (rc != SQL_OK)
-                {
-                    print_error("[event_data]mysql_stmt_execute() returned");
-                    break;
-                }
+    if (!rows.empty())
+    {
+        const bool tx = (begin_transaction() == SQL_OK);
 
-                //mysql_stmt_reset(pStmt);
+        if ((rc = insert_rows(sql, rows, " ON DUPLICATE KEY UPDATE Serial=Serial")) != SQL_OK)
+            print_error("[event_data]insert_rows() returned");
 
-                rc = SQL_OK;
-            }
+        if (tx)
+        {
+            if (rc == SQL_OK)
+                commit_transaction();
+            else
+                rollback_transaction();
         }
-
-        mysql_stmt_close(pStmt);
-
-        if (rc == SQL_OK)
-            exec_query("COMMIT");
-        else
-            exec_query("ROLLBACK");
     }
-    else
-        print_error("[event_data]mysql_stmt_prepare() returned");
 
     return rc;
 }
 
 int db_SQL_Export::exportBatteryData(InverterData *inverters[], time_t spottime)
 {
-    const char *sql = "INSERT INTO SpotDataX(`TimeStamp`,`Serial`,`Key`,`Value`) VALUES(?,?,?,?)";
-    int rc = SQL_OK;
+    const char *sql = "INSERT INTO SpotDataX(`TimeStamp`,`Serial`,`Key`,`Value`) VALUES";
+    std::vector<std::string> rows;
 
-    MYSQL_STMT *pStmt = mysql_stmt_init(m_dbHandle);
-    if (!pStmt)
+    for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
     {
-        print_error("Out of memory");
-        return SQL_ERROR;
+        InverterData* id = inverters[inv];
+        if (id->hasBattery)
+        {
+            add_battery_data(rows, (int32_t)spottime, id->Serial, BatChaStt >> 8, id->BatChaStt);
+            add_battery_data(rows, (int32_t)spottime, id->Serial, BatTmpVal >> 8, id->BatTmpVal);
+            add_battery_data(rows, (int32_t)spottime, id->Serial, BatVol >> 8, id->BatVol);
+            add_battery_data(rows, (int32_t)spottime, id->Serial, BatAmp >> 8, id->BatAmp);
+            //add_battery_data(rows, (int32_t)spottime, id->Serial, BatDiagCapacThrpCnt >> 8, id->BatDiagCapacThrpCnt);
+            //add_battery_data(rows, (int32_t)spottime, id->Serial, BatDiagTotAhIn >> 8, id->BatDiagTotAhIn);
+            //add_battery_data(rows, (int32_t)spottime, id->Serial, BatDiagTotAhOut >> 8, id->BatDiagTotAhOut);
+            add_battery_data(rows, (int32_t)spottime, id->Serial, MeteringGridMsTotWIn >> 8, id->MeteringGridMsTotWIn);
+            add_battery_data(rows, (int32_t)spottime, id->Serial, MeteringGridMsTotWOut >> 8, id->MeteringGridMsTotWOut);
+        }
     }
 
-    if ((rc = mysql_stmt_prepare(pStmt, sql, strlen(sql))) == SQL_OK)
+    int rc = SQL_OK;
+
+    if (!rows.empty())
     {
-        exec_query("START TRANSACTION");
+        const bool tx = (begin_transaction() == SQL_OK);
+
+        if ((rc = insert_rows(sql, rows)) != SQL_OK)
+            print_error("[battery_data]insert_rows() returned");
 
-        for (uint32_t inv = 0; inverters[inv] != NULL && inv<MAX_INVERTERS; inv++)
+        if (tx)
         {
-            InverterData* id = inverters[inv];
-            if (id->hasBattery)
-            {
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatChaStt >> 8, id->BatChaStt)) != SQL_OK) break;
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatTmpVal >> 8, id->BatTmpVal)) != SQL_OK) break;
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatVol >> 8, id->BatVol)) != SQL_OK) break;
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatAmp >> 8, id->BatAmp)) != SQL_OK) break;
-                //if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatDiagCapacThrpCnt >> 8, id->BatDiagCapacThrpCnt)) != SQL_OK) break;
-                //if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatDiagTotAhIn >> 8, id->BatDiagTotAhIn)) != SQL_OK) break;
-                //if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, BatDiagTotAhOut >> 8, id->BatDiagTotAhOut)) != SQL_OK) break;
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, MeteringGridMsTotWIn >> 8, id->MeteringGridMsTotWIn)) != SQL_OK) break;
-                if ((rc = insert_battery_data(pStmt, (int32_t)spottime, id->Serial, MeteringGridMsTotWOut >> 8, id->MeteringGridMsTotWOut)) != SQL_OK) break;
-            }
+            if (rc == SQL_OK)
+                commit_transaction();
+            else
+                rollback_transaction();
         }
-
-        mysql_stmt_close(pStmt);
-
-        if (rc == SQL_OK)
-            exec_query("COMMIT");
-        else
-            exec_query("ROLLBACK");
-    }
-    else
-    {
-        print_error("[battery_data]mysql_stmt_prepare() returned");
     }
 
     return rc;
 }
 
-int db_SQL_Export::insert_battery_data(MYSQL_STMT *pStmt, int32_t tm, int32_t sn, int32_t key, int32_t val)
+void db_SQL_Export::add_battery_data(std::vector<std::string> &rows, int32_t tm, uint32_t sn, int32_t key, int32_t val)
 {
-    int rc = SQL_OK;
-
-    MYSQL_BIND values[4];
-
-    memset(values, 0, sizeof(values));
-
-    // Timestamp
-    values[0].buffer_type = MYSQL_TYPE_LONG;
-    values[0].buffer = (void *)&tm;
-    values[0].is_unsigned = false;
-
-    // Serial
-    values[1].buffer_type = MYSQL_TYPE_LONG;
-    values[1].buffer = (void *)&sn;
-    values[1].is_unsigned = true;
-
-    // Key
-    values[2].buffer_type = MYSQL_TYPE_LONG;
-    values[2].buffer = (void *)&key;
-    values[2].is_unsigned = false;
-
-    // Value
-    values[3].buffer_type = MYSQL_TYPE_LONG;
-    values[3].buffer = (void *)&val;
-    values[3].is_unsigned = false;
-
-    mysql_stmt_bind_param(pStmt, values);
-
-    rc = mysql_stmt_execute(pStmt);
-
-    if (rc != SQL_OK)
-    {
-        print_error("[battery_data]mysql_stmt_execute() returned");
-    }
-
-    return rc;
+    std::ostringstream row;
+    row << '(' << tm << ',' << sn << ',' << key << ',' << val << ')';
+    rows.push_back(row.str());
 }
 
 #endif
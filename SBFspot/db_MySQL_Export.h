@@ -36,15 +36,35 @@ DISCLAIMER:
 
 #if defined(USE_MYSQL)
 
-#include "db_MySQL.h"
+#include "db_update.h"
+#include "db_Spool.h"
+#include "db_Rollup.h"
 #include <sstream>
+#include <vector>
 
 extern bool quiet;
 extern int verbose;
 
-class db_SQL_Export : public db_SQL_Base
+// Default max number of rows in a multi-row INSERT statement
+#define SQL_DEFAULT_BATCH_SIZE 5000
+// Max size of a multi-row INSERT statement (must be lower than max_allowed_packet of the server)
+#define SQL_MAX_BATCH_BYTES (1024 * 1024)
+
+class db_SQL_Export : public db_SQL_Update
 {
 public:
+    db_SQL_Export() { m_batchsize = SQL_DEFAULT_BATCH_SIZE; m_spooling = false; m_rollup = false; m_pvostaging = false; m_spotheartbeat = 0; }
+    void set_batch_size(unsigned int batchsize) { m_batchsize = batchsize > 0 ? batchsize : SQL_DEFAULT_BATCH_SIZE; }
+    void set_spool(const std::string &filename) { m_spool.set_filename(filename); }
+    void set_spot_heartbeat(unsigned int minutes) { m_spotheartbeat = (time_t)minutes * 60; }
+    bool spooling(void) const { return m_spooling; }
+    int begin_transaction(void);
+    int commit_transaction(void);
+    int replay_spool(void);
+    int flush_spool(void) { return m_spool.flush(); }
+    int init_rollup(void);
+    int init_pvo_staging(void);
+    int maintain_partitions(unsigned int retention);
     int exportDayData(InverterData *inverters[]);
     int exportMonthData(InverterData *inverters[]);
     int exportSpotData(InverterData *inv[], time_t spottime);
@@ -68,7 +88,34 @@ public:
     }
 
 private:
-    int insert_battery_data(MYSQL_STMT *pStmt, int32_t tm, int32_t sn, int32_t key, int32_t val);
+    unsigned int m_batchsize;   // Max number of rows per INSERT statement
+    db_Spool m_spool;           // Rows waiting for the database to become available
+    bool m_spooling;            // Rows are written to the spool instead of the database
+    bool m_rollup;              // Rollup tables are available
+    bool m_pvostaging;          // PVOutput staging table is available
+    time_t m_spotheartbeat;     // Max gap between stored spot data (write-on-change)
+
+    // Rows inserted by the open transaction, spooled again when the server rolls it back
+    struct UnitOfWork
+    {
+        std::string insert;
+        std::string upsert;
+        std::vector<std::string> rows;
+    };
+    std::vector<UnitOfWork> m_unitofwork;
+
+    bool connection_lost(void);
+    void spool_unitofwork(void);
+    int insert_rows(const std::string &insert, const std::vector<std::string> &rows, const std::string &upsert = "");
+    int write_rows(const std::string &insert, const std::vector<std::string> &rows, const std::string &upsert);
+    std::string s_escaped(const std::string &str);
+    int rollup(const RollupDef &def, const std::vector<RollupRange> &ranges);
+    int pvo_datelimit(void);
+    int stage_pvodata(uint32_t serial, time_t from, time_t to);
+    int partition_table(const std::string &table, bool &completed);
+    int add_partitions(const std::string &table);
+    int drop_partitions(const std::string &table, time_t cutoff);
+    void add_battery_data(std::vector<std::string> &rows, int32_t tm, uint32_t sn, int32_t key, int32_t val);
 };
 
 #endif //#if defined(USE_MYSQL)
@@ -0,0 +1,135 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "osselect.h"
+#include "db_Rollup.h"
+#include <sstream>
+
+// With write-on-change (SpotHeartbeat) the sums are per stored poll, not per minute
+const RollupDef SpotDataRollup =
+{
+    "SpotDataRollup",
+    "SpotData",
+    "Samples,PacMin,PacMax,PacSum,PdcSum,ETotalMin,ETotalMax",
+    "COUNT(*),MIN(Pac1+Pac2+Pac3),MAX(Pac1+Pac2+Pac3),SUM(Pac1+Pac2+Pac3),SUM(Pdc1+Pdc2),MIN(ETotal),MAX(ETotal)",
+    "SUM(Samples),MIN(PacMin),MAX(PacMax),SUM(PacSum),SUM(PdcSum),MIN(ETotalMin),MAX(ETotalMax)"
+};
+
+const RollupDef DayDataRollup =
+{
+    "DayDataRollup",
+    "DayData",
+    "Samples,PowerMax,PowerSum,TotalYieldMin,TotalYieldMax",
+    "COUNT(*),MAX(Power),SUM(Power),MIN(TotalYield),MAX(TotalYield)",
+    "SUM(Samples),MAX(PowerMax),SUM(PowerSum),MIN(TotalYieldMin),MAX(TotalYieldMax)"
+};
+
+// Start of the next hour/day/month/year after tm (local time)
+// mktime() normalizes the overflow and takes care of DST changes
+static time_t next_bucket(struct tm tm, char period)
+{
+    tm.tm_isdst = -1;
+    switch (period)
+    {
+    case 'H': tm.tm_hour++; break;
+    case 'D': tm.tm_mday++; break;
+    case 'M': tm.tm_mon++; break;
+    case 'Y': tm.tm_year++; break;
+    }
+    return mktime(&tm);
+}
+
+// Start of the hour/day/month/year containing t (local time)
+static struct tm bucket_tm(time_t t, char period)
+{
+    struct tm tm;
+    localtime_s(&tm, &t);
+    tm.tm_sec = 0;
+    tm.tm_min = 0;
+    if (period != 'H') tm.tm_hour = 0;
+    if (period == 'M' || period == 'Y') tm.tm_mday = 1;
+    if (period == 'Y') tm.tm_mon = 0;
+    tm.tm_isdst = -1;
+    return tm;
+}
+
+time_t bucket_start(time_t t, char period, int offset)
+{
+    struct tm tm = bucket_tm(t, period);
+    switch (period)
+    {
+    case 'H': tm.tm_hour += offset; break;
+    case 'D': tm.tm_mday += offset; break;
+    case 'M': tm.tm_mon += offset; break;
+    case 'Y': tm.tm_year += offset; break;
+    }
+    return mktime(&tm);
+}
+
+std::vector<std::string> rollup_statements(const RollupDef &def, const char *replace, uint32_t serial, time_t from, time_t to)
+{
+    static const char periods[] = { 'H', 'D', 'M' };
+    std::vector<std::string> statements;
+    std::ostringstream sql;
+
+    for (int p = 0; p < 3; p++)
+    {
+        const char period = periods[p];
+        struct tm tm = bucket_tm(from, period);
+        time_t bucket = mktime(&tm);
+
+        while (bucket <= to)
+        {
+            const time_t next = next_bucket(tm, period);
+
+            sql.str("");
+            sql << replace << ' ' << def.table << "(Period,TimeStamp,Serial," << def.columns << ") " <<
+                "SELECT '" << period << "'," << bucket << ',' << serial << ',';
+
+            if (period == 'H')
+                sql << def.aggregates << " FROM " << def.source << " WHERE ";
+            else
+                sql << def.reaggregates << " FROM " << def.table << " WHERE Period='" << periods[p - 1] << "' AND ";
+
+            // GROUP BY: no row when there is nothing to aggregate
+            sql << "Serial=" << serial << " AND TimeStamp>=" << bucket << " AND TimeStamp<" << next << " GROUP BY Serial";
+            statements.push_back(sql.str());
+
+            tm = bucket_tm(next, period);
+            bucket = next;
+        }
+    }
+
+    return statements;
+}
@@ -0,0 +1,72 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+// Rollup tables hold hourly ('H'), daily ('D') and monthly ('M') aggregates per device
+// A bucket is always recalculated from its source rows, so it doesn't matter
+// whether rows are new, duplicate or arrive late (archive data)
+// Hours are rolled up from the source table, days from hours and months from days
+
+struct RollupDef
+{
+    const char *table;          // Rollup table
+    const char *source;         // Source table of the hourly buckets
+    const char *columns;        // Aggregate columns of the rollup table
+    const char *aggregates;     // Aggregates of the source rows (same order as columns)
+    const char *reaggregates;   // Aggregates of the rollup rows of a lower period
+};
+
+// Period of a device to refresh
+struct RollupRange
+{
+    uint32_t serial;
+    time_t from;
+    time_t to;
+};
+
+extern const RollupDef SpotDataRollup;
+extern const RollupDef DayDataRollup;
+
+// Start of the hour/day/month/year ('H','D','M','Y') containing t, moved by offset periods (local time)
+time_t bucket_start(time_t t, char period, int offset = 0);
+
+// Statements to refresh all buckets overlapping [from, to] of one device
+// replace is the "insert or replace" syntax of the database
+std::vector<std::string> rollup_statements(const RollupDef &def, const char *replace, uint32_t serial, time_t from, time_t to);
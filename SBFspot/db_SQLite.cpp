@@ -37,6 +37,7 @@ DISCLAIMER:
 #include "db_SQLite.h"
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <cinttypes>
 
 std::string db_SQL_Base::status_text(int status)
 {
@@ -58,7 +59,22 @@ std::string db_SQL_Base::status_text(int status)
     }
 }
 
-int db_SQL_Base::open(const std::string& database)
+bool db_SQL_Base::parse_profile(const std::string &name, SQLPROFILE &profile)
+{
+    if (boost::iequals(name, "default"))
+        profile = SQLP_DEFAULT;
+    else if (boost::iequals(name, "flash"))
+        profile = SQLP_FLASH;
+    else if (boost::iequals(name, "durable"))
+        profile = SQLP_DURABLE;
+    else
+        return false;
+
+    return true;
+}
+
+// A read-only connection never writes or checkpoints the database
+int db_SQL_Base::open(const std::string& database, bool readonly)
 {
     int result = SQLITE_OK;
 
@@ -73,12 +89,42 @@ int db_SQL_Base::open(const std::string& database)
         m_database = database;
 
         if (database.size() > 0)
-            result = sqlite3_open_v2(database.c_str(), &m_dbHandle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, NULL);
+            result = sqlite3_open_v2(database.c_str(), &m_dbHandle, (readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE) | SQLITE_OPEN_FULLMUTEX, NULL);
         else
             result = SQLITE_ERROR;
 
         if (result == SQLITE_OK)
-            sqlite3_busy_timeout(m_dbHandle, 2000);
+        {
+            // Wait for locks of other connections (SBFspot and SBFspotUploadDaemon share the db)
+            sqlite3_busy_timeout(m_dbHandle, m_busytimeout);
+            m_txlevel = 0;
+            m_commits = 0;
+            m_walframes = 0;
+            m_walsize = 0;
+
+            if (!readonly)
+            {
+                sqlite3_wal_hook(m_dbHandle, wal_hook, this);
+#if defined(SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE)
+                // The last connection to close also checkpoints, unless another process takes care of that
+                if (m_checkpoint == 0)
+                    sqlite3_db_config(m_dbHandle, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1, NULL);
+#endif
+            }
+
+            switch (m_profile)
+            {
+            case SQLP_FLASH:
+                // In WAL mode, synchronous=NORMAL only syncs at checkpoints and is still consistent after a power failure
+                exec_query("PRAGMA synchronous=NORMAL;PRAGMA temp_store=MEMORY;PRAGMA cache_size=-8192;PRAGMA mmap_size=67108864;PRAGMA journal_size_limit=4194304");
+                break;
+            case SQLP_DURABLE:
+                exec_query("PRAGMA synchronous=FULL");
+                break;
+            default:
+                break;
+            }
+        }
         else
         {
             print_error("Can't open SQLite db [" + m_database + "]");
@@ -94,39 +140,64 @@ int db_SQL_Base::close(void)
 {
     int result = SQLITE_OK;
 
+    for (auto &stmt : m_statements)
+        sqlite3_finalize(stmt.second);
+    m_statements.clear();
+
     if ((result = sqlite3_close(m_dbHandle)) != SQLITE_OK)
         print_error("Can't close SQLite db [" + m_database + "]");
     else
     {
         m_database = "";
         m_dbHandle = NULL;
+        m_txlevel = 0;
     }
 
     return result;
 }
 
-int db_SQL_Base::exec_query(const std::string &qry)
+// Returns a reset statement, prepared on first use and kept until close()
+sqlite3_stmt *db_SQL_Base::prepared(const std::string &sql)
 {
-    int result = SQLITE_OK;
-    int retrycount = 0;
-
-    do
+    auto it = m_statements.find(sql);
+    if (it != m_statements.end())
     {
-        result = sqlite3_exec(m_dbHandle, qry.c_str(), NULL, NULL, NULL);
-        if (result != SQLITE_OK)
-        {
-            print_error("sqlite3_exec() returned", qry);
-            if (++retrycount > SQL_BUSY_RETRY_COUNT)
-                break;
-        }
-
-    } while ((result == SQLITE_BUSY) || (result == SQLITE_LOCKED));
+        sqlite3_reset(it->second);
+        sqlite3_clear_bindings(it->second);
+        return it->second;
+    }
 
-    if ((result == SQLITE_OK) && (retrycount > 0))
+    sqlite3_stmt *pStmt = NULL;
+    if (sqlite3_prepare_v2(m_dbHandle, sql.c_str(), -1, &pStmt, NULL) != SQLITE_OK)
     {
-        std::cout << "Query executed successfully after " << retrycount << " time" << (retrycount == 1 ? "" : "s") << std::endl;
+        print_error("sqlite3_prepare_v2() returned", sql);
+        return NULL;
     }
 
+    m_statements[sql] = pStmt;
+    return pStmt;
+}
+
+// Append a value to a PVOutput batch without temporary strings
+static void append_int(std::string &buf, int64_t value)
+{
+    char tmp[24];
+    buf.append(tmp, snprintf(tmp, sizeof(tmp), "%" PRId64, value));
+}
+
+static void append_double(std::string &buf, double value)
+{
+    char tmp[32];
+    buf.append(tmp, snprintf(tmp, sizeof(tmp), "%g", value));  // Same as the default ostream format
+}
+
+// Locks held by other connections are waited for by the busy timeout (see open)
+int db_SQL_Base::exec_query(const std::string &qry)
+{
+    int result = sqlite3_exec(m_dbHandle, qry.c_str(), NULL, NULL, NULL);
+    if (result != SQLITE_OK)
+        print_error("sqlite3_exec() returned", qry);
+
     return result;
 }
 
@@ -137,6 +208,102 @@ int db_SQL_Base::exec_query_multi(const std::string &qry)
     return exec_query(qry);
 }
 
+// Start a (nested) transaction
+// The outermost level starts an immediate transaction, inner levels are mapped to savepoints
+// This allows a caller to group several exports in a single unit of work (one commit/fsync)
+// while the exports keep their own transaction handling
+int db_SQL_Base::begin_transaction(void)
+{
+    int rc = SQLITE_OK;
+
+    if (m_txlevel == 0)
+        rc = exec_query("BEGIN IMMEDIATE TRANSACTION");
+    else
+        rc = exec_query("SAVEPOINT sp" + std::to_string(m_txlevel));
+
+    if (rc == SQLITE_OK)
+        m_txlevel++;
+
+    return rc;
+}
+
+int db_SQL_Base::commit_transaction(void)
+{
+    int rc = SQLITE_OK;
+
+    if (m_txlevel == 0)
+        return SQLITE_ERROR; // No transaction active
+
+    if (--m_txlevel == 0)
+    {
+        if ((rc = exec_query("COMMIT")) == SQLITE_OK)
+            m_commits++;
+        else
+        {
+            print_error("Commit failed. Rolling back now...");
+            exec_query("ROLLBACK");
+        }
+    }
+    else
+        rc = exec_query("RELEASE sp" + std::to_string(m_txlevel));
+
+    return rc;
+}
+
+int db_SQL_Base::rollback_transaction(void)
+{
+    int rc = SQLITE_OK;
+
+    if (m_txlevel == 0)
+        return SQLITE_ERROR; // No transaction active
+
+    if (--m_txlevel == 0)
+        rc = exec_query("ROLLBACK");
+    else
+    {
+        // Undo the changes since the savepoint and remove it from the transaction stack
+        const std::string sp = "sp" + std::to_string(m_txlevel);
+        if ((rc = exec_query("ROLLBACK TO " + sp)) == SQLITE_OK)
+            rc = exec_query("RELEASE " + sp);
+    }
+
+    return rc;
+}
+
+// Called by SQLite after each commit in WAL mode
+int db_SQL_Base::wal_hook(void *pArg, sqlite3 *db, const char *dbName, int nPages)
+{
+    db_SQL_Base *self = static_cast<db_SQL_Base *>(pArg);
+
+    // WAL is restarted after a checkpoint
+    self->m_walframes += (nPages >= self->m_walsize) ? nPages - self->m_walsize : nPages;
+    self->m_walsize = nPages;
+
+    // Registering a WAL hook disables the default auto-checkpoint
+    // Do the same as SQLite does by default, unless checkpoints are left to another process
+    if ((self->m_checkpoint > 0) && (nPages >= self->m_checkpoint))
+        sqlite3_wal_checkpoint_v2(db, dbName, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+
+    return SQLITE_OK;
+}
+
+// Copy the WAL to the database as far as possible, without waiting for other connections
+int db_SQL_Base::checkpoint(int *logged, int *checkpointed)
+{
+    int rc = sqlite3_wal_checkpoint_v2(m_dbHandle, "main", SQLITE_CHECKPOINT_PASSIVE, logged, checkpointed);
+    if (rc != SQLITE_OK)
+        print_error("Checkpoint failed");
+
+    return rc;
+}
+
+std::string db_SQL_Base::write_stats(void) const
+{
+    std::ostringstream stats;
+    stats << m_commits << " commit" << (m_commits == 1 ? "" : "s") << ", " << m_walframes << " WAL page" << (m_walframes == 1 ? "" : "s") << " written";
+    return stats.str();
+}
+
 int db_SQL_Base::type_label(InverterData *inverters[])
 {
     std::stringstream sql;
@@ -206,118 +373,161 @@ int db_SQL_Base::device_status(InverterData *inverters[], time_t spottime)
 
 int db_SQL_Base::batch_get_archdaydata(std::string &data, unsigned int Serial, int datelimit, int statuslimit, int& recordcount)
 {
-    std::stringstream sql;
     int rc = SQLITE_OK;
     recordcount = 0;
 
-    sqlite3_stmt *pStmt = NULL;
-
-    sql << "SELECT strftime('%Y%m%d,%H:%M',TimeStamp),V1,V2,V3,V4,V5,V6,V7,V8,V9,V10,V11,V12 FROM [vwPvoData] WHERE "
-        "TimeStamp>DATE(DATE(),'" << -(datelimit - 2) << " day') "
+    // PvoStaging is filled by SBFspot when the DayData is stored
+    // Un-uploaded rows of a device are read from the PvoStaging_Upload index
+    sqlite3_stmt *pStmt = prepared(
+        "SELECT strftime('%Y%m%d,%H:%M',TimeStamp,'unixepoch','localtime'),V1,V2,V3,V4,V5,V6,V7,V8,V9,V10,V11,V12 FROM PvoStaging WHERE "
+        "TimeStamp>strftime('%s',DATE('now','localtime',?1),'utc') "
         "AND PVoutput IS NULL "
-        "AND Serial=" << Serial << " "
+        "AND Serial=?2 "
         "ORDER BY TimeStamp "
-        "LIMIT " << statuslimit;
+        "LIMIT ?3");
 
-    rc = sqlite3_prepare_v2(m_dbHandle, sql.str().c_str(), -1, &pStmt, NULL);
-
-    if (pStmt != NULL)
+    if (pStmt == NULL)
+        rc = SQLITE_ERROR;
+    else
     {
-        std::stringstream result;
+        const std::string days = std::to_string(-(datelimit - 2)) + " day";
+        sqlite3_bind_text(pStmt, 1, days.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(pStmt, 2, Serial);
+        sqlite3_bind_int(pStmt, 3, statuslimit);
+
+        // Rows are formatted straight into data, trailing empty values are left out
+        data.reserve(data.length() + statuslimit * PVO_BATCH_ROWSIZE);
         while (sqlite3_step(pStmt) == SQLITE_ROW)
         {
-            result.str("");
-
-            std::string dt = (char *)sqlite3_column_text(pStmt, 0);
-            // Energy Generation
-            int64_t V1 = sqlite3_column_int64(pStmt, 1);
-            // Power Generation
-            int64_t V2 = sqlite3_column_int64(pStmt, 2);
-
             // from 2nd record, add a record separator
-            if (!data.empty()) result << ";";
-
-            // Mandatory values
-            result << dt << "," << V1 << "," << V2;
-
-            result << ",";
-            // Energy Consumption
-            if (sqlite3_column_type(pStmt, 3) != SQLITE_NULL)
-                result << sqlite3_column_int64(pStmt, 3);
+            if (!data.empty()) data += ';';
+
+            // Date, Energy Generation and Power Generation are mandatory
+            data.append((const char *)sqlite3_column_text(pStmt, 0), sqlite3_column_bytes(pStmt, 0));
+            data += ',';
+            append_int(data, sqlite3_column_int64(pStmt, 1));
+            data += ',';
+            append_int(data, sqlite3_column_int64(pStmt, 2));
+
+            // Energy Consumption, Power Consumption, Temperature, Voltage and Extended values
+            size_t end = data.length();
+            for (int col = 3; col <= 12; col++)
+            {
+                data += ',';
+                if (sqlite3_column_type(pStmt, col) != SQLITE_NULL)
+                {
+                    if (col <= 4)
+                        append_int(data, sqlite3_column_int64(pStmt, col));
+                    else
+                        append_double(data, sqlite3_column_double(pStmt, col));
+                    end = data.length();
+                }
+            }
+            data.resize(end);
 
-            result << ",";
-            // Power Consumption
-            if (sqlite3_column_type(pStmt, 4) != SQLITE_NULL)
-                result << sqlite3_column_int64(pStmt, 4);
+            recordcount++;
+        }
 
-            result << ",";
-            // Temperature
-            if (sqlite3_column_type(pStmt, 5) != SQLITE_NULL)
-                result << sqlite3_column_double(pStmt, 5);
+        sqlite3_reset(pStmt);
+    }
 
-            result << ",";
-            // Voltage
-            if (sqlite3_column_type(pStmt, 6) != SQLITE_NULL)
-                result << sqlite3_column_double(pStmt, 6);
+    return rc;
+}
 
-            // Extended values
-            for (int extval = 7; extval <= 12; extval++)
-            {
-                result << ",";
-                if (sqlite3_column_type(pStmt, extval) != SQLITE_NULL)
-                    result << sqlite3_column_double(pStmt, extval);
-            }
+// Number of datapoints of a device waiting to be uploaded,
+// and the number that's too old to be uploaded (outside the datelimit window)
+int db_SQL_Base::batch_get_backlog(unsigned int Serial, int datelimit, int &count, int &expired)
+{
+    int rc = SQLITE_OK;
+    count = 0;
+    expired = 0;
 
-            const std::string& str = result.str();
-            int end = str.length();
+    sqlite3_stmt *pStmt = prepared(
+        "SELECT IFNULL(SUM(TimeStamp>strftime('%s',DATE('now','localtime',?1),'utc')),0),COUNT(*) FROM PvoStaging WHERE "
+        "PVoutput IS NULL "
+        "AND Serial=?2");
 
-            for (std::string::const_reverse_iterator it = str.rbegin(); it != str.rend(); ++it, end--)
-            {
-                if ((*it) != ',')
-                    break;
-            }
+    if (pStmt == NULL)
+        rc = SQLITE_ERROR;
+    else
+    {
+        const std::string days = std::to_string(-(datelimit - 2)) + " day";
+        sqlite3_bind_text(pStmt, 1, days.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(pStmt, 2, Serial);
 
-            data.append(result.str().substr(0, end));
-            recordcount++;
+        if (sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            count = sqlite3_column_int(pStmt, 0);
+            expired = sqlite3_column_int(pStmt, 1) - count;
         }
+        else
+            rc = SQLITE_ERROR;
 
-        sqlite3_finalize(pStmt);
+        sqlite3_reset(pStmt);
     }
 
     return rc;
 }
 
-int db_SQL_Base::batch_set_pvoflag(const std::string &data, unsigned int Serial)
+// flagged: number of DayData rows accepted by PVOutput
+int db_SQL_Base::batch_set_pvoflag(const std::string &data, unsigned int Serial, int &flagged)
 {
-    std::stringstream sql;
     int rc = SQLITE_OK;
+    flagged = 0;
 
-    std::vector<std::string> items;
-    boost::split(items, data, boost::is_any_of(";"));
+    // Items of the response are YYYYMMDD,HH:MM,<0|1>
+    // Only accepted items (1) are flagged
+    const bool tx = (begin_transaction() == SQLITE_OK);
 
-    sql << "UPDATE OR ROLLBACK DayData "
-        "SET PVoutput=1 "
-        "WHERE Serial=" << Serial << " "
-        "AND strftime('%Y%m%d,%H:%M',datetime(TimeStamp, 'unixepoch', 'localtime')) "
-        "IN (";
+    // The local date/time is converted to unix time, so the rows are found by primary key
+    sqlite3_stmt *pStaging = prepared("UPDATE PvoStaging SET PVoutput=1 WHERE Serial=?1 AND TimeStamp=strftime('%s',?2,'utc')");
+    sqlite3_stmt *pDayData = prepared("UPDATE DayData SET PVoutput=1 WHERE Serial=?1 AND TimeStamp=strftime('%s',?2,'utc')");
+    if ((pStaging == NULL) || (pDayData == NULL))
+        rc = SQLITE_ERROR;
 
-    bool firstitem = true;
-    for (const auto &item : items)
+    char ts[] = "YYYY-MM-DD HH:MM";
+    for (size_t pos = 0; (rc == SQLITE_OK) && (pos < data.length()); )
     {
-        if ((item.size() == 16) && (item.back() == '1'))
+        size_t next = data.find(';', pos);
+        if (next == std::string::npos) next = data.length();
+
+        const char *item = data.c_str() + pos;
+        if ((next - pos == 16) && (item[15] == '1'))
         {
-            if (!firstitem)
-                sql << ",";
-            else
-                firstitem = false;
-            sql << s_quoted(item.substr(0, 14));
+            memcpy(ts, item, 4);
+            memcpy(ts + 5, item + 4, 2);
+            memcpy(ts + 8, item + 6, 2);
+            memcpy(ts + 11, item + 9, 5);
+
+            for (sqlite3_stmt *pStmt : { pStaging, pDayData })
+            {
+                sqlite3_bind_int64(pStmt, 1, Serial);
+                sqlite3_bind_text(pStmt, 2, ts, 16, SQLITE_STATIC);
+
+                if (sqlite3_step(pStmt) != SQLITE_DONE)
+                {
+                    rc = SQLITE_ERROR;
+                    print_error("sqlite3_step() returned", sqlite3_sql(pStmt));
+                }
+                else if (pStmt == pDayData)
+                    flagged += sqlite3_changes(m_dbHandle);
+                sqlite3_reset(pStmt);
+            }
         }
+
+        pos = next + 1;
     }
 
-    sql << ")";
+    if (tx)
+    {
+        if (rc == SQLITE_OK)
+            commit_transaction();
+        else
+            rollback_transaction();
+    }
 
-    if ((rc = exec_query(sql.str())) != SQLITE_OK)
-        print_error("exec_query() returned", sql.str());
+    if (rc != SQLITE_OK)
+        flagged = 0;
 
     return rc;
 }
@@ -39,6 +39,7 @@ DISCLAIMER:
 #include "osselect.h"
 #include "SBFspot.h"
 #include <sqlite3.h>
+#include <map>
 
 extern bool quiet;
 extern int verbose;
@@ -48,9 +49,20 @@ extern int verbose;
 #define SQL_BATCH_DATELIMIT     "Batch_DateLimit"
 #define SQL_BATCH_STATUSLIMIT   "Batch_StatusLimit"
 
+#define PVO_BATCH_ROWSIZE       64      // Typical length of a row formatted by batch_get_archdaydata()
+
 #define SQL_MINIMUM_SCHEMA_VERSION 1
-#define SQL_RECOMMENDED_SCHEMA_VERSION 1
-#define SQL_BUSY_RETRY_COUNT 20
+#define SQL_RECOMMENDED_SCHEMA_VERSION 2
+#define SQL_BUSY_TIMEOUT        10000   // Max time (ms) to wait for a lock held by another connection
+#define SQL_CHECKPOINT_PAGES    1000    // WAL size that triggers a checkpoint (SQLite default)
+
+// Performance profile, applied at open()
+enum SQLPROFILE
+{
+    SQLP_DEFAULT = 0,   // SQLite defaults
+    SQLP_FLASH = 1,     // Fewer fsyncs and writes for SD cards: synchronous=NORMAL, temp store in memory, mmap
+    SQLP_DURABLE = 2    // synchronous=FULL: every commit survives a power failure
+};
 
 class db_SQL_Base
 {
@@ -64,20 +76,40 @@ public:
 protected:
     sqlite3 *m_dbHandle;
     std::string m_database;
+    int m_txlevel;              // Transaction nesting level (0=autocommit)
+    unsigned int m_commits;     // Number of committed transactions since open()
+    unsigned int m_walframes;   // Number of pages appended to the WAL since open()
+    int m_walsize;              // Current size of the WAL (pages)
+    SQLPROFILE m_profile;       // Performance profile
+    int m_busytimeout;          // Max time (ms) to wait for a lock
+    int m_checkpoint;           // WAL size (pages) that triggers a checkpoint, 0=leave checkpoints to another process
+    std::map<std::string, sqlite3_stmt*> m_statements;  // Prepared statements, finalized by close()
 
 public:
-    db_SQL_Base() { m_dbHandle = NULL; }
+    db_SQL_Base() { m_dbHandle = NULL; m_txlevel = 0; m_commits = 0; m_walframes = 0; m_walsize = 0; m_profile = SQLP_DEFAULT; m_busytimeout = SQL_BUSY_TIMEOUT; m_checkpoint = SQL_CHECKPOINT_PAGES; }
     ~db_SQL_Base() { if (m_dbHandle) close(); }
-    int open(const std::string& database);
+    static bool parse_profile(const std::string &name, SQLPROFILE &profile);
+    void set_profile(SQLPROFILE profile) { m_profile = profile; }
+    void set_busy_timeout(int timeout) { m_busytimeout = timeout; }
+    void set_checkpoint(int pages) { m_checkpoint = pages; }
+    int open(const std::string& database, bool readonly = false);
     int close(void);
     int exec_query(const std::string &qry);
     int exec_query_multi(const std::string &qry);
+    int begin_transaction(void);
+    int commit_transaction(void);
+    int rollback_transaction(void);
+    int checkpoint(int *logged = NULL, int *checkpointed = NULL);
+    bool in_transaction(void) const { return m_txlevel > 0; }
+    std::string write_stats(void) const;
     std::string errortext(void) { return m_dbHandle ? sqlite3_errmsg(m_dbHandle) : "Unable to open the database file [" + m_database + "]"; }
     bool isopen(void) { return (m_dbHandle != NULL); }
+    int ping(void) { return (m_dbHandle != NULL) ? SQL_OK : SQL_ERROR; }
     int type_label(InverterData *inverters[]);
     int device_status(InverterData *inverters[], time_t spottime);
     int batch_get_archdaydata(std::string &data, unsigned int Serial, int datelimit, int statuslimit, int& recordcount);
-    int batch_set_pvoflag(const std::string &data, unsigned int Serial);
+    int batch_set_pvoflag(const std::string &data, unsigned int Serial, int &flagged);
+    int batch_get_backlog(unsigned int Serial, int datelimit, int &count, int &expired);
     int set_config(const std::string key, const std::string value);
     int get_config(const std::string key, std::string &value);
     int get_config(const std::string key, int &value);
@@ -92,6 +124,10 @@ protected:
     void print_error(std::string msg, std::string sql) { std::cout << timestamp() << "Error: " << msg << ": '" << (m_dbHandle != NULL ? sqlite3_errmsg(m_dbHandle) : "null") << "' while executing\n" << sql << std::endl; }
     std::string strftime_t(const time_t utctime) { return static_cast<std::ostringstream &&>((std::ostringstream() << utctime)).str(); }
     std::string timestamp(void);
+    sqlite3_stmt *prepared(const std::string &sql);
+
+private:
+    static int wal_hook(void *pArg, sqlite3 *db, const char *dbName, int nPages);
 };
 
 #endif //#if defined(USE_SQLITE)
@@ -36,6 +36,355 @@ DISCLAIMER:
 
 #include "db_SQLite_Export.h"
 #include "mppt.h"
+#include <boost/algorithm/string/join.hpp>
+#include <cerrno>
+#include <cstring>
+#include <set>
+
+// Create the rollup tables in databases created by a previous version
+int db_SQL_Export::init_rollup(void)
+{
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS SpotDataRollup ("
+        "Period char(1) NOT NULL,TimeStamp datetime NOT NULL,Serial int(4) NOT NULL,Samples int(4),"
+        "PacMin int,PacMax int,PacSum int(8),PdcSum int(8),ETotalMin int(8),ETotalMax int(8),"
+        "PRIMARY KEY (Serial, Period, TimeStamp));"
+        "CREATE TABLE IF NOT EXISTS DayDataRollup ("
+        "Period char(1) NOT NULL,TimeStamp datetime NOT NULL,Serial int(4) NOT NULL,Samples int(4),"
+        "PowerMax int(8),PowerSum int(8),TotalYieldMin int(8),TotalYieldMax int(8),"
+        "PRIMARY KEY (Serial, Period, TimeStamp));";
+
+    int rc = exec_query(sql);
+    if (rc != SQLITE_OK)
+        print_error("Rollup tables not available");
+
+    m_rollup = (rc == SQLITE_OK);
+
+    return rc;
+}
+
+// Refresh the rollup buckets of a device
+// A failure is reported by the caller, but doesn't undo the export of the raw data
+int db_SQL_Export::rollup(const RollupDef &def, uint32_t serial, time_t from, time_t to)
+{
+    int rc = SQLITE_OK;
+
+    if (!m_rollup)
+        return rc;
+
+    for (const auto &sql : rollup_statements(def, "INSERT OR REPLACE INTO", serial, from, to))
+    {
+        if ((rc = exec_query(sql)) != SQLITE_OK)
+            break;
+    }
+
+    return rc;
+}
+
+// Create the PVOutput staging table in databases created by a previous version
+// A new table is filled with the data that is still to be uploaded
+int db_SQL_Export::init_pvo_staging(void)
+{
+    const bool created = !table_exists("PvoStaging");
+
+    const char *sql =
+        "CREATE TABLE IF NOT EXISTS PvoStaging ("
+        "TimeStamp datetime NOT NULL,Serial int(4) NOT NULL,"
+        "V1 int(8),V2 int(8),V3 int(8),V4 int(8),V5 float,V6 float,"
+        "V7 float,V8 float,V9 float,V10 float,V11 float,V12 float,PVoutput int(1),"
+        "PRIMARY KEY (TimeStamp, Serial));"
+        "CREATE INDEX IF NOT EXISTS PvoStaging_Upload ON PvoStaging(Serial, TimeStamp) WHERE PVoutput IS NULL;";
+
+    int rc = exec_query_multi(sql);
+    m_pvostaging = (rc == SQLITE_OK);
+
+    if (m_pvostaging && created)
+        rc = stage_pvodata(0, time(NULL) - pvo_datelimit() * 86400, time(NULL));
+
+    return rc;
+}
+
+// Number of days PVOutput accepts uploads of (set by SBFspotUploadDaemon)
+int db_SQL_Export::pvo_datelimit(void)
+{
+    int datelimit = 90;
+    get_config(SQL_BATCH_DATELIMIT, datelimit);
+    return datelimit;
+}
+
+// Average of a spot data column over the 5 minutes of dd.TimeStamp
+// With write-on-change, a window without spot data has the values of the last stored sample
+static std::string spot_average(const std::string &expr, time_t heartbeat)
+{
+    const std::string average = "(SELECT avg(" + expr + ") FROM SpotData s WHERE s.TimeStamp>=dd.TimeStamp-150 AND s.TimeStamp<dd.TimeStamp+150 AND s.Serial=dd.Serial)";
+    if (heartbeat == 0)
+        return average;
+
+    return "COALESCE(" + average + ",(SELECT " + expr + " FROM SpotData s WHERE s.TimeStamp<dd.TimeStamp-150 AND s.TimeStamp>=dd.TimeStamp-150-" + std::to_string(heartbeat) +
+        " AND s.Serial=dd.Serial ORDER BY s.TimeStamp DESC LIMIT 1))";
+}
+
+// Copy the DayData rows that are not yet uploaded to PVOutput to the staging table,
+// together with the consumption and spot data averaged over the same 5 minutes (see vwPvoData)
+// serial=0 stages the rows of all devices
+int db_SQL_Export::stage_pvodata(uint32_t serial, time_t from, time_t to)
+{
+    int rc = SQLITE_OK;
+
+    if (!m_pvostaging)
+        return rc;
+
+    std::ostringstream sql;
+    sql << "INSERT OR REPLACE INTO PvoStaging(TimeStamp,Serial,V1,V2,V3,V4,V5,V6) "
+        "SELECT dd.TimeStamp,dd.Serial,dd.TotalYield,dd.Power,"
+        "(SELECT avg(c.EnergyUsed) FROM Consumption c WHERE c.TimeStamp>=dd.TimeStamp-150 AND c.TimeStamp<dd.TimeStamp+150),"
+        "(SELECT avg(c.PowerUsed) FROM Consumption c WHERE c.TimeStamp>=dd.TimeStamp-150 AND c.TimeStamp<dd.TimeStamp+150),"
+        << spot_average("s.Temperature", m_spotheartbeat) << ',' << spot_average("s.Uac1", m_spotheartbeat) <<
+        " FROM DayData dd WHERE dd.TimeStamp BETWEEN " << from << " AND " << to << " AND dd.PVoutput IS NULL";
+    if (serial != 0)
+        sql << " AND dd.Serial=" << serial;
+
+    if ((rc = exec_query(sql.str())) != SQLITE_OK)
+        print_error("[pvo_staging]exec_query() returned", sql.str());
+
+    return rc;
+}
+
+// Config key of the years moved to an archive file (comma separated)
+#define SQL_SPOT_ARCHIVES "SpotArchives"
+
+static const char *SpotTables[] = { "SpotData", "SpotDataX" };
+
+static int year_of(time_t t)
+{
+    struct tm tm;
+    localtime_s(&tm, &t);
+    return tm.tm_year + 1900;
+}
+
+static std::string year_list(const std::set<int> &years)
+{
+    std::ostringstream list;
+    for (const int year : years)
+        list << (year == *years.begin() ? "" : ",") << year;
+    return list.str();
+}
+
+// Spot data of previous years is moved to a database file per year (<database>_<year>.db)
+// SQLite views can't refer to an attached database, so the views of the main database
+// (vwSpotData, ...) only show the current year. Attach an archive to query its year.
+// Retention deletes the archives of the years older than 'retention' months (0=keep all)
+int db_SQL_Export::maintain_partitions(unsigned int retention)
+{
+    int rc = SQLITE_OK;
+
+    if (!isopen())
+        return rc;
+
+    // The aggregates of the deleted spot data are kept in the rollups
+    if ((retention > 0) && !m_rollup)
+    {
+        std::cout << "SQL_SpotRetention ignored: rollup tables are not available" << std::endl;
+        retention = 0;
+    }
+
+    set_migration_timeout(SQL_MIGRATION_TIMEOUT);
+
+    std::set<int> years;
+    std::string archives;
+    get_config(SQL_SPOT_ARCHIVES, archives);
+    std::istringstream list(archives);
+    for (std::string year; std::getline(list, year, ',');)
+        years.insert(atoi(year.c_str()));
+
+    // Move the data of the previous years, one year at a time
+    const char *oldest = "SELECT MIN(TimeStamp) FROM (SELECT MIN(TimeStamp) AS TimeStamp FROM main.SpotData UNION ALL SELECT MIN(TimeStamp) FROM main.SpotDataX)";
+    const time_t thisyear = bucket_start(time(NULL), 'Y');
+    int64_t first = thisyear;
+    bool completed = true;
+
+    select_int(oldest, first);
+
+    while ((rc == SQLITE_OK) && completed && (first < thisyear))
+    {
+        const int year = year_of(first);
+
+        if ((rc = attach_archive(year)) == SQLITE_OK)
+        {
+            for (const char *table : SpotTables)
+            {
+                if (((rc = archive_table(table, year, bucket_start(first, 'Y'), bucket_start(first, 'Y', 1), completed)) != SQLITE_OK) || !completed)
+                    break;
+            }
+
+            exec_query("DETACH DATABASE y" + std::to_string(year));
+        }
+
+        if ((rc == SQLITE_OK) && completed)
+        {
+            years.insert(year);
+            rc = set_config(SQL_SPOT_ARCHIVES, year_list(years));
+
+            first = thisyear;
+            select_int(oldest, first);
+        }
+    }
+
+    // Drop the archives of the years before the retention period
+    if ((rc == SQLITE_OK) && (retention > 0))
+    {
+        const time_t cutoff = bucket_start(time(NULL), 'M', -(int)retention);
+
+        while (!years.empty() && (year_of(cutoff) > *years.begin()))
+        {
+            if ((rc = drop_archive(*years.begin())) != SQLITE_OK)
+                break;
+
+            years.erase(years.begin());
+            set_config(SQL_SPOT_ARCHIVES, year_list(years));
+        }
+    }
+
+    return rc;
+}
+
+// Archive file of a year: <database>_<year>.db
+std::string db_SQL_Export::archive_file(int year)
+{
+    std::string file = m_database;
+    const size_t ext = file.rfind('.');
+    if ((ext != std::string::npos) && (ext > file.find_last_of("/\\") + 1))
+        file.erase(ext);
+
+    return file + "_" + std::to_string(year) + ".db";
+}
+
+// Attach the archive of a year as y<year>
+// The tables and indexes are created with the definition of the main database
+int db_SQL_Export::attach_archive(int year)
+{
+    const std::string schema = "y" + std::to_string(year);
+    int64_t attached = 0;
+
+    select_int("SELECT COUNT(*) FROM pragma_database_list WHERE name='" + schema + "'", attached);
+    if (attached > 0)
+        return SQLITE_OK;
+
+    // The main database is opened without SQLITE_OPEN_CREATE, which also applies to ATTACH
+    sqlite3 *archive = NULL;
+    int rc = sqlite3_open_v2(archive_file(year).c_str(), &archive, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    sqlite3_close(archive);
+
+    if (rc == SQLITE_OK)
+        rc = exec_query("ATTACH DATABASE " + s_quoted(archive_file(year)) + " AS " + schema);
+    if (rc != SQLITE_OK)
+    {
+        print_error("Unable to attach " + archive_file(year));
+        return rc;
+    }
+
+    // Tables before indexes
+    const char *sql = "SELECT type,name,sql FROM main.sqlite_master WHERE tbl_name IN ('SpotData','SpotDataX') AND type IN ('table','index') AND sql IS NOT NULL ORDER BY type DESC, name";
+    std::vector<std::string> types, names, ddl;
+    select_column(sql, types, 0);
+    select_column(sql, names, 1);
+    select_column(sql, ddl, 2);
+
+    for (size_t i = 0; (rc == SQLITE_OK) && (i < ddl.size()); i++)
+    {
+        const bool table = (types[i] == "table");
+        const size_t pos = table ? ddl[i].find('(') : ddl[i].find(" ON ");
+        if (pos != std::string::npos)
+            rc = exec_query("CREATE " + std::string(table ? "TABLE" : "INDEX") + " IF NOT EXISTS " + schema + "." + names[i] + " " + ddl[i].substr(pos));
+    }
+
+    return rc;
+}
+
+// Move the rows of [from, to) to the archive, a batch per transaction
+int db_SQL_Export::archive_table(const std::string &table, int year, time_t from, time_t to, bool &completed)
+{
+    // Generated columns are not listed
+    std::vector<std::string> columns;
+    select_column("SELECT '[' || name || ']' FROM pragma_table_info('" + table + "')", columns);
+    const std::string cols = boost::algorithm::join(columns, ",");
+    const std::string archive = "y" + std::to_string(year) + "." + table;
+
+    auto move = [&](int64_t first, int64_t last)
+    {
+        std::ostringstream sql;
+        last = std::min<int64_t>(last, to);
+        sql << "INSERT OR REPLACE INTO " << archive << '(' << cols << ") SELECT " << cols << " FROM main." << table << " WHERE TimeStamp>=" << first << " AND TimeStamp<" << last << ';'
+            << "DELETE FROM main." << table << " WHERE TimeStamp>=" << first << " AND TimeStamp<" << last;
+        return sql.str();
+    };
+
+    std::ostringstream where;
+    where << "TimeStamp>=" << from << " AND TimeStamp<" << to;
+
+    const std::string name = table + "_" + std::to_string(year);
+    int rc = migrate_batches(name, "main." + table, "TimeStamp", move, completed, where.str());
+    if ((rc == SQLITE_OK) && completed)
+        clear_checkpoint(name);
+
+    return rc;
+}
+
+// Refresh the rollups of an archived year and delete its file
+int db_SQL_Export::drop_archive(int year)
+{
+    int rc = attach_archive(year);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    const std::string schema = "y" + std::to_string(year);
+    const std::string source = schema + ".SpotData";
+    RollupDef def = SpotDataRollup;
+    def.source = source.c_str();
+
+    std::vector<std::string> serials;
+    select_column("SELECT DISTINCT Serial FROM " + source, serials);
+
+    struct tm year_tm = {};
+    year_tm.tm_year = year - 1900;
+    year_tm.tm_mday = 1;
+    year_tm.tm_isdst = -1;
+    const time_t from = mktime(&year_tm);
+
+    if ((rc = begin_transaction()) == SQLITE_OK)
+    {
+        for (const auto &serial : serials)
+        {
+            if ((rc = rollup(def, (uint32_t)strtoul(serial.c_str(), NULL, 10), from, bucket_start(from, 'Y', 1) - 1)) != SQLITE_OK)
+            {
+                print_error("[partitions]rollup() returned");
+                break;
+            }
+        }
+
+        if (rc == SQLITE_OK)
+            rc = commit_transaction();
+        else
+            rollback_transaction();
+    }
+
+    if (rc == SQLITE_OK)
+        rc = exec_query("DETACH DATABASE " + schema);
+
+    if (rc == SQLITE_OK)
+    {
+        // Keep the archive in the list, the next run tries again
+        if (remove(archive_file(year).c_str()) != 0)
+        {
+            std::cout << "Unable to delete " << archive_file(year) << ": " << strerror(errno) << std::endl;
+            rc = SQLITE_ERROR;
+        }
+        else if (isverbose(2))
+            std::cout << "Deleted " << archive_file(year) << std::endl;
+    }
+
+    return rc;
+}
 
 int db_SQL_Export::exportDayData(InverterData *inverters[])
 {
@@ -45,7 +394,7 @@ int db_SQL_Export::exportDayData(InverterData *inverters[])
     sqlite3_stmt* pStmt;
     if ((rc = sqlite3_prepare_v2(m_dbHandle, sql, strlen(sql), &pStmt, NULL)) == SQLITE_OK)
     {
-        exec_query("BEGIN IMMEDIATE TRANSACTION");
+        const bool tx = (begin_transaction() == SQLITE_OK);
 
         for (uint32_t inv=0; inverters[inv]!=NULL && inv<MAX_INVERTERS; inv++)
         {
@@ -75,12 +424,17 @@ int db_SQL_Export::exportDayData(InverterData *inverters[])
 
             if (first_rec < last_rec) // Production data found or all zero?
             {
+                time_t first_tm = 0, last_tm = 0;
+
                 // Store data from first to last record
                 for (unsigned int idx = first_rec; idx <= last_rec; idx++)
                 {
                     // Invalid dates are not written to db
                     if (inverters[inv]->dayData[idx].datetime != 0)
                     {
+                        if (first_tm == 0) first_tm = inverters[inv]->dayData[idx].datetime;
+                        last_tm = inverters[inv]->dayData[idx].datetime;
+
                         sqlite3_bind_int(pStmt, 1, (int)inverters[inv]->dayData[idx].datetime);
                         // Fix #269
                         // To store unsigned int32 serial numbers, we're using sqlite3_bind_int64
@@ -102,17 +456,27 @@ int db_SQL_Export::exportDayData(InverterData *inverters[])
                         rc = SQLITE_OK;
                     }
                 }
+
+                // Recalculate the aggregates of the stored period (also for archive data arriving late)
+                if ((rc == SQLITE_OK) && (first_tm != 0))
+                {
+                    if (rollup(DayDataRollup, inverters[inv]->Serial, first_tm, last_tm) != SQLITE_OK)
+                        print_error("[day_data]rollup() returned");
+                    stage_pvodata(inverters[inv]->Serial, first_tm, last_tm);
+                }
             }
         }
 
         sqlite3_finalize(pStmt);
 
         if (rc == SQLITE_OK)
-            exec_query("COMMIT");
+        {
+            if (tx) commit_transaction();
+        }
         else
         {
             print_error("[day_data]Transaction failed. Rolling back now...");
-            exec_query("ROLLBACK");
+            if (tx) rollback_transaction();
         }
     }
 
@@ -127,15 +491,16 @@ int db_SQL_Export::exportMonthData(InverterData *inverters[])
     sqlite3_stmt* pStmt;
     if ((rc = sqlite3_prepare_v2(m_dbHandle, sql, strlen(sql), &pStmt, NULL)) == SQLITE_OK)
     {
-        exec_query("BEGIN IMMEDIATE TRANSACTION");
+        const bool tx = (begin_transaction() == SQLITE_OK);
 
         for (uint32_t inv=0; inverters[inv]!=NULL && inv<MAX_INVERTERS; inv++)
         {
             //Fix Issue 74: Double data in Monthdata tables
-            tm *ptm = localtime(&inverters[inv]->monthData[0].datetime);
+            tm month_tm;
+            localtime_s(&month_tm, &inverters[inv]->monthData[0].datetime);
 
             std::stringstream rmvsql;
-            rmvsql << "DELETE FROM MonthData WHERE Serial=" << inverters[inv]->Serial << " AND strftime('%Y-%m',datetime(TimeStamp, 'unixepoch'))='" << std::put_time(ptm, "%Y-%m") << "';";
+            rmvsql << "DELETE FROM MonthData WHERE Serial=" << inverters[inv]->Serial << " AND strftime('%Y-%m',datetime(TimeStamp, 'unixepoch'))='" << std::put_time(&month_tm, "%Y-%m") << "';";
 
             rc = exec_query(rmvsql.str().c_str());
             if (rc != SQLITE_OK)
@@ -173,11 +538,13 @@ int db_SQL_Export::exportMonthData(InverterData *inverters[])
         sqlite3_finalize(pStmt);
 
         if (rc == SQLITE_OK)
-            exec_query("COMMIT");
+        {
+            if (tx) commit_transaction();
+        }
         else
         {
             print_error("[month_data]Transaction failed. Rolling back now...");
-            exec_query("ROLLBACK");
+            if (tx) rollback_transaction();
         }
     }
 
@@ -192,7 +559,8 @@ int db_SQL_Export::exportSpotData(InverterData *inv[], time_t spottime)
     for (uint32_t i=0; inv[i]!=NULL && i<MAX_INVERTERS; i++)
     {
         sql.str("");
-        sql << "INSERT INTO SpotData VALUES(" <<
+        sql << "INSERT INTO SpotData(TimeStamp,Serial,Pdc1,Pdc2,Idc1,Idc2,Udc1,Udc2,Pac1,Pac2,Pac3,Iac1,Iac2,Iac3,Uac1,Uac2,Uac3,"
+            "EToday,ETotal,Frequency,OperatingTime,FeedInTime,BT_Signal,Status,GridRelay,Temperature) VALUES(" <<
             spottime << ',' <<
             inv[i]->Serial << ',' <<
             inv[i]->mpp.at(1).Pdc() << ',' <<
@@ -227,6 +595,9 @@ int db_SQL_Export::exportSpotData(InverterData *inv[], time_t spottime)
             break;
         }
 
+        if (rollup(SpotDataRollup, inv[i]->Serial, spottime, spottime) != SQLITE_OK)
+            print_error("[spot_data]rollup() returned");
+
         // If inverter has more than 2 mppt, use SpotDataX table to store the data
         if (inv[i]->mpp.size() > 2)
         {
@@ -258,7 +629,7 @@ int db_SQL_Export::exportEventData(InverterData *inv[], TagDefs& tags)
     sqlite3_stmt* pStmt;
     if ((rc = sqlite3_prepare_v2(m_dbHandle, sql, strlen(sql), &pStmt, NULL)) == SQLITE_OK)
     {
-        exec_query("BEGIN IMMEDIATE TRANSACTION");
+        const bool tx = (begin_transaction() == SQLITE_OK);
 
         for (uint32_t i=0; inv[i]!=NULL && i<MAX_INVERTERS; i++)
         {
@@ -327,11 +698,13 @@ int db_SQL_Export::exportEventData(InverterData *inv[], TagDefs& tags)
         sqlite3_finalize(pStmt);
 
         if (rc == SQLITE_OK)
-            rc = exec_query("COMMIT");
+        {
+            if (tx) rc = commit_transaction();
+        }
         else
         {
             print_error("[event_data]Transaction failed. Rolling back now...");
-            rc = exec_query("ROLLBACK");
+            if (tx) rc = rollback_transaction();
         }
     }
 
@@ -346,7 +719,7 @@ int db_SQL_Export::exportBatteryData(InverterData *inverters[], time_t spottime)
     sqlite3_stmt* pStmt;
     if ((rc = sqlite3_prepare_v2(m_dbHandle, sql, strlen(sql), &pStmt, NULL)) == SQLITE_OK)
     {
-        exec_query("BEGIN IMMEDIATE TRANSACTION");
+        const bool tx = (begin_transaction() == SQLITE_OK);
 
         for (uint32_t inv=0; inverters[inv]!=NULL && inv<MAX_INVERTERS; inv++)
         {
@@ -368,11 +741,13 @@ int db_SQL_Export::exportBatteryData(InverterData *inverters[], time_t spottime)
         sqlite3_finalize(pStmt);
 
         if (rc == SQLITE_OK)
-            exec_query("COMMIT");
+        {
+            if (tx) commit_transaction();
+        }
         else
         {
             print_error("[battery_data]Transaction failed. Rolling back now...");
-            exec_query("ROLLBACK");
+            if (tx) rollback_transaction();
         }
     }
 
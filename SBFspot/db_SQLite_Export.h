@@ -36,16 +36,22 @@ DISCLAIMER:
 
 #if defined(USE_SQLITE)
 
-#include "db_SQLite.h"
+#include "db_update.h"
+#include "db_Rollup.h"
 #include <sstream>
 #include <iomanip>
 
 extern bool quiet;
 extern int verbose;
 
-class db_SQL_Export : public db_SQL_Base
+class db_SQL_Export : public db_SQL_Update
 {
 public:
+    db_SQL_Export() { m_rollup = false; m_pvostaging = false; m_spotheartbeat = 0; }
+    void set_spot_heartbeat(unsigned int minutes) { m_spotheartbeat = (time_t)minutes * 60; }
+    int init_rollup(void);
+    int init_pvo_staging(void);
+    int maintain_partitions(unsigned int retention);
     int exportDayData(InverterData *inverters[]);
     int exportMonthData(InverterData *inverters[]);
     int exportSpotData(InverterData *inv[], time_t spottime);
@@ -69,7 +75,18 @@ public:
     }
 
 private:
+    bool m_rollup;      // Rollup tables are available
+    bool m_pvostaging;  // PVOutput staging table is available
+    time_t m_spotheartbeat; // Max gap between stored spot data (write-on-change)
+
     int insert_battery_data(sqlite3_stmt* pStmt, int32_t tm, int32_t sn, int32_t key, int32_t val);
+    int rollup(const RollupDef &def, uint32_t serial, time_t from, time_t to);
+    int pvo_datelimit(void);
+    int stage_pvodata(uint32_t serial, time_t from, time_t to);
+    std::string archive_file(int year);
+    int attach_archive(int year);
+    int archive_table(const std::string &table, int year, time_t from, time_t to, bool &completed);
+    int drop_archive(int year);
 };
 
 #endif //#if defined(USE_SQLITE)
@@ -0,0 +1,202 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#if defined(USE_MYSQL)
+
+#include "db_Spool.h"
+#include "osselect.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <iostream>
+#if defined(_WIN32)
+#include <io.h>
+#define fsync _commit
+#endif
+
+bool db_Spool::empty(void) const
+{
+    if (!m_buffer.empty())
+        return false;
+
+    struct stat st;
+    return (stat(m_filename.c_str(), &st) != 0) || (st.st_size == 0);
+}
+
+void db_Spool::add_record(char type, const std::string &payload)
+{
+    const uint32_t len = (uint32_t)payload.size();
+
+    m_buffer += type;
+    m_buffer += (char)(len & 0xFF);
+    m_buffer += (char)((len >> 8) & 0xFF);
+    m_buffer += (char)((len >> 16) & 0xFF);
+    m_buffer += (char)((len >> 24) & 0xFF);
+    m_buffer += payload;
+}
+
+void db_Spool::append(const std::string &insert, const std::string &upsert, const std::vector<std::string> &rows)
+{
+    if (!enabled() || rows.empty())
+        return;
+
+    // Only write a header when the rows are for another statement than the previous ones
+    std::string header = insert + '\0' + upsert;
+    if (header != m_header)
+    {
+        add_record('H', header);
+        m_header = header;
+    }
+
+    for (const auto &row : rows)
+        add_record('R', row);
+}
+
+// Write buffered records to the spool file
+// All records of a run are synced to disk at once
+int db_Spool::flush(void)
+{
+    if (m_buffer.empty())
+        return 0;
+
+    FILE *spool = fopen(m_filename.c_str(), "ab");
+    if (spool == NULL)
+    {
+        std::cout << "Error: Unable to open spool file " << m_filename << std::endl;
+        return -1;
+    }
+
+    int rc = 0;
+    if ((fwrite(m_buffer.data(), 1, m_buffer.size(), spool) != m_buffer.size()) || (fflush(spool) != 0) || (fsync(fileno(spool)) != 0))
+    {
+        std::cout << "Error: Unable to write spool file " << m_filename << std::endl;
+        rc = -1;
+    }
+
+    fclose(spool);
+
+    if (rc == 0)
+        m_buffer.clear();
+
+    return rc;
+}
+
+// Read the spool file and pass the rows to func, in the order they were spooled
+// Consecutive rows of the same statement are passed in groups of at most maxrows
+int db_Spool::replay(ReplayFunc func, unsigned int maxrows, unsigned int &rowcount)
+{
+    rowcount = 0;
+
+    // Rows spooled by this process must be replayed as well
+    if (flush() != 0)
+        return -1;
+
+    FILE *spool = fopen(m_filename.c_str(), "rb");
+    if (spool == NULL)
+        return 0; // Nothing spooled
+
+    int rc = 0;
+    std::string insert;
+    std::string upsert;
+    std::vector<std::string> rows;
+    std::string payload;
+    unsigned char hdr[5];
+
+    while (fread(hdr, 1, sizeof(hdr), spool) == sizeof(hdr))
+    {
+        const uint32_t len = hdr[1] | (hdr[2] << 8) | (hdr[3] << 16) | ((uint32_t)hdr[4] << 24);
+        payload.resize(len);
+        if ((len > 0) && (fread(&payload[0], 1, len, spool) != len))
+        {
+            // Record was not completely written (e.g. power failure during flush)
+            std::cout << "Warning: Spool file " << m_filename << " ends with an incomplete record" << std::endl;
+            break;
+        }
+
+        if ((hdr[0] == 'R') && !insert.empty())
+        {
+            rows.push_back(payload);
+            if (rows.size() < maxrows)
+                continue;
+        }
+        else if (hdr[0] != 'H')
+        {
+            std::cout << "Error: Spool file " << m_filename << " is corrupt" << std::endl;
+            rc = -1;
+            break;
+        }
+
+        // Pass the collected rows before a new header or when the group is complete
+        if (!rows.empty())
+        {
+            if ((rc = func(insert, upsert, rows)) != 0)
+                break;
+            rowcount += (unsigned int)rows.size();
+            rows.clear();
+        }
+
+        if (hdr[0] == 'H')
+        {
+            const size_t sep = payload.find('\0');
+            insert = payload.substr(0, sep);
+            upsert = (sep == std::string::npos) ? "" : payload.substr(sep + 1);
+        }
+    }
+
+    if ((rc == 0) && !rows.empty())
+    {
+        if ((rc = func(insert, upsert, rows)) == 0)
+            rowcount += (unsigned int)rows.size();
+    }
+
+    fclose(spool);
+
+    return rc;
+}
+
+// Remove all records from the spool (after they have been replayed)
+int db_Spool::clear(void)
+{
+    m_buffer.clear();
+    m_header.clear();
+
+    FILE *spool = fopen(m_filename.c_str(), "wb");
+    if (spool == NULL)
+        return -1;
+
+    fclose(spool);
+    return 0;
+}
+
+#endif //#if defined(USE_MYSQL)
@@ -0,0 +1,75 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2022, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#if defined(USE_MYSQL)
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Local spool for rows that couldn't be written to the database
+//
+// The spool is an append-only file with length-prefixed records:
+//   'H' <len> <insert statement> '\0' <upsert clause>   Header for the following rows
+//   'R' <len> <values tuple>                            Row
+// <len> is a 32 bit little endian payload length
+// Records are buffered in memory and written with a single fsync by flush()
+class db_Spool
+{
+public:
+    typedef std::function<int(const std::string &insert, const std::string &upsert, const std::vector<std::string> &rows)> ReplayFunc;
+
+    db_Spool() {}
+    ~db_Spool() { flush(); }
+
+    void set_filename(const std::string &filename) { m_filename = filename; }
+    bool enabled(void) const { return !m_filename.empty(); }
+    bool empty(void) const;
+
+    void append(const std::string &insert, const std::string &upsert, const std::vector<std::string> &rows);
+    int flush(void);
+    int replay(ReplayFunc func, unsigned int maxrows, unsigned int &rowcount);
+    int clear(void);
+
+private:
+    void add_record(char type, const std::string &payload);
+
+    std::string m_filename;
+    std::string m_buffer;       // Records not yet written to the spool file
+    std::string m_header;       // Last header added to the spool
+};
+
+#endif //#if defined(USE_MYSQL)
@@ -34,3 +34,534 @@ DISCLAIMER:
 
 #include "db_update.h"
 
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+
+// Nearest5min of vwSpotData: (TimeStamp % 300) < 150 ? TimeStamp - (TimeStamp % 300) : TimeStamp - (TimeStamp % 300) + 300
+#define SQL_SPOTDATA_BUCKET "TimeStamp+150-(TimeStamp+150)%300"
+
+#if defined(USE_SQLITE)
+#define SQL_SCHEMA_SPOTDATA_BUCKET 2
+#define SQL_REPLACE_INTO "INSERT OR REPLACE INTO "
+#else
+#define SQL_SCHEMA_SPOTDATA_BUCKET 3
+#define SQL_REPLACE_INTO "REPLACE INTO "
+#endif
+
+// Checkpoint of a migration that has replaced its table
+#define SQL_MIGRATION_DONE "done"
+
+int db_SQL_Update::schema_version()
+{
+    int version = 0;
+    get_config(SQL_SCHEMAVERSION, version);
+    return version;
+}
+
+// Bring a database created by a previous version up to SQL_RECOMMENDED_SCHEMA_VERSION
+// Large tables are migrated in batches during at most SQL_MIGRATION_TIMEOUT seconds per run,
+// the next runs continue where the previous one stopped
+int db_SQL_Update::schema_update()
+{
+    int rc = SQL_OK;
+    const int version = schema_version();
+
+    if ((version > 0) && (version < SQL_RECOMMENDED_SCHEMA_VERSION))
+    {
+        if (!quiet)
+            std::cout << "Updating database schema from version " << version << " to " << SQL_RECOMMENDED_SCHEMA_VERSION << std::endl;
+
+        set_migration_timeout(SQL_MIGRATION_TIMEOUT);
+        bool completed = true;
+
+        if (version < SQL_SCHEMA_SPOTDATA_BUCKET)
+        {
+            if (((rc = update_spotdata_bucket(completed)) == SQL_OK) && completed)
+                rc = set_schema_version(SQL_SCHEMA_SPOTDATA_BUCKET, "SpotData_Bucket");
+        }
+
+        if (rc != SQL_OK)
+            print_error("Database schema update failed");
+        else if (!completed && !quiet)
+            std::cout << "Database schema update will be continued during the next run" << std::endl;
+    }
+
+    return rc;
+}
+
+// Store the new version and remove the checkpoint of the migration that completed it
+int db_SQL_Update::set_schema_version(int version, const std::string &migration)
+{
+    const bool tx = (begin_transaction() == SQL_OK);
+
+    int rc = set_config(SQL_SCHEMAVERSION, std::to_string(version));
+    if (rc == SQL_OK)
+        rc = clear_checkpoint(migration);
+
+    if (tx)
+    {
+        if (rc == SQL_OK)
+            commit_transaction();
+        else
+            rollback_transaction();
+    }
+
+    return rc;
+}
+
+int db_SQL_Update::clear_checkpoint(const std::string &name)
+{
+    return exec_query("DELETE FROM Config WHERE `Key`='" SQL_MIGRATION_CHECKPOINT + name + "'");
+}
+
+// Run a statement for each SQL_UPDATE_BATCH_SECONDS of rows in a table (optionally filtered), one transaction per batch
+// Each transaction also stores the checkpoint (next batch,last batch) in the Config table,
+// so other connections never wait for more than a single batch and an interrupted migration
+// resumes where it stopped. Rows stored after the start must be handled by the caller (e.g. triggers).
+// The checkpoint is kept after completion, until the schema version is updated
+int db_SQL_Update::migrate_batches(const std::string &name, const std::string &table, const std::string &column, BatchFunc batch, bool &completed, const std::string &where)
+{
+    const std::string key = SQL_MIGRATION_CHECKPOINT + name;
+    int64_t from = 0, last = -1;
+    int rc = SQL_OK;
+
+    completed = false;
+
+    std::string checkpoint;
+    get_config(key, checkpoint);
+    if (checkpoint.empty())
+    {
+        const std::string filter = where.empty() ? "" : " WHERE " + where;
+        select_int("SELECT MIN(" + column + ") FROM " + table + filter, from);
+        select_int("SELECT MAX(" + column + ") FROM " + table + filter, last);
+    }
+    else
+    {
+        char sep;
+        std::istringstream(checkpoint) >> from >> sep >> last;
+    }
+
+    while (from <= last)
+    {
+        if (time(NULL) >= m_deadline)
+            return rc;
+
+        const std::string sql = batch(from, from + SQL_UPDATE_BATCH_SECONDS);
+        from += SQL_UPDATE_BATCH_SECONDS;
+
+        const bool tx = (begin_transaction() == SQL_OK);
+
+        if ((rc = exec_query(sql)) == SQL_OK)
+            rc = set_config(key, std::to_string(from) + ',' + std::to_string(last));
+        else
+            print_error("exec_query() returned", sql);
+
+        if (tx)
+        {
+            if (rc == SQL_OK)
+                commit_transaction();
+            else
+                rollback_transaction();
+        }
+
+        if (rc != SQL_OK)
+            return rc;
+
+        if (isverbose(2))
+            std::cout << name << ": " << (last < from ? 0 : (last - from) / SQL_UPDATE_BATCH_SECONDS + 1) << " batches to go" << std::endl;
+    }
+
+    completed = true;
+
+    return rc;
+}
+
+// Copy a table to a new definition, without blocking the writers for more than a batch
+// The old table and its triggers are dropped when the new table replaces it
+int db_SQL_Update::migrate_table(const TableMigration &def, bool &completed)
+{
+    const std::string key = SQL_MIGRATION_CHECKPOINT + std::string(def.name);
+    const std::string target = std::string(def.table) + "_new";
+    const std::string old = std::string(def.table) + "_old";
+    int rc = SQL_OK;
+
+    std::string checkpoint;
+    get_config(key, checkpoint);
+    completed = (checkpoint == SQL_MIGRATION_DONE);
+
+    if (!completed)
+    {
+        if (table_exists(old))
+            completed = ((rc = replace_table(def)) == SQL_OK); // Stopped between the swap and its checkpoint
+        else
+        {
+            // Mirror changes before the copy starts, so no row is missed
+            if ((rc = exec_query_multi(def.create)) == SQL_OK)
+                rc = create_mirror_triggers(def);
+
+            if (rc == SQL_OK)
+            {
+                const std::string keycol = std::string(def.key).substr(0, std::string(def.key).find(','));
+                auto copy = [&](int64_t from, int64_t to)
+                {
+                    std::ostringstream sql;
+                    sql << SQL_REPLACE_INTO << target << '(' << def.columns << ") SELECT " << def.select << " FROM " << def.table <<
+                        " WHERE " << keycol << ">=" << from << " AND " << keycol << '<' << to;
+                    return sql.str();
+                };
+
+                rc = migrate_batches(def.name, def.table, keycol, copy, completed);
+            }
+
+            if ((rc == SQL_OK) && completed)
+                completed = ((rc = replace_table(def)) == SQL_OK);
+        }
+    }
+
+    // Also removes the leftovers of a run that stopped after the replacement
+    if (completed)
+        exec_query("DROP TABLE IF EXISTS " + old);
+
+    return rc;
+}
+
+// Condition matching the primary key of a row with the NEW or OLD row of a trigger
+static std::string key_match(const std::string &key, const std::string &row)
+{
+    std::ostringstream match;
+    std::istringstream cols(key);
+    std::string col;
+
+    while (std::getline(cols, col, ','))
+    {
+        if (match.tellp() > 0)
+            match << " AND ";
+        match << col << '=' << row << '.' << col;
+    }
+
+    return match.str();
+}
+
+#endif
+
+#if defined(USE_SQLITE)
+
+// Add the 5 minute bucket of vwAvgSpotData to SpotData and index it per device
+int db_SQL_Update::update_spotdata_bucket(bool &completed)
+{
+    int rc = SQL_OK;
+    const bool generated = (sqlite3_libversion_number() >= 3031000);
+    int64_t hidden = -1; // -1: no column, 0: plain column, 2/3: generated column
+
+    completed = true;
+
+    select_int(generated ? "SELECT hidden FROM pragma_table_xinfo('SpotData') WHERE name='Bucket'"
+                         : "SELECT 0 FROM pragma_table_info('SpotData') WHERE name='Bucket'", hidden);
+
+    if ((hidden == -1) && generated)
+    {
+        // The value of a virtual column is only stored in the index
+        rc = exec_query("ALTER TABLE SpotData ADD COLUMN Bucket int GENERATED ALWAYS AS (" SQL_SPOTDATA_BUCKET ") VIRTUAL");
+    }
+    else if (hidden <= 0)
+    {
+        // Generated columns are not supported by this SQLite version:
+        // New rows get their bucket from a trigger, existing rows are updated in batches
+        if (hidden == -1)
+            rc = exec_query("ALTER TABLE SpotData ADD COLUMN Bucket int");
+
+        if (rc == SQL_OK)
+            rc = exec_query("CREATE TRIGGER IF NOT EXISTS SpotData_Bucket_Insert AFTER INSERT ON SpotData WHEN NEW.Bucket IS NULL BEGIN "
+                "UPDATE SpotData SET Bucket=NEW.TimeStamp+150-(NEW.TimeStamp+150)%300 WHERE TimeStamp=NEW.TimeStamp AND Serial=NEW.Serial; END");
+
+        if (rc == SQL_OK)
+        {
+            auto update = [](int64_t from, int64_t to)
+            {
+                std::ostringstream sql;
+                sql << "UPDATE SpotData SET Bucket=" SQL_SPOTDATA_BUCKET " WHERE TimeStamp>=" << from << " AND TimeStamp<" << to;
+                return sql.str();
+            };
+
+            rc = migrate_batches("SpotData_Bucket", "SpotData", "TimeStamp", update, completed);
+        }
+    }
+
+    if ((rc == SQL_OK) && completed)
+        rc = exec_query("CREATE INDEX IF NOT EXISTS SpotData_Bucket ON SpotData(Serial, Bucket)");
+
+    if ((rc == SQL_OK) && completed)
+        rc = exec_query(
+            "DROP VIEW IF EXISTS vwAvgSpotData;"
+            "CREATE VIEW vwAvgSpotData AS "
+            "SELECT datetime(Dat.Bucket, 'unixepoch', 'localtime') AS nearest5min,Dat.Serial,"
+            "avg(Pdc1) AS Pdc1,avg(Pdc2) AS Pdc2,avg(Idc1) AS Idc1,avg(Idc2) AS Idc2,avg(Udc1) AS Udc1,avg(Udc2) AS Udc2,"
+            "avg(Pac1) AS Pac1,avg(Pac2) AS Pac2,avg(Pac3) AS Pac3,avg(Iac1) AS Iac1,avg(Iac2) AS Iac2,avg(Iac3) AS Iac3,"
+            "avg(Uac1) AS Uac1,avg(Uac2) AS Uac2,avg(Uac3) AS Uac3,avg(ROUND(Dat.Temperature,1)) AS Temperature "
+            "FROM SpotData Dat INNER JOIN Inverters Inv ON Dat.Serial = Inv.Serial "
+            "GROUP BY Dat.Serial, Dat.Bucket;");
+
+    return rc;
+}
+
+bool db_SQL_Update::table_exists(const std::string &table)
+{
+    int64_t count = 0;
+    select_int("SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name=" + s_quoted(table), count);
+    return count > 0;
+}
+
+int db_SQL_Update::create_mirror_triggers(const TableMigration &def)
+{
+    const std::string table = def.table;
+    const std::string copy = std::string("INSERT OR REPLACE INTO ") + table + "_new(" + def.columns + ") SELECT " + def.select + " FROM " + table + " WHERE ";
+    std::ostringstream sql;
+
+    sql << "CREATE TRIGGER IF NOT EXISTS " << table << "_Migrate_Insert AFTER INSERT ON " << table << " BEGIN " << copy << key_match(def.key, "NEW") << "; END;"
+        << "CREATE TRIGGER IF NOT EXISTS " << table << "_Migrate_Update AFTER UPDATE ON " << table << " BEGIN " << copy << key_match(def.key, "NEW") << "; END;"
+        << "CREATE TRIGGER IF NOT EXISTS " << table << "_Migrate_Delete AFTER DELETE ON " << table << " BEGIN DELETE FROM " << table << "_new WHERE " << key_match(def.key, "OLD") << "; END;";
+
+    int rc = exec_query(sql.str());
+    if (rc != SQL_OK)
+        print_error("exec_query() returned", sql.str());
+
+    return rc;
+}
+
+// Drop the old table (and its triggers) and rename the new one in a single transaction
+// legacy_alter_table prevents the rename from failing on the views of the dropped table
+int db_SQL_Update::replace_table(const TableMigration &def)
+{
+    const std::string table = def.table;
+
+    exec_query("PRAGMA legacy_alter_table=ON");
+
+    int rc = begin_transaction();
+    if (rc == SQL_OK)
+    {
+        if ((rc = exec_query("DROP TABLE " + table + ";ALTER TABLE " + table + "_new RENAME TO " + table)) == SQL_OK)
+            rc = set_config(SQL_MIGRATION_CHECKPOINT + std::string(def.name), SQL_MIGRATION_DONE);
+
+        if (rc == SQL_OK)
+            rc = commit_transaction();
+        else
+            rollback_transaction();
+    }
+
+    exec_query("PRAGMA legacy_alter_table=OFF");
+
+    return rc;
+}
+
+int db_SQL_Update::select_int(const std::string &sql, int64_t &value)
+{
+    sqlite3_stmt *pStmt = NULL;
+    int rc = sqlite3_prepare_v2(m_dbHandle, sql.c_str(), -1, &pStmt, NULL);
+
+    if (rc == SQLITE_OK)
+    {
+        if ((sqlite3_step(pStmt) == SQLITE_ROW) && (sqlite3_column_type(pStmt, 0) != SQLITE_NULL))
+            value = sqlite3_column_int64(pStmt, 0);
+
+        sqlite3_finalize(pStmt);
+    }
+    else
+        print_error("sqlite3_prepare_v2() returned", sql);
+
+    return rc;
+}
+
+int db_SQL_Update::select_column(const std::string &sql, std::vector<std::string> &values, unsigned int column)
+{
+    sqlite3_stmt *pStmt = NULL;
+    int rc = sqlite3_prepare_v2(m_dbHandle, sql.c_str(), -1, &pStmt, NULL);
+
+    if (rc == SQLITE_OK)
+    {
+        while (sqlite3_step(pStmt) == SQLITE_ROW)
+        {
+            const unsigned char *value = sqlite3_column_text(pStmt, column);
+            values.push_back(value ? (const char *)value : "");
+        }
+
+        sqlite3_finalize(pStmt);
+    }
+    else
+        print_error("sqlite3_prepare_v2() returned", sql);
+
+    return rc;
+}
+
+#elif defined(USE_MYSQL)
+
+// Add the 5 minute bucket of vwAvgSpotData to SpotData and index it per device
+// Adding a virtual column only changes the table definition and InnoDB builds the index online,
+// so the poller can keep inserting data while the existing rows are indexed
+int db_SQL_Update::update_spotdata_bucket(bool &completed)
+{
+    int rc = SQL_OK;
+    int64_t exists = 0;
+
+    completed = true;
+
+    select_int("SELECT COUNT(*) FROM information_schema.COLUMNS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='SpotData' AND COLUMN_NAME='Bucket'", exists);
+    if (exists == 0)
+        rc = exec_query("ALTER TABLE SpotData ADD COLUMN Bucket int AS (" SQL_SPOTDATA_BUCKET ") VIRTUAL");
+
+    exists = 0;
+    select_int("SELECT COUNT(*) FROM information_schema.STATISTICS WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='SpotData' AND INDEX_NAME='SpotData_Bucket'", exists);
+    if ((rc == SQL_OK) && (exists == 0))
+        rc = exec_query("CREATE INDEX SpotData_Bucket ON SpotData(Serial, Bucket)");
+
+    if (rc == SQL_OK)
+        rc = exec_query(
+            "CREATE OR REPLACE VIEW vwAvgSpotData AS "
+            "SELECT From_UnixTime(Dat.Bucket) AS nearest5min,Dat.Serial,"
+            "cast(avg(Pdc1) as decimal(9)) AS Pdc1,cast(avg(Pdc2) as decimal(9)) AS Pdc2,"
+            "cast(avg(Idc1) as decimal(9,3)) AS Idc1,cast(avg(Idc2) as decimal(9,3)) AS Idc2,"
+            "cast(avg(Udc1) as decimal(9,2)) AS Udc1,cast(avg(Udc2) as decimal(9,2)) AS Udc2,"
+            "cast(avg(Pac1) as decimal(9)) AS Pac1,cast(avg(Pac2) as decimal(9)) AS Pac2,cast(avg(Pac3) as decimal(9)) AS Pac3,"
+            "cast(avg(Iac1) as decimal(9,3)) AS Iac1,cast(avg(Iac2) as decimal(9,3)) AS Iac2,cast(avg(Iac3) as decimal(9,3)) AS Iac3,"
+            "cast(avg(Uac1) as decimal(9,2)) AS Uac1,cast(avg(Uac2) as decimal(9,2)) AS Uac2,cast(avg(Uac3) as decimal(9,2)) AS Uac3,"
+            "cast(avg(ROUND(Dat.Temperature,1)) as decimal(9,2)) AS Temperature "
+            "FROM SpotData Dat INNER JOIN Inverters Inv ON Dat.Serial=Inv.Serial "
+            "GROUP BY Dat.Serial, Dat.Bucket");
+
+    if (rc != SQL_OK)
+        print_error("[schema_update]exec_query() returned");
+
+    return rc;
+}
+
+bool db_SQL_Update::table_exists(const std::string &table)
+{
+    int64_t count = 0;
+    select_int("SELECT COUNT(*) FROM information_schema.TABLES WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME=" + s_quoted(table), count);
+    return count > 0;
+}
+
+bool db_SQL_Update::trigger_exists(const std::string &trigger)
+{
+    int64_t count = 0;
+    select_int("SELECT COUNT(*) FROM information_schema.TRIGGERS WHERE TRIGGER_SCHEMA=DATABASE() AND TRIGGER_NAME=" + s_quoted(trigger), count);
+    return count > 0;
+}
+
+int db_SQL_Update::create_mirror_triggers(const TableMigration &def)
+{
+    const std::string table = def.table;
+    const std::string copy = std::string("REPLACE INTO ") + table + "_new(" + def.columns + ") SELECT " + def.select + " FROM " + table + " WHERE ";
+    const std::string triggers[][2] =
+    {
+        { table + "_Migrate_Insert", "AFTER INSERT ON " + table + " FOR EACH ROW " + copy + key_match(def.key, "NEW") },
+        { table + "_Migrate_Update", "AFTER UPDATE ON " + table + " FOR EACH ROW " + copy + key_match(def.key, "NEW") },
+        { table + "_Migrate_Delete", "AFTER DELETE ON " + table + " FOR EACH ROW DELETE FROM " + table + "_new WHERE " + key_match(def.key, "OLD") }
+    };
+
+    int rc = SQL_OK;
+
+    for (const auto &trigger : triggers)
+    {
+        if (!trigger_exists(trigger[0]))
+        {
+            const std::string sql = "CREATE TRIGGER " + trigger[0] + ' ' + trigger[1];
+            if ((rc = exec_query(sql)) != SQL_OK)
+            {
+                print_error("exec_query() returned", sql);
+                break;
+            }
+        }
+    }
+
+    return rc;
+}
+
+// Swap the tables in a single (atomic) RENAME TABLE
+// A run that stopped before the checkpoint was stored is detected by the existence of <table>_old
+int db_SQL_Update::replace_table(const TableMigration &def)
+{
+    const std::string table = def.table;
+    int rc = SQL_OK;
+
+    if (!table_exists(table + "_old"))
+        rc = exec_query("RENAME TABLE " + table + " TO " + table + "_old, " + table + "_new TO " + table);
+
+    if (rc == SQL_OK)
+        rc = set_config(SQL_MIGRATION_CHECKPOINT + std::string(def.name), SQL_MIGRATION_DONE);
+
+    if (rc == SQL_OK)
+        rc = exec_query_multi("DROP TRIGGER IF EXISTS " + table + "_Migrate_Insert;"
+            "DROP TRIGGER IF EXISTS " + table + "_Migrate_Update;"
+            "DROP TRIGGER IF EXISTS " + table + "_Migrate_Delete");
+
+    if (rc != SQL_OK)
+        print_error("[replace_table]exec_query() returned");
+
+    return rc;
+}
+
+// Remove the old table, its mirror triggers and the checkpoint of a migration that stopped after the swap
+// The next run finds the table already migrated, so this is done on each run and does nothing afterwards
+int db_SQL_Update::cleanup_migration(const std::string &name, const std::string &table)
+{
+    if (!table_exists(table + "_old"))
+        return SQL_OK;
+
+    int rc = exec_query_multi("DROP TRIGGER IF EXISTS " + table + "_Migrate_Insert;"
+        "DROP TRIGGER IF EXISTS " + table + "_Migrate_Update;"
+        "DROP TRIGGER IF EXISTS " + table + "_Migrate_Delete;"
+        "DROP TABLE IF EXISTS " + table + "_old");
+
+    if (rc == SQL_OK)
+        rc = clear_checkpoint(name);
+
+    if (rc != SQL_OK)
+        print_error("[cleanup_migration]exec_query() returned");
+
+    return rc;
+}
+
+int db_SQL_Update::select_int(const std::string &sql, int64_t &value)
+{
+    int rc = mysql_query(m_dbHandle, sql.c_str());
+
+    if (rc == SQL_OK)
+    {
+        MYSQL_RES *sqlResult = mysql_store_result(m_dbHandle);
+        if (sqlResult)
+        {
+            MYSQL_ROW sqlRow = mysql_fetch_row(sqlResult);
+            if (sqlRow && sqlRow[0])
+                value = strtoll(sqlRow[0], NULL, 10);
+
+            mysql_free_result(sqlResult);
+        }
+    }
+    else
+        print_error("mysql_query() returned", sql);
+
+    return rc;
+}
+
+int db_SQL_Update::select_column(const std::string &sql, std::vector<std::string> &values, unsigned int column)
+{
+    int rc = mysql_query(m_dbHandle, sql.c_str());
+
+    if (rc == SQL_OK)
+    {
+        MYSQL_RES *sqlResult = mysql_store_result(m_dbHandle);
+        if (sqlResult)
+        {
+            MYSQL_ROW sqlRow;
+            while ((sqlRow = mysql_fetch_row(sqlResult)) && (column < mysql_num_fields(sqlResult)))
+                values.push_back(sqlRow[column] ? sqlRow[column] : "");
+
+            mysql_free_result(sqlResult);
+        }
+    }
+    else
+        print_error("mysql_query() returned", sql);
+
+    return rc;
+}
+
+#endif
@@ -34,14 +34,71 @@ DISCLAIMER:
 
 #pragma once
 
-#include "SQLselect.h"
+#include "osselect.h"
 #if defined(USE_SQLITE)
+#include "db_SQLite.h"
+#elif defined(USE_MYSQL)
+#include "db_MySQL.h"
+#endif
+
+#if defined(USE_SQLITE) || defined(USE_MYSQL)
+
+#include <functional>
+#include <vector>
+
+// Number of seconds of data processed per transaction by a migration
+#define SQL_UPDATE_BATCH_SECONDS 86400
+// Max duration of the migrations in a single run (seconds)
+// The next run continues at the last checkpoint
+#define SQL_MIGRATION_TIMEOUT 60
+// Config key prefix of the migration checkpoints
+#define SQL_MIGRATION_CHECKPOINT "Migration_"
+
+// Online copy of a table to a new definition
+// The new table <table>_new is filled in batches, while triggers on the old table mirror
+// the rows that are stored meanwhile. When all rows are copied, the new table replaces the old one.
+struct TableMigration
+{
+    const char *name;       // Name of the migration (checkpoint key)
+    const char *table;      // Table to migrate
+    const char *create;     // CREATE TABLE IF NOT EXISTS <table>_new, including its indexes
+    const char *columns;    // Column list of the new table
+    const char *select;     // Values of the columns, selected from the old table
+    const char *key;        // Primary key, the first column is used for the batches (e.g. "TimeStamp,Serial")
+};
 
 class db_SQL_Update : public db_SQL_Base
 {
 public:
+    db_SQL_Update() { m_deadline = 0; }
     int schema_version();
     int schema_update();
+
+protected:
+    // Returns the SQL statement processing the rows in [from, to)
+    typedef std::function<std::string(int64_t from, int64_t to)> BatchFunc;
+
+    void set_migration_timeout(int seconds) { m_deadline = time(NULL) + seconds; }
+    int migrate_batches(const std::string &name, const std::string &table, const std::string &column, BatchFunc batch, bool &completed, const std::string &where = "");
+    int migrate_table(const TableMigration &def, bool &completed);
+    int clear_checkpoint(const std::string &name);
+#if defined(USE_MYSQL)
+    int cleanup_migration(const std::string &name, const std::string &table);
+#endif
+    int select_int(const std::string &sql, int64_t &value);
+    int select_column(const std::string &sql, std::vector<std::string> &values, unsigned int column = 0);
+    bool table_exists(const std::string &table);
+
+private:
+    time_t m_deadline;      // End of the migration time slot of this run
+
+    int update_spotdata_bucket(bool &completed);
+    int set_schema_version(int version, const std::string &migration);
+#if defined(USE_MYSQL)
+    bool trigger_exists(const std::string &trigger);
+#endif
+    int create_mirror_triggers(const TableMigration &def);
+    int replace_table(const TableMigration &def);
 };
 
 #endif
@@ -33,6 +33,7 @@ DISCLAIMER:
 ************************************************************************************************/
 
 #include "Inverter.h"
+#include "Logger.h"
 #include "sunrise_sunset.h"
 
 const uint32_t MAX_INVERTERS = 20;
@@ -45,6 +46,17 @@ dll_import importSMAData = NULL;
 dll_version decoderVersion = NULL;
 #endif
 
+// Warnings and errors are written to the logfile right away
+static bool isUrgent(const std::string &line)
+{
+    for (const char *level : { "WARNING: ", "ERROR: ", "CRITICAL: ", "Error: " })
+    {
+        if (line.find(level) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
 int main(int argc, char **argv)
 {
 #if defined(_WIN32)
@@ -55,6 +67,7 @@ int main(int argc, char **argv)
     int rc = 0;
 
     Config cfg;
+    Logger logger;
 
     //Read the command line and store settings in config struct
     rc = parseCmdline(argc, argv, &cfg);
@@ -84,6 +97,16 @@ int main(int argc, char **argv)
         strncpy(DateTimeFormat, cfg.DateTimeFormat, sizeof(DateTimeFormat));
         strncpy(DateFormat, cfg.DateFormat, sizeof(DateFormat));
 
+        // Resident process: the console output goes to a logfile per day (SBFspotYYYYMMDD.log),
+        // written by a background thread
+        if (cfg.listen && !cfg.logPath.empty())
+        {
+            CreatePath(cfg.logPath.c_str());
+            logger.open(cfg.logPath + FOLDER_SEP, "SBFspot", cfg.logMaxSize * 1024 * 1024, cfg.logCompress);
+            if (!logger.capture([&logger](const std::string &line) { logger.write(line + '\n', isUrgent(line)); }))
+                print_error(stdout, PROC_WARNING, "Unable to redirect the output to the logfile\n");
+        }
+
         if (VERBOSE_NORMAL) print_error(stdout, PROC_INFO, "Starting...\n");
 
         // If co-ordinates provided, calculate sunrise & sunset times
@@ -98,7 +121,8 @@ int main(int argc, char **argv)
                 printf("sunset : %02d:%02d\n", (int)cfg.sunset, (int)((cfg.sunset - (int)cfg.sunset) * 60));
             }
 
-            if ((!cfg.forceInq) && (!cfg.isLight))
+            // Resident process keeps waiting for the sun
+            if ((!cfg.forceInq) && (!cfg.isLight) && (!cfg.listen))
             {
                 if (!quiet) puts("Nothing to do... it's dark. Use -finq to force inquiry.");
                 return 0;
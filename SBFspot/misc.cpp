@@ -37,6 +37,7 @@ DISCLAIMER:
 #include "SBFspot.h"
 #include <string.h>
 #include <stdio.h>
+#include <cmath>
 #if defined(_WIN32)
 #include "decoder.h"
 #endif
@@ -49,20 +50,22 @@ extern int debug;
 //print time as UTC time
 std::string strfgmtime_t(const char *format, const time_t rawtime)
 {
-    const tm *timeinfo = gmtime(&rawtime);
+    tm timeinfo;
+    gmtime_s(&timeinfo, &rawtime);
 
     std::ostringstream os;
-    os << std::put_time(timeinfo, format);
+    os << std::put_time(&timeinfo, format);
     return os.str();
 }
 
 //Print time as local time
 std::string strftime_t(const char *format, const time_t rawtime)
 {
-    const tm *timeinfo = localtime(&rawtime);
+    tm timeinfo;
+    localtime_s(&timeinfo, &rawtime);
 
     std::ostringstream os;
-    os << std::put_time(timeinfo, format);
+    os << std::put_time(&timeinfo, format);
     return os.str();
 }
 
@@ -219,8 +222,57 @@ void HexDump(uint8_t *buf, int count, int radix)
     }
 }
 
+// Same output as sprintf("%.*f") with integer arithmetic
+// Returns false when the value is too large or too close to a rounding tie
+static bool FormatFixed(char *str, double value, int precision, char decimalpoint)
+{
+    static const double scale[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+    if ((precision < 0) || (precision > 6))
+        return false;
+
+    const double scaled = fabs(value) * scale[precision];
+    if (!(scaled < 1e12))   // Also NaN and inf
+        return false;
+
+    // Half-way cases depend on the exact binary value
+    const double whole = floor(scaled);
+    if (fabs(scaled - whole - 0.5) < 1e-3)
+        return false;
+
+    unsigned long long number = (unsigned long long)whole + ((scaled - whole > 0.5) ? 1 : 0);
+
+    // Digits right to left
+    char digits[24];
+    char *pos = digits + sizeof(digits);
+    for (int i = 0; i < precision; i++)
+    {
+        *--pos = (char)('0' + number % 10);
+        number /= 10;
+    }
+    if (precision > 0)
+        *--pos = decimalpoint;
+    do
+    {
+        *--pos = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+
+    if (std::signbit(value))
+        *str++ = '-';
+
+    const size_t len = digits + sizeof(digits) - pos;
+    memcpy(str, pos, len);
+    str[len] = 0;
+
+    return true;
+}
+
 char *FormatFloat(char *str, float value, int width, int precision, char decimalpoint)
 {
+    if ((width == 0) && FormatFixed(str, value, precision, decimalpoint))
+        return str;
+
     sprintf(str, "%*.*f", width, precision, value);
     char *dppos = strrchr(str, '.');
     if (dppos != NULL) *dppos = decimalpoint;
@@ -229,6 +281,9 @@ char *FormatFloat(char *str, float value, int width, int precision, char decimal
 
 char *FormatDouble(char *str, double value, int width, int precision, char decimalpoint)
 {
+    if ((width == 0) && FormatFixed(str, value, precision, decimalpoint))
+        return str;
+
     sprintf(str, "%*.*f", width, precision, value);
     char *dppos = strrchr(str, '.');
     if (dppos != NULL) *dppos = decimalpoint;
@@ -37,285 +37,985 @@ DISCLAIMER:
 #include "SBFspot.h"
 #include <boost/algorithm/string.hpp>
 #include "mppt.h"
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <thread>
+
+static std::string keyed(const std::string& format, const std::string& key)
+{
+    std::string part(format);
+    boost::replace_all(part, "{key}", key);
+    return part;
+}
+
+static float tracker(const InverterData& inv, uint8_t n, float (*value)(const mppt& dc))
+{
+    auto dc = inv.mpp.find(n);
+    return dc == inv.mpp.end() ? 0.0f : value(dc->second);
+}
 
 MqttExport::MqttExport(const Config& config)
     : m_config(config)
+    , m_valueCount(0)
+    , m_heartbeat((time_t)config.mqtt_heartbeat)
+    , m_qos(0)
+    , m_retain(false)
 {
+    compile();
+
+    if (m_config.mqtt_builtin)
+        parsePublisherArgs();
+
+    // Resident mode, commands are received on the publishing connection
+    if (m_config.listen)
+    {
+        m_commandTopic = m_config.mqtt_command_topic;
+        boost::replace_all(m_commandTopic, "{plantname}", m_config.plantname);
+        m_resultTopic = m_commandTopic + "/result";
+        m_client.subscribe(m_commandTopic, 1);
+    }
 }
 
 MqttExport::~MqttExport()
 {
 }
 
-int MqttExport::exportInverterData(const std::vector<InverterData>& inverterData)
+// Translate MQTT_Data and MQTT_ItemFormat once, instead of for each inverter and poll
+void MqttExport::compile()
 {
-    int rc = 0;
+    // Item format is split at {value}
+    // Double quotes collapse as they did when the item was built by string replacement
+    std::string format(m_config.mqtt_item_format);
+    boost::replace_all(format, "\"\"", "\"");
+    const size_t valuepos = format.find("{value}");
+    const std::string before = format.substr(0, valuepos);
+    const std::string after = (valuepos == std::string::npos) ? "" : format.substr(valuepos + 7);
+    // Text values are quoted, unless the item format already does ("{value}")
+    const bool quoted = before.empty() || (before.back() != '"') || after.empty() || (after.front() != '"');
+
+    m_idLabel.prefix = keyed(before, "Id");
+    m_idLabel.suffix = keyed(after, "Id");
+    m_resultLabel.prefix = keyed(before, "Result");
+    m_resultLabel.suffix = keyed(after, "Result");
+    m_quoted = quoted;
+
+    // Any change is published, except for the time of the poll
+    std::map<std::string, std::pair<double, bool>> deadbands;
+    deadbands["timestamp"] = std::make_pair(-1.0, false);
+    parseDeadbands(m_config.mqtt_deadbands, deadbands);
 
-    // Split message body
     std::vector<std::string> items;
     boost::split(items, m_config.mqtt_publish_data, boost::is_any_of(","));
 
-    std::stringstream mqtt_message;
-    std::string key;
-    char value[80];
+    m_items.clear();
+    for (const auto& name : items)
+    {
+        MqttItem item = MqttItem();
+        std::string key(name);
+        std::transform(key.begin(), key.end(), key.begin(), [](auto ch)
+        {
+            return static_cast<char>(std::tolower(ch));
+        });
+
+// suppress warning C4307: '*': integral constant overflow
+#if defined(_MSC_VER)
+#   pragma warning(push)
+#   pragma warning(disable: 4307)
+#endif
+
+        switch (djb::hash(key.c_str()))
+        {
+        case "prgversion"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config& cfg, const InverterData&, std::string& out) { out += cfg.prgVersion; };
+            break;
+        case "plantname"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config& cfg, const InverterData&, std::string& out) { out += cfg.plantname; };
+            break;
+        case "timestamp"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config&, const InverterData&) { return time(nullptr); };
+            break;
+        case "sunrise"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config& cfg, const InverterData&) { return to_time_t(cfg.sunrise); };
+            break;
+        case "sunset"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config& cfg, const InverterData&) { return to_time_t(cfg.sunset); };
+            break;
+        case "invserial"_:
+            item.type = MqttItem::SERIAL;
+            break;
+        case "invname"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += inv.DeviceName; };
+            break;
+        case "invclass"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += inv.DeviceClass; };
+            break;
+        case "invtype"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += inv.DeviceType; };
+            break;
+        case "invswver"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += inv.SWVersion; };
+            break;
+        case "invtime"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config&, const InverterData& inv) { return inv.InverterDatetime; };
+            break;
+        case "invstatus"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += tagdefs.getDesc(inv.DeviceStatus, "?"); };
+            break;
+        case "invtemperature"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return is_NaN(inv.Temperature) ? 0.0f : (float)inv.Temperature / 100; };
+            break;
+        case "invgridrelay"_:
+            item.type = MqttItem::TEXT;
+            item.textValue = [](const Config&, const InverterData& inv, std::string& out) { out += tagdefs.getDesc(inv.GridRelayStatus, "?"); };
+            break;
+        case "pdc1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 1, [](const mppt& dc) { return (float)dc.Pdc(); }); };
+            break;
+        case "pdc2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 2, [](const mppt& dc) { return (float)dc.Pdc(); }); };
+            break;
+        case "pdctot"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.calPdcTot; };
+            break;
+        case "idc1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 1, [](const mppt& dc) { return (float)dc.Idc() / 1000; }); };
+            break;
+        case "idc2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 2, [](const mppt& dc) { return (float)dc.Idc() / 1000; }); };
+            break;
+        case "udc1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 1, [](const mppt& dc) { return (float)dc.Udc() / 100; }); };
+            break;
+        case "udc2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return tracker(inv, 2, [](const mppt& dc) { return (float)dc.Udc() / 100; }); };
+            break;
+        case "etotal"_:
+            item.type = MqttItem::DOUBLE;
+            item.doubleValue = [](const InverterData& inv) { return (double)inv.ETotal / 1000; };
+            break;
+        case "etoday"_:
+            item.type = MqttItem::DOUBLE;
+            item.doubleValue = [](const InverterData& inv) { return (double)inv.EToday / 1000; };
+            break;
+        case "pactot"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.TotalPac; };
+            break;
+        case "pac1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Pac1; };
+            break;
+        case "pac2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Pac2; };
+            break;
+        case "pac3"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Pac3; };
+            break;
+        case "uac1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Uac1 / 100; };
+            break;
+        case "uac2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Uac2 / 100; };
+            break;
+        case "uac3"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Uac3 / 100; };
+            break;
+        case "iac1"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Iac1 / 1000; };
+            break;
+        case "iac2"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Iac2 / 1000; };
+            break;
+        case "iac3"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.Iac3 / 1000; };
+            break;
+        case "gridfreq"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.GridFreq / 100; };
+            break;
+        case "opertm"_:
+            item.type = MqttItem::DOUBLE;
+            item.doubleValue = [](const InverterData& inv) { return (double)inv.OperationTime / 3600; };
+            break;
+        case "feedtm"_:
+            item.type = MqttItem::DOUBLE;
+            item.doubleValue = [](const InverterData& inv) { return (double)inv.FeedInTime / 3600; };
+            break;
+        case "btsignal"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return inv.BT_Signal; };
+            break;
+        case "battmpval"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return ((float)inv.BatTmpVal) / 10; };
+            break;
+        case "batvol"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return ((float)inv.BatVol) / 100; };
+            break;
+        case "batamp"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return ((float)inv.BatAmp) / 1000; };
+            break;
+        case "batchastt"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.BatChaStt; };
+            break;
+        case "invwakeuptm"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config&, const InverterData& inv) { return inv.WakeupTime; };
+            break;
+        case "invsleeptm"_:
+            item.type = MqttItem::TIME;
+            item.timeValue = [](const Config&, const InverterData& inv) { return inv.SleepTime; };
+            break;
+        case "meteringwin"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.MeteringGridMsTotWIn; };
+            break;
+        case "meteringwout"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)inv.MeteringGridMsTotWOut; };
+            break;
+        case "meteringwtot"_:
+            item.type = MqttItem::FLOAT;
+            item.floatValue = [](const InverterData& inv) { return (float)(inv.MeteringGridMsTotWIn - inv.MeteringGridMsTotWOut); };
+            break;
+        case "pdc"_:
+            item.type = MqttItem::MPPT;
+            item.key = "PDC";
+            item.trackerValue = [](const mppt& dc) { return (float)dc.Pdc(); };
+            break;
+        case "idc"_:
+            item.type = MqttItem::MPPT;
+            item.key = "IDC";
+            item.trackerValue = [](const mppt& dc) { return (float)dc.Idc() / 1000; };
+            break;
+        case "udc"_:
+            item.type = MqttItem::MPPT;
+            item.key = "UDC";
+            item.trackerValue = [](const mppt& dc) { return (float)dc.Udc() / 100; };
+            break;
+        case "null"_:   // empty string (MQTT stream to CSV)
+            item.type = MqttItem::NONE;
+            break;
+        default:
+            if (VERBOSE_NORMAL) std::cout << "MQTT: Don't know what to do with '" << name << "'" << std::endl;
+            continue;
+        }
+
+#if defined(_MSC_VER)
+#   pragma warning(pop)
+#endif
+
+        if (item.type == MqttItem::MPPT)
+        {
+            // Tracker number is appended to the key when the item is used
+            item.label.prefix = before;
+            item.label.suffix = after;
+        }
+        else if (item.type != MqttItem::NONE)
+        {
+            item.label.prefix = keyed(before, name);
+            item.label.suffix = keyed(after, name);
+        }
+        item.label.field = key;
+        item.quoted = quoted;
+
+        auto deadband = deadbands.find(key);
+        if (deadband != deadbands.end())
+        {
+            item.deadband = deadband->second.first;
+            item.relative = deadband->second.second;
+        }
+
+        m_items.push_back(item);
+    }
+}
+
+bool MqttExport::parseDeadbands(const std::string& list, std::map<std::string, std::pair<double, bool>>& deadbands)
+{
+    std::vector<std::string> items;
+    boost::split(items, list, boost::is_any_of(","));
+
+    for (const auto& item : items)
+    {
+        if (item.empty())
+            continue;
+
+        const size_t sep = item.find(':');
+        if (sep == std::string::npos)
+            return false;
+
+        std::string key = item.substr(0, sep);
+        std::string value = item.substr(sep + 1);
+        boost::to_lower(key);
+
+        const bool relative = !value.empty() && (value.back() == '%');
+        if (relative)
+            value.pop_back();
+
+        char *pEnd = NULL;
+        const double band = strtod(value.c_str(), &pEnd);
+        if (key.empty() || value.empty() || (*pEnd != 0))
+            return false;
+
+        deadbands[key] = std::make_pair(band, relative);
+    }
+
+    return true;
+}
+
+// Format the values of an inverter into m_values
+void MqttExport::collect(const InverterData& inv)
+{
     const int prec = m_config.precision;
     const char dp = '.';
 
-    for (const auto& inv : inverterData)
+    m_valueCount = 0;
+
+    for (auto& item : m_items)
     {
-#if defined(_WIN32)
-        std::string mqtt_command_line = "\"\"" + m_config.mqtt_publish_exe + "\" " + m_config.mqtt_publish_args + "\"";
-#else
-        std::string mqtt_command_line = m_config.mqtt_publish_exe + " " + m_config.mqtt_publish_args;
-        // On Linux, message must be inside single quotes
-        boost::replace_all(mqtt_command_line, "\"", "'");
-#endif
+        const size_t count = (item.type == MqttItem::MPPT) ? inv.mpp.size() : 1;
+        if (m_values.size() < m_valueCount + count)
+            m_values.resize(m_valueCount + count);
 
-        // Fill host/port/topic
-        boost::replace_first(mqtt_command_line, "{host}", m_config.mqtt_host);
-        boost::replace_first(mqtt_command_line, "{port}", m_config.mqtt_port);
-        boost::replace_first(mqtt_command_line, "{topic}", m_config.mqtt_topic);
+        if (item.type == MqttItem::MPPT)
+        {
+            // Resize before labels are referenced by m_values
+            if (!inv.mpp.empty() && (item.trackers.size() <= inv.mpp.rbegin()->first))
+                item.trackers.resize(inv.mpp.rbegin()->first + 1);
 
-        mqtt_message.str("");
+            for (const auto& dc : inv.mpp)
+            {
+                MqttLabel& label = item.trackers[dc.first];
+                if (label.field.empty())
+                {
+                    const std::string key = item.key + std::to_string(dc.first);
+                    label.prefix = keyed(item.label.prefix, key);
+                    label.suffix = keyed(item.label.suffix, key);
+                    label.field = boost::to_lower_copy(key);
+                }
+
+                MqttValue& value = m_values[m_valueCount++];
+                value.item = &item;
+                value.label = &label;
+                value.number = item.trackerValue(dc.second);
+                value.text = FormatFloat(m_value, (float)value.number, 0, prec, dp);
+            }
+            continue;
+        }
 
-        for (const auto& item : items)
+        MqttValue& value = m_values[m_valueCount++];
+        value.item = &item;
+        value.label = &item.label;
+        value.number = 0;
+        value.text.clear();
+
+        switch (item.type)
+        {
+        case MqttItem::FLOAT:
+        {
+            const float number = item.floatValue(inv);
+            value.number = number;
+            value.text = FormatFloat(m_value, number, 0, prec, dp);
+            break;
+        }
+        case MqttItem::DOUBLE:
+            value.number = item.doubleValue(inv);
+            value.text = FormatDouble(m_value, value.number, 0, prec, dp);
+            break;
+        case MqttItem::SERIAL:
+            value.number = (double)inv.Serial;
+            snprintf(m_value, sizeof(m_value), "%lu", inv.Serial);
+            value.text = m_value;
+            break;
+        case MqttItem::TEXT:
+            item.textValue(m_config, inv, value.text);
+            break;
+        case MqttItem::TIME:
         {
-            bool add_to_msg = true;
-            key = item;
-            memset(value, 0, sizeof(value));
-            std::transform(key.begin(), key.end(), key.begin(), [](auto ch)
+            const time_t rawtime = item.timeValue(m_config, inv);
+            if (item.lastText.empty() || (rawtime != item.lastTime))
             {
-                return static_cast<char>(std::tolower(ch));
-            });
+                item.lastTime = rawtime;
+                item.lastText = strftime_t(m_config.DateTimeFormat, rawtime);
+            }
+            value.number = (double)rawtime;
+            value.text = item.lastText;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
 
-// suppress warning C4307: '*': integral constant overflow
-#if defined(_MSC_VER)
-#   pragma warning(push)
-#   pragma warning(disable: 4307)
-#endif
+// Build the message of an inverter from m_values
+void MqttExport::buildMessage()
+{
+    const std::string& delimiter = m_config.mqtt_item_delimiter;
+
+    m_message.clear();
+
+    for (size_t i = 0; i < m_valueCount; i++)
+    {
+        const MqttValue& value = m_values[i];
+        const bool quoted = value.item->quoted && ((value.item->type == MqttItem::TEXT) || (value.item->type == MqttItem::TIME));
+
+        if (i > 0) m_message += delimiter;
+        m_message += value.label->prefix;
+        if (quoted) m_message += '"';
+        m_message += value.text;
+        if (quoted) m_message += '"';
+        m_message += value.label->suffix;
+    }
+}
+
+// Value moved beyond its deadband, or wasn't published for MQTT_Heartbeat seconds
+bool MqttExport::changed(const MqttValue& value, const MqttFieldState& state, time_t now) const
+{
+    if ((state.published == 0) || (now < state.published) || (now - state.published >= m_heartbeat))
+        return true;
+
+    const MqttItem& item = *value.item;
+    if (item.deadband < 0)
+        return false;
 
-            switch (djb::hash(key.c_str()))
+    if ((item.type == MqttItem::TEXT) || (item.type == MqttItem::NONE))
+        return value.text != state.text;
+
+    const double band = item.relative ? fabs(state.value) * item.deadband / 100 : item.deadband;
+    return fabs(value.number - state.value) > band;
+}
+
+int MqttExport::exportInverterData(const std::vector<InverterData>& inverterData)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    int rc = 0;
+    const time_t now = time(nullptr);
+
+    // A new day starts with a new state
+    if (m_heartbeat > 0)
+    {
+        const std::string file = stateFile(now);
+        if (file != m_stateLoaded)
+            loadState(file);
+    }
+
+    bool published = false;
+    for (const auto& inv : inverterData)
+    {
+        collect(inv);
+
+        int publish_rc = 0;
+        if (!m_config.mqtt_field_topic.empty())
+        {
+            publish_rc = publishFields(inv, now);
+            published = true;
+        }
+        else
+        {
+            // Whole message is published when any of its values changed
+            auto& state = m_state[inv.Serial];
+            bool any = (m_heartbeat == 0);
+            for (size_t i = 0; i < m_valueCount && !any; i++)
+                any = changed(m_values[i], state[m_values[i].label->field], now);
+
+            if (!any)
             {
-            case "prgversion"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", m_config.prgVersion);
-                break;
-            case "plantname"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", m_config.plantname);
-                break;
-            case "timestamp"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, time(nullptr)).c_str());
-                break;
-            case "sunrise"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, to_time_t(m_config.sunrise)).c_str());
-                break;
-            case "sunset"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, to_time_t(m_config.sunset)).c_str());
-                break;
-            case "invserial"_:
-                snprintf(value, sizeof(value) - 1, "%lu", inv.Serial);
-                break;
-            case "invname"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", inv.DeviceName.c_str());
-                break;
-            case "invclass"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", inv.DeviceClass.c_str());
-                break;
-            case "invtype"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", inv.DeviceType.c_str());
-                break;
-            case "invswver"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", inv.SWVersion.c_str());
-                break;
-            case "invtime"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, inv.InverterDatetime).c_str());
-                break;
-            case "invstatus"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", tagdefs.getDesc(inv.DeviceStatus, "?").c_str());
-                break;
-            case "invtemperature"_:
-                FormatFloat(value, is_NaN(inv.Temperature) ? 0.0f : (float)inv.Temperature / 100, 0, prec, dp);
-                break;
-            case "invgridrelay"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", tagdefs.getDesc(inv.GridRelayStatus, "?").c_str());
-                break;
-            case "pdc1"_:
-                FormatFloat(value, (float)inv.mpp.at(1).Pdc(), 0, prec, dp);
-                break;
-            case "pdc2"_:
-                FormatFloat(value, (float)inv.mpp.at(2).Pdc(), 0, prec, dp);
-                break;
-            case "pdctot"_:
-                FormatFloat(value, (float)inv.calPdcTot, 0, prec, dp);
-                break;
-            case "idc1"_:
-                FormatFloat(value, (float)inv.mpp.at(1).Idc() / 1000, 0, prec, dp);
-                break;
-            case "idc2"_:
-                FormatFloat(value, (float)inv.mpp.at(2).Idc() / 1000, 0, prec, dp);
-                break;
-            case "udc1"_:
-                FormatFloat(value, (float)inv.mpp.at(1).Udc() / 100, 0, prec, dp);
-                break;
-            case "udc2"_:
-                FormatFloat(value, (float)inv.mpp.at(2).Udc() / 100, 0, prec, dp);
-                break;
-            case "etotal"_:
-                FormatDouble(value, (double)inv.ETotal / 1000, 0, prec, dp);
-                break;
-            case "etoday"_:
-                FormatDouble(value, (double)inv.EToday / 1000, 0, prec, dp);
-                break;
-            case "pactot"_:
-                FormatFloat(value, (float)inv.TotalPac, 0, prec, dp);
-                break;
-            case "pac1"_:
-                FormatFloat(value, (float)inv.Pac1, 0, prec, dp);
-                break;
-            case "pac2"_:
-                FormatFloat(value, (float)inv.Pac2, 0, prec, dp);
-                break;
-            case "pac3"_:
-                FormatFloat(value, (float)inv.Pac3, 0, prec, dp);
-                break;
-            case "uac1"_:
-                FormatFloat(value, (float)inv.Uac1 / 100, 0, prec, dp);
-                break;
-            case "uac2"_:
-                FormatFloat(value, (float)inv.Uac2 / 100, 0, prec, dp);
-                break;
-            case "uac3"_:
-                FormatFloat(value, (float)inv.Uac3 / 100, 0, prec, dp);
-                break;
-            case "iac1"_:
-                FormatFloat(value, (float)inv.Iac1 / 1000, 0, prec, dp);
-                break;
-            case "iac2"_:
-                FormatFloat(value, (float)inv.Iac2 / 1000, 0, prec, dp);
-                break;
-            case "iac3"_:
-                FormatFloat(value, (float)inv.Iac3 / 1000, 0, prec, dp);
-                break;
-            case "gridfreq"_:
-                FormatFloat(value, (float)inv.GridFreq / 100, 0, prec, dp);
-                break;
-            case "opertm"_:
-                FormatDouble(value, (double)inv.OperationTime / 3600, 0, prec, dp);
-                break;
-            case "feedtm"_:
-                FormatDouble(value, (double)inv.FeedInTime / 3600, 0, prec, dp);
-                break;
-            case "btsignal"_:
-                FormatFloat(value, inv.BT_Signal, 0, prec, dp);
-                break;
-            case "battmpval"_:
-                FormatFloat(value, ((float)inv.BatTmpVal) / 10, 0, prec, dp);
-                break;
-            case "batvol"_:
-                FormatFloat(value, ((float)inv.BatVol) / 100, 0, prec, dp);
-                break;
-            case "batamp"_:
-                FormatFloat(value, ((float)inv.BatAmp) / 1000, 0, prec, dp);
-                break;
-            case "batchastt"_:
-                FormatFloat(value, ((float)inv.BatChaStt), 0, prec, dp);
-                break;
-            case "invwakeuptm"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, inv.WakeupTime).c_str());
-                break;
-            case "invsleeptm"_:
-                snprintf(value, sizeof(value) - 1, "\"%s\"", strftime_t(m_config.DateTimeFormat, inv.SleepTime).c_str());
-                break;
-            case "meteringwin"_:
-                FormatFloat(value, (float)inv.MeteringGridMsTotWIn, 0, prec, dp);
-                break;
-            case "meteringwout"_:
-                FormatFloat(value, (float)inv.MeteringGridMsTotWOut, 0, prec, dp);
-                break;
-            case "meteringwtot"_:
-                FormatFloat(value, (float)(inv.MeteringGridMsTotWIn - inv.MeteringGridMsTotWOut), 0, prec, dp);
-                break;
-            case "pdc"_:
-                for (const auto& dc : inv.mpp)
+                if (VERBOSE_NORMAL) std::cout << "MQTT: " << inv.Serial << " unchanged, not published" << std::endl;
+                continue;
+            }
+
+            buildMessage();
+
+            if (VERBOSE_NORMAL) std::cout << "MQTT: Publishing (" << m_config.mqtt_topic << ')' << m_config.mqtt_item_delimiter << m_message << std::endl;
+
+            publish_rc = m_config.mqtt_builtin ? publish(inv) : execPublisher(inv);
+
+            if ((publish_rc == 0) && (m_heartbeat > 0))
+            {
+                for (size_t i = 0; i < m_valueCount; i++)
                 {
-                    FormatFloat(value, (float)dc.second.Pdc(), 0, prec, dp);
-                    mqtt_message << to_keyvalue(std::string("PDC") + std::to_string(dc.first), value);
-                    add_to_msg = false;
+                    MqttFieldState& field = state[m_values[i].label->field];
+                    field.value = m_values[i].number;
+                    field.text = m_values[i].text;
+                    field.published = now;
                 }
-                break;
-            case "idc"_:
-                for (const auto& dc : inv.mpp)
+                published = true;
+            }
+        }
+
+        if (publish_rc != 0)
+            rc = publish_rc;
+    }
+
+    if (published && (m_heartbeat > 0))
+        saveState(stateFile(now), now);
+
+    return rc;
+}
+
+// One retained message per value: MQTT_FieldTopic with {key} replaced by the lowercase key
+int MqttExport::publishFields(const InverterData& inv, time_t now)
+{
+    int rc = 0;
+    int count = 0;
+    auto& state = m_state[inv.Serial];
+
+    for (size_t i = 0; i < m_valueCount; i++)
+    {
+        const MqttValue& value = m_values[i];
+        if (value.item->type == MqttItem::NONE)
+            continue;
+
+        MqttFieldState& field = state[value.label->field];
+        if ((m_heartbeat > 0) && !changed(value, field, now))
+            continue;
+
+        if (field.topic.empty())
+        {
+            field.topic = m_config.mqtt_field_topic;
+            boost::replace_all(field.topic, "{plantname}", m_config.plantname);
+            boost::replace_all(field.topic, "{serial}", std::to_string(inv.Serial));
+            boost::replace_all(field.topic, "{key}", value.label->field);
+        }
+
+        if (VERBOSE_HIGH) std::cout << "MQTT: Publishing (" << field.topic << ") " << value.text << std::endl;
+
+        if (m_client.publish(field.topic, value.text, m_qos, true) != 0)
+        {
+            std::cout << "MQTT: Failed to publish to " << m_config.mqtt_host << std::endl;
+            rc = -1;
+            break;
+        }
+
+        field.value = value.number;
+        field.text = value.text;
+        field.published = now;
+        count++;
+    }
+
+    if (VERBOSE_NORMAL) std::cout << "MQTT: " << inv.Serial << " published " << count << " of " << m_valueCount << " values" << std::endl;
+
+    return rc;
+}
+
+// Waits at most <timeout> milliseconds for a command
+// Invalid commands are answered right away
+bool MqttExport::nextCommand(MqttCommand& command, unsigned int timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    std::string topic, payload, error;
+
+    do
+    {
+        // Short slices, the export worker shares the connection
+        const long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        const unsigned int slice = (unsigned int)std::max(0LL, std::min(remaining, 100LL));
+
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+
+            bool connected = m_client.isConnected() || (m_client.connect() == 0);
+            if (connected)
+                m_client.loop(slice);
+
+            while (m_client.message(topic, payload))
+            {
+                if (topic != m_commandTopic)
+                    continue;
+
+                if (VERBOSE_NORMAL) std::cout << "MQTT: Command (" << payload << ')' << std::endl;
+
+                if (MqttCommand::parse(payload, command, error))
+                    return true;
+
+                std::cout << "MQTT: Invalid command: " << error << std::endl;
+                publishResultLocked(command, E_BADARG, std::vector<InverterData>());
+            }
+
+            if (connected)
+                continue;
+        }
+
+        // Broker unavailable, retry after the timeout
+        std::this_thread::sleep_until(deadline);
+    } while (std::chrono::steady_clock::now() < deadline);
+
+    return false;
+}
+
+int MqttExport::publishResult(const MqttCommand& command, int result, const std::vector<InverterData>& inverterData)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return publishResultLocked(command, result, inverterData);
+}
+
+// One message per inverter, MQTT_Data preceded by the Id of the command and the Result of the poll (0=OK)
+// Without inverters, only the Id and Result are published
+int MqttExport::publishResultLocked(const MqttCommand& command, int result, const std::vector<InverterData>& inverterData)
+{
+    const std::string& delimiter = m_config.mqtt_item_delimiter;
+    int rc = 0;
+    size_t idx = 0;
+
+    do
+    {
+        m_message.clear();
+        if (idx < inverterData.size())
+        {
+            collect(inverterData[idx]);
+            buildMessage();
+        }
+
+        m_payload.assign(m_payloadHead);
+        m_payload += m_idLabel.prefix;
+        if (m_quoted) m_payload += '"';
+        m_payload += command.id;
+        if (m_quoted) m_payload += '"';
+        m_payload += m_idLabel.suffix;
+        m_payload += delimiter;
+        m_payload += m_resultLabel.prefix;
+        m_payload += std::to_string(result);
+        m_payload += m_resultLabel.suffix;
+        if (!m_message.empty())
+        {
+            m_payload += delimiter;
+            m_payload += m_message;
+        }
+        m_payload += m_payloadTail;
+
+        if (VERBOSE_NORMAL) std::cout << "MQTT: Publishing (" << m_resultTopic << ") " << m_payload << std::endl;
+
+        if (m_client.publish(m_resultTopic, m_payload, m_qos, false) != 0)
+        {
+            std::cout << "MQTT: Failed to publish to " << m_config.mqtt_host << std::endl;
+            rc = -1;
+        }
+    } while (++idx < inverterData.size());
+
+    return rc;
+}
+
+static const unsigned long spotDataTypes = SpotDCPower | SpotDCVoltage | SpotACPower | SpotACVoltage | SpotGridFrequency | SpotACTotalPower;
+
+static const struct
+{
+    const char *name;
+    unsigned long type;
+} commandDataTypes[] =
+{
+    { "EnergyProduction", EnergyProduction },
+    { "SpotDCPower", SpotDCPower },
+    { "SpotDCVoltage", SpotDCVoltage },
+    { "SpotACPower", SpotACPower },
+    { "SpotACVoltage", SpotACVoltage },
+    { "SpotGridFrequency", SpotGridFrequency },
+    { "SpotACTotalPower", SpotACTotalPower },
+    { "TypeLabel", TypeLabel },
+    { "OperationTime", OperationTime },
+    { "SoftwareVersion", SoftwareVersion },
+    { "DeviceStatus", DeviceStatus },
+    { "GridRelayStatus", GridRelayStatus },
+    { "BatteryChargeStatus", BatteryChargeStatus },
+    { "BatteryInfo", BatteryInfo },
+    { "InverterTemperature", InverterTemperature },
+    { "MeteringGridMsTotW", MeteringGridMsTotW },
+    { "Spot", spotDataTypes }
+};
+
+bool MqttCommand::parse(const std::string& payload, MqttCommand& command, std::string& error)
+{
+    command.id.clear();
+    command.dataTypes = 0;
+    command.serials.clear();
+
+    std::vector<std::string> args;
+    boost::split(args, payload, boost::is_any_of(";"));
+
+    for (auto& arg : args)
+    {
+        boost::trim(arg);
+        if (arg.empty())
+            continue;
+
+        const size_t sep = arg.find('=');
+        const std::string key = boost::trim_copy(arg.substr(0, sep));
+        const std::string value = (sep == std::string::npos) ? "" : boost::trim_copy(arg.substr(sep + 1));
+
+        std::vector<std::string> items;
+        boost::split(items, value, boost::is_any_of(","));
+
+        if (boost::iequals(key, "id"))
+            command.id = value;
+        else if (boost::iequals(key, "data"))
+        {
+            for (auto& item : items)
+            {
+                boost::trim(item);
+                const size_t count = sizeof(commandDataTypes) / sizeof(commandDataTypes[0]);
+                size_t i = 0;
+                while ((i < count) && !boost::iequals(item, commandDataTypes[i].name))
+                    i++;
+                if (i == count)
                 {
-                    FormatFloat(value, (float)dc.second.Idc() / 1000, 0, prec, dp);
-                    mqtt_message << to_keyvalue(std::string("IDC") + std::to_string(dc.first), value);
-                    add_to_msg = false;
+                    error = "Unknown data '" + item + "'";
+                    return false;
                 }
-                break;
-            case "udc"_:
-                for (const auto& dc : inv.mpp)
+                command.dataTypes |= commandDataTypes[i].type;
+            }
+        }
+        else if (boost::iequals(key, "serial"))
+        {
+            for (auto& item : items)
+            {
+                char *pEnd = NULL;
+                boost::trim(item);
+                const unsigned long serial = strtoul(item.c_str(), &pEnd, 10);
+                if (item.empty() || (*pEnd != 0))
                 {
-                    FormatFloat(value, (float)dc.second.Udc() / 100, 0, prec, dp);
-                    mqtt_message << to_keyvalue(std::string("UDC") + std::to_string(dc.first), value);
-                    add_to_msg = false;
+                    error = "Invalid serial '" + item + "'";
+                    return false;
                 }
-                break;
-            case "null"_:   // empty string (MQTT stream to CSV)
-                mqtt_message << m_config.mqtt_item_delimiter;
-                add_to_msg = false;
-                break;
-            default:
-                add_to_msg = false;
-                if (VERBOSE_NORMAL) std::cout << "MQTT: Don't know what to do with '" << item << "'" << std::endl;
-                break;
+                command.serials.push_back(serial);
             }
+        }
+        else
+        {
+            error = "Unknown argument '" + key + "'";
+            return false;
+        }
+    }
 
-#if defined(_MSC_VER)
-#   pragma warning(pop)
-#endif
+    if (command.dataTypes == 0)
+        command.dataTypes = spotDataTypes;
+
+    return true;
+}
+
+std::string MqttExport::stateFile(time_t now) const
+{
+    return strftime_t(m_config.outputPath, now) + FOLDER_SEP + m_config.plantname + "-Mqtt.state";
+}
+
+// One line per inverter field: serial, key, time and value of the last publication, text
+void MqttExport::loadState(const std::string& file)
+{
+    m_state.clear();
+    m_stateLoaded = file;
+
+    std::ifstream state(file);
+    unsigned long serial;
+    std::string key;
+    MqttFieldState field;
+    while (state >> serial >> key >> field.published >> field.value)
+    {
+        state.get();    // Separator
+        if (std::getline(state, field.text))
+            m_state[serial][key] = field;
+    }
+}
+
+void MqttExport::saveState(const std::string& file, time_t now) const
+{
+    CreatePath(strftime_t(m_config.outputPath, now).c_str());
 
-            if (add_to_msg)
-                mqtt_message << to_keyvalue(item, value);
+    std::ofstream state(file, std::ios::trunc);
+    state.precision(17);
+    for (const auto& inv : m_state)
+    {
+        for (const auto& field : inv.second)
+        {
+            if (field.second.published > 0)
+                state << inv.first << ' ' << field.first << ' ' << field.second.published << ' ' << field.second.value << ' ' << field.second.text << '\n';
         }
+    }
 
-        boost::replace_first(mqtt_command_line, "{plantname}", m_config.plantname);
-        boost::replace_first(mqtt_command_line, "{serial}", std::to_string(inv.Serial));
-        boost::replace_first(mqtt_command_line, "{message}", mqtt_message.str().substr(1));
+    if (!state)
+    {
+        char msg[80 + MAX_PATH];
+        snprintf(msg, sizeof(msg), "Unable to write %s\n", file.c_str());
+        print_error(stdout, PROC_WARNING, msg);
+    }
+}
 
-        if (VERBOSE_NORMAL) std::cout << "MQTT: Publishing (" << m_config.mqtt_topic << ')' << m_config.mqtt_item_delimiter << mqtt_message.str().substr(1) << std::endl;
+// The builtin client accepts the mosquitto_pub options of MQTT_PublisherArgs,
+// so existing configurations can switch from MQTT_Client=publisher without changes
+void MqttExport::parsePublisherArgs()
+{
+    // Split arguments, double quoted arguments may contain blanks
+    std::vector<std::string> args;
+    std::string arg;
+    bool quoted = false, in_arg = false;
+    for (const char ch : m_config.mqtt_publish_args)
+    {
+        if (ch == '"')
+        {
+            quoted = !quoted;
+            in_arg = true;
+        }
+        else if ((ch == ' ' || ch == '\t') && !quoted)
+        {
+            if (in_arg) args.push_back(arg);
+            arg.clear();
+            in_arg = false;
+        }
+        else
+        {
+            arg += ch;
+            in_arg = true;
+        }
+    }
+    if (in_arg) args.push_back(arg);
 
-        int system_rc = ::system(mqtt_command_line.c_str());
+    std::string host("{host}"), port("{port}"), username, password;
+    std::string clientId = "SBFspot-" + std::to_string(std::random_device()() % 1000000);
+    unsigned int keepAlive = 60;
+    std::string payload("{message}");
+    m_topic = "{topic}";
 
-        if (system_rc != 0) // Error
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string& opt = args[i];
+        if ((opt == "-r") || (opt == "--retain"))
+            m_retain = true;
+        else if ((opt == "-d") || (opt == "--debug") || (opt == "--quiet"))
+            ;   // Not applicable
+        else if ((i + 1 < args.size()) && (opt.length() > 1) && (opt[0] == '-'))
         {
-            std::cout << "MQTT: Failed to execute '" << m_config.mqtt_publish_exe << "' mosquitto client installed?" << std::endl;
-            rc = system_rc;
+            const std::string& val = args[++i];
+            if ((opt == "-h") || (opt == "--host"))
+                host = val;
+            else if ((opt == "-p") || (opt == "--port"))
+                port = val;
+            else if ((opt == "-t") || (opt == "--topic"))
+                m_topic = val;
+            else if ((opt == "-m") || (opt == "--message"))
+                payload = val;
+            else if ((opt == "-q") || (opt == "--qos"))
+                m_qos = atoi(val.c_str());
+            else if ((opt == "-u") || (opt == "--username"))
+                username = val;
+            else if ((opt == "-P") || (opt == "--pw"))
+                password = val;
+            else if ((opt == "-i") || (opt == "--id"))
+                clientId = val;
+            else if ((opt == "-k") || (opt == "--keepalive"))
+                keepAlive = (unsigned int)atoi(val.c_str());
+            else
+                std::cout << "MQTT: Option '" << opt << "' not supported by builtin client (use MQTT_Client=publisher)" << std::endl;
         }
+        else
+            std::cout << "MQTT: Option '" << opt << "' not supported by builtin client (use MQTT_Client=publisher)" << std::endl;
     }
 
-    return rc;
+    boost::replace_first(host, "{host}", m_config.mqtt_host);
+    boost::replace_first(port, "{port}", m_config.mqtt_port);
+    boost::replace_first(m_topic, "{topic}", m_config.mqtt_topic);
+
+    const size_t msgpos = payload.find("{message}");
+    m_payloadHead = payload.substr(0, msgpos);
+    m_payloadTail = (msgpos == std::string::npos) ? "" : payload.substr(msgpos + 9);
+
+    m_client.setServer(host, port);
+    m_client.setCredentials(username, password);
+    m_client.setClientId(clientId);
+    m_client.setKeepAlive(keepAlive);
 }
 
-std::string MqttExport::to_keyvalue(const std::string key, const std::string value) const
+int MqttExport::publish(const InverterData& inv)
 {
-    std::string key_value = m_config.mqtt_item_delimiter + m_config.mqtt_item_format;
-    boost::replace_all(key_value, "{key}", key);
-    boost::replace_first(key_value, "{value}", value);
+    auto topic = m_topics.find(inv.Serial);
+    if (topic == m_topics.end())
+    {
+        std::string name(m_topic);
+        boost::replace_all(name, "{plantname}", m_config.plantname);
+        boost::replace_all(name, "{serial}", std::to_string(inv.Serial));
+        topic = m_topics.insert(std::make_pair(inv.Serial, name)).first;
+    }
+
+    m_payload.assign(m_payloadHead).append(m_message).append(m_payloadTail);
+
+    int rc = m_client.publish(topic->second, m_payload, m_qos, m_retain);
+    if (rc != 0)
+        std::cout << "MQTT: Failed to publish to " << m_config.mqtt_host << std::endl;
 
-    boost::replace_all(key_value, "\"\"", "\"");
+    return rc;
+}
+
+int MqttExport::execPublisher(const InverterData& inv)
+{
 #if defined(_WIN32)
+    std::string mqtt_command_line = "\"\"" + m_config.mqtt_publish_exe + "\" " + m_config.mqtt_publish_args + "\"";
+
     // When exporting MQTT stream to CSV, don't use double/double quotes
+    std::string message(m_message);
     if (m_config.mqtt_topic != "CSV")   // Case sensitive!
-        boost::replace_all(key_value, "\"", "\"\"");
+        boost::replace_all(message, "\"", "\"\"");
+#else
+    std::string mqtt_command_line = m_config.mqtt_publish_exe + " " + m_config.mqtt_publish_args;
+    // On Linux, message must be inside single quotes
+    boost::replace_all(mqtt_command_line, "\"", "'");
+
+    const std::string& message = m_message;
 #endif
 
-    return key_value;
+    // Fill host/port/topic
+    boost::replace_first(mqtt_command_line, "{host}", m_config.mqtt_host);
+    boost::replace_first(mqtt_command_line, "{port}", m_config.mqtt_port);
+    boost::replace_first(mqtt_command_line, "{topic}", m_config.mqtt_topic);
+
+    boost::replace_first(mqtt_command_line, "{plantname}", m_config.plantname);
+    boost::replace_first(mqtt_command_line, "{serial}", std::to_string(inv.Serial));
+    boost::replace_first(mqtt_command_line, "{message}", message);
+
+    int system_rc = ::system(mqtt_command_line.c_str());
+
+    if (system_rc != 0) // Error
+        std::cout << "MQTT: Failed to execute '" << m_config.mqtt_publish_exe << "' mosquitto client installed?" << std::endl;
+
+    return system_rc;
 }
 
 time_t MqttExport::to_time_t(float time_f)
 {
     auto timestamp = time(nullptr);
-    auto localtm = std::localtime(&timestamp);
-    localtm->tm_sec = 0;
-    localtm->tm_hour = (int)time_f;
-    localtm->tm_min = (int)((time_f - (int)time_f) * 60);
-    return std::mktime(localtm);
+    struct tm localtm;
+    localtime_s(&localtm, &timestamp);
+    localtm.tm_sec = 0;
+    localtm.tm_hour = (int)time_f;
+    localtm.tm_min = (int)((time_f - (int)time_f) * 60);
+    return std::mktime(&localtm);
 }
@@ -34,12 +34,81 @@ DISCLAIMER:
 
 #pragma once
 
+#include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 #include "hash.h"
+#include "MqttClient.h"
 
 struct Config;
 struct InverterData;
+class mppt;
+
+// Text around the value of an item
+struct MqttLabel
+{
+    std::string prefix;     // Item format before {value}, {key} filled in
+    std::string suffix;     // Item format after {value}
+    std::string field;      // Lowercase key, used by MQTT_FieldTopic and the change state
+};
+
+// Item of MQTT_Data, compiled once with MQTT_ItemFormat
+struct MqttItem
+{
+    enum Type { FLOAT, DOUBLE, TEXT, TIME, SERIAL, MPPT, NONE };
+
+    Type type;
+    MqttLabel label;
+    bool quoted;            // TEXT: item format has no quotes around {value}
+
+    // MQTT_Deadbands, used when MQTT_Heartbeat is set
+    double deadband;        // Negative: only published by the heartbeat
+    bool relative;          // Deadband in % of the last published value
+
+    float (*floatValue)(const InverterData& inv);
+    double (*doubleValue)(const InverterData& inv);
+    void (*textValue)(const Config& config, const InverterData& inv, std::string& out);
+    time_t (*timeValue)(const Config& config, const InverterData& inv);
+
+    // TIME: last formatted value, most timestamps are the same for all inverters of a poll
+    time_t lastTime;
+    std::string lastText;
+
+    // MPPT: one item per tracker (PDC1, PDC2, ...)
+    float (*trackerValue)(const mppt& dc);
+    std::string key;
+    std::vector<MqttLabel> trackers;   // Built on first use
+};
+
+// Formatted value of an item, shared by the message and the per field topics
+struct MqttValue
+{
+    const MqttItem *item;
+    const MqttLabel *label;
+    double number;
+    std::string text;
+};
+
+// Last published value of a field
+struct MqttFieldState
+{
+    double value;
+    std::string text;
+    time_t published;
+    std::string topic;      // Not saved
+};
+
+// On-demand poll, received on MQTT_CommandTopic (SBFspot -listen)
+// Payload: id=<correlation id>;data=<getInverterDataType>,...;serial=<serial>,...
+struct MqttCommand
+{
+    std::string id;                     // Returned with the result
+    unsigned long dataTypes;            // getInverterDataType flags, default all spot data
+    std::vector<unsigned long> serials; // Empty: all inverters
+
+    static bool parse(const std::string& payload, MqttCommand& command, std::string& error);
+};
 
 class MqttExport
 {
@@ -47,11 +116,58 @@ public:
     MqttExport(const Config& config);
     ~MqttExport();
 
+    // Parse "Key:deadband[%],..." (MQTT_Deadbands)
+    static bool parseDeadbands(const std::string& list, std::map<std::string, std::pair<double, bool>>& deadbands);
+
     int exportInverterData(const std::vector<InverterData>& inverterData);
 
+    // Command channel, bypasses the export queue
+    bool nextCommand(MqttCommand& command, unsigned int timeout);
+    int publishResult(const MqttCommand& command, int result, const std::vector<InverterData>& inverterData);
+
 private:
     const Config& m_config;
+    std::mutex m_lock;      // Shared by the export worker and the command channel
+
+    std::vector<MqttItem> m_items;
+    std::vector<MqttValue> m_values;    // Reused for each inverter
+    size_t m_valueCount;
+    std::string m_message;
+    char m_value[80];
+
+    // Change driven publishing (MQTT_Heartbeat), one state per inverter and field
+    const time_t m_heartbeat;
+    std::map<unsigned long, std::map<std::string, MqttFieldState>> m_state;
+    std::string m_stateLoaded;
+
+    // Builtin client, options taken from MQTT_PublisherArgs
+    MqttClient m_client;
+    std::string m_topic;    // -t {topic}
+    std::string m_payloadHead;  // -m "{{message}}" split at {message}
+    std::string m_payloadTail;
+    std::string m_payload;
+    std::map<unsigned long, std::string> m_topics;  // Topic per serial
+    std::string m_commandTopic;
+    std::string m_resultTopic;  // {commandtopic}/result
+    MqttLabel m_idLabel;        // Id and Result items of a command result
+    MqttLabel m_resultLabel;
+    bool m_quoted;
+    int m_qos;              // -q
+    bool m_retain;          // -r
+
+    void compile();
+    void collect(const InverterData& inv);
+    void buildMessage();
+    bool changed(const MqttValue& value, const MqttFieldState& state, time_t now) const;
+    int publishFields(const InverterData& inv, time_t now);
+    void parsePublisherArgs();
+    int publish(const InverterData& inv);
+    int execPublisher(const InverterData& inv);
+    int publishResultLocked(const MqttCommand& command, int result, const std::vector<InverterData>& inverterData);
+
+    std::string stateFile(time_t now) const;
+    void loadState(const std::string& file);
+    void saveState(const std::string& file, time_t now) const;
 
-    std::string to_keyvalue(const std::string key, const std::string value) const;
-    time_t to_time_t(float time_f);
+    static time_t to_time_t(float time_f);
 };
@@ -52,6 +52,8 @@ extern unsigned int sleep (unsigned int __seconds); // See unistd.h
 #include <strings.h>
 #define stricmp strcasecmp
 #define strnicmp strncasecmp
+#define localtime_s(tm, time) localtime_r(time, tm)
+#define gmtime_s(tm, time) gmtime_r(time, tm)
 
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -38,112 +38,81 @@ const uint32_t MAX_INVERTERS = 20;
 
 void CommonServiceCode(void)
 {
-    CURLcode rc_curl = CURLE_OK;
-    int rc_db = 0;
-    int batch_datelimit = 0, batch_statuslimit = 0;
-    std::stringstream msg;
+    db_SQL_Base db;
+#if defined(USE_SQLITE)
+    SQLPROFILE profile = SQLP_DEFAULT;
+    db_SQL_Base::parse_profile(cfg.getSqlProfile(), profile);
+    db.set_profile(profile);
+    db.set_busy_timeout(cfg.getSqlBusyTimeout());
+#endif
 
-    time_t nextStatusCheck = 0;
-    const time_t timeBetweenChecks = 2 * 60 * 60;   // every 2 hours
+    // One HTTP connection to pvoutput.org, reused by all PVO systems
+    if (!PVOutput::global_init())
+        Log("Failed to initialize libcurl", LOG_ERROR_);
 
-    db_SQL_Base db;
+    // Woken up by SBFspot when new DayData is stored
+    UploadNotifier notifier;
+    if (!cfg.getSqlNotifySocket().empty() && !notifier.listen(cfg.getSqlNotifySocket()))
+        Log("Unable to listen on " + cfg.getSqlNotifySocket() + ", checking for new data every " + std::to_string(cfg.getSqlQueryInterval()) + " seconds", LOG_WARNING_);
 
-    // Periodically check if the service is stopping.
-    while (!bStopping)
     {
-        msg.str("");
+        UploadScheduler scheduler(cfg.getPvoSIDs(), cfg.getPvoApiKey());
+
+        // Periodically check if the service is stopping.
+        // The connection is kept open between runs and only reopened when it was lost
+        while (!bStopping)
+        {
+            if (db.isopen() && (db.ping() != db.SQL_OK))
+            {
+                Log("Lost connection to the database, reconnecting...", LOG_WARNING_);
+                db.close();
+            }
+
+            if (!db.isopen())
+            {
 #if defined(USE_MYSQL)
-        db.open(cfg.getSqlHostname(), cfg.getSqlUsername(), cfg.getSqlPassword(), cfg.getSqlDatabase(), cfg.getSqlPort());
+                db.open(cfg.getSqlHostname(), cfg.getSqlUsername(), cfg.getSqlPassword(), cfg.getSqlDatabase(), cfg.getSqlPort());
 #elif defined(USE_SQLITE)
-        db.open(cfg.getSqlDatabase());
+                db.open(cfg.getSqlDatabase());
 #endif
+                // Config keys are only read when (re)connected, afterwards they're kept in memory
+                if (db.isopen())
+                    scheduler.load(db);
+            }
 
-        if (!db.isopen())
-            Log(db.errortext(), LOG_ERROR_);
-        else
-        {
-            for (std::map<SMASerial, PVOSystemID>::const_iterator it = cfg.getPvoSIDs().begin(); !bStopping && it != cfg.getPvoSIDs().end(); ++it)
+            if (!db.isopen())
+                Log(db.errortext(), LOG_ERROR_);
+            else
             {
-                PVOutput PVO(it->second, cfg.getPvoApiKey(), 30);
-                time_t now = time(nullptr);
-                db.get_config(SQL_NEXTSTATUSCHECK, nextStatusCheck);
-                if ((nextStatusCheck - now) < 0)
-                {
-                    PVO.getSystemData();
-
-                    if (PVO.HTTP_status() == PVOutput::HTTP_OK)
-                    {
-                        batch_datelimit = PVO.batch_datelimit();
-                        batch_statuslimit = PVO.batch_statuslimit();
-                        nextStatusCheck = now + timeBetweenChecks;
-                        db.set_config(SQL_BATCH_DATELIMIT, std::to_string(batch_datelimit));
-                        db.set_config(SQL_BATCH_STATUSLIMIT, std::to_string(batch_statuslimit));
-                        db.set_config(SQL_NEXTSTATUSCHECK, std::to_string(nextStatusCheck));
-
-                        if (!PVO.isTeamMember())
-                        {
-                            Log(PVO.SystemName() + " is not yet member of SBFspot Team. Consider joining at http://pvoutput.org/listteam.jsp?tid=613", LOG_WARNING_);
-                        }
-                    }
-                }
-
-                if (batch_datelimit == 0) batch_datelimit = PVO.batch_datelimit();
-                if (batch_statuslimit == 0) batch_statuslimit = PVO.batch_statuslimit();
-
-                std::string data;
-
-                int datapoints = 0;
-                Log("Retrieving new datapoints from DB...", ERRLEVEL::LOG_DEBUG_);
-                if ((rc_db = db.batch_get_archdaydata(data, it->first/*Serial*/, batch_datelimit, batch_statuslimit, datapoints)) == db.SQL_OK)
-                {
-                    if (!data.empty())
-                    {
-                        std::stringstream msg;
-
-                        if (datapoints == 1)
-                            msg << "Uploading datapoint: " << data;
-                        else
-                        {
-                            if (VERBOSE_HIGH)
-                                msg << "Uploading " << datapoints << " datapoints " << data;
-                            else
-                            {
-                                size_t pos = data.find_first_of(";");
-                                if (pos == std::string::npos) pos = data.length();
-                                msg << "Uploading " << datapoints << " datapoints, starting with " << data.substr(0, pos);
-                            }
-                        }
-
-                        std::string response;
-                        if ((rc_curl = PVO.addBatchStatus(data, response)) == CURLE_OK)
-                        {
-                            if (PVO.HTTP_status() == PVOutput::HTTP_OK)
-                            {
-                                msg << " => OK (200)";
-                                Log(msg.str(), LOG_INFO_);
-                                rc_db = db.batch_set_pvoflag(response, it->first/*Serial*/);
-                                if (rc_db != db.SQL_OK)
-                                    Log("batch_set_pvoflag() returned " + db.errortext(), LOG_ERROR_);
-                            }
-                            else
-                            {
-                                msg << " " << response;
-                                Log(msg.str(), LOG_ERROR_);
-                            }
-                        }
-                        else
-                            Log("addBatchStatus() returned " + PVO.errtext(), LOG_ERROR_);
-                    }
-                }
+                scheduler.run(db);
+
+#if defined(USE_SQLITE)
+                // Copy the WAL written by SBFspot to the database while we're idle anyway
+                // A passive checkpoint doesn't wait for, nor block SBFspot
+                int logged = 0, checkpointed = 0;
+                if (db.checkpoint(&logged, &checkpointed) == db.SQL_OK)
+                    Log("Checkpoint: " + std::to_string(checkpointed) + " of " + std::to_string(logged) + " WAL pages", ERRLEVEL::LOG_DEBUG_);
+#endif
             }
 
-            db.close();
+            // Wait for next run, or until SBFspot stored new data
+            uint32_t countdown = cfg.getSqlQueryInterval() + 30 - (time(nullptr) % cfg.getSqlQueryInterval());
+            if (notifier.isListening())
+            {
+                if (!bStopping && notifier.wait(countdown))
+                    Log("New data stored by SBFspot", ERRLEVEL::LOG_DEBUG_);
+            }
+            else
+            {
+                for (; !bStopping && countdown > 0; countdown--)
+                    sleep(1);
+            }
         }
-
-        // Wait for next run
-        for (uint32_t countdown = cfg.getSqlQueryInterval() + 30 - (time(nullptr) % cfg.getSqlQueryInterval()); !bStopping && countdown > 0; countdown--)
-            sleep(1);
     }
+
+    if (db.isopen())
+        db.close();
+    PVOutput::global_cleanup();
 }
 
 std::string timestamp(void)
@@ -181,28 +150,21 @@ int Log(std::string txt, ERRLEVEL level)
     }
 #endif
 
-    if (level >= cfg.getLogLevel())
+    // The logfile is written by a background thread, see Logger
+    static Logger logger;
+    static std::once_flag opened;
+    std::call_once(opened, []
     {
-        char buff[32];
-        time_t now = time(nullptr);
-        strftime(buff, sizeof(buff), "SBFspotUpload%Y%m%d.log", localtime(&now));
-        std::string fullpath(cfg.getLogDir() + buff);
+        logger.open(cfg.getLogDir(), "SBFspotUpload", cfg.getLogMaxSize() * 1024 * 1024, cfg.getLogCompress());
 
-        std::ofstream fs_log;
-        fs_log.open(fullpath.c_str(), std::ios::app | std::ios::out);
+        // Diagnostics printed by the db classes and PVOutput end up in the logfile too
+        // print_error() of the db classes writes to std::cout
+        logger.redirect([](const std::string &line) { Log(line, line.find("Error:") != std::string::npos ? LOG_ERROR_ : LOG_INFO_); },
+            [](const std::string &line) { Log(line, LOG_ERROR_); });
+    });
 
-        if (fs_log.is_open())
-        {
-            fs_log << timestamp() << errlevelText[level] << ": " << txt << '\n';
-            fs_log.close();
-            rc = 0;
-        }
-        else
-        {
-            std::cerr << "Unable to write to logfile [" << fullpath << "]" << std::endl;
-            rc = 1;
-        }
-    }
+    if (level >= cfg.getLogLevel())
+        logger.write(timestamp() + errlevelText[level] + ": " + txt + '\n', level >= cfg.getLogFlushLevel());
 
     return rc;
 }
@@ -46,6 +46,9 @@ DISCLAIMER:
 #endif
 
 #include "Configuration.h"
+#include "UploadScheduler.h"
+#include "../SBFspot/Logger.h"
+#include "../SBFspot/UploadNotify.h"
 #include <fstream>
 #include <iostream>
 #include <sstream>
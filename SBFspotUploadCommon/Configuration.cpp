@@ -127,6 +127,33 @@ int Configuration::readSettings(std::string me, std::string filename)
                         }
                     }
 
+                    else if (lineparts[0] == "logflushlevel")
+                    {
+                        if (lcValue == "debug") m_LogFlushLevel = LOG_DEBUG_;
+                        else if (lcValue == "info") m_LogFlushLevel = LOG_INFO_;
+                        else if (lcValue == "warning") m_LogFlushLevel = LOG_WARNING_;
+                        else if (lcValue == "error") m_LogFlushLevel = LOG_ERROR_;
+                        else
+                        {
+                            print_error("Syntax error", lineCnt, m_ConfigFile);
+                            m_Status = CFG_ERROR;
+                            break;
+                        }
+                    }
+
+                    else if (lineparts[0] == "logmaxsize")
+                    {
+                        m_LogMaxSize = boost::lexical_cast<unsigned long>(lineparts[1]);
+                        if (m_LogMaxSize > 1000)
+                        {
+                            std::cerr << "WARNING: LogMaxSize out of range (0-1000)" << std::endl;
+                            m_LogMaxSize = 0; // Set to default
+                        }
+                    }
+
+                    else if (lineparts[0] == "logcompress")
+                        m_LogCompress = boost::lexical_cast<int>(lineparts[1]) != 0;
+
                     else if (lineparts[0] == "pvoutput_sid")
                     {
                         std::vector<std::string> systems;
@@ -178,6 +205,21 @@ int Configuration::readSettings(std::string me, std::string filename)
                             m_SqlQueryInterval = 300; // Set to default
                         }
                     }
+                    else if (lineparts[0] == "sql_notifysocket")
+                        m_SqlNotifySocket = lineparts[1];
+#if defined(USE_SQLITE)
+                    else if (lineparts[0] == "sql_profile")
+                        m_SqlProfile = lineparts[1];
+                    else if (lineparts[0] == "sql_busytimeout")
+                    {
+                        m_SqlBusyTimeout = boost::lexical_cast<int>(lineparts[1]);
+                        if ((m_SqlBusyTimeout < 0) || (m_SqlBusyTimeout > 600000))
+                        {
+                            std::cerr << "WARNING: SQL_BusyTimeout out of range (0-600000)" << std::endl;
+                            m_SqlBusyTimeout = 10000; // Set to default
+                        }
+                    }
+#endif
                     else
                         std::cerr << "WARNING: Ignoring '" << lineparts[0] << "'" << std::endl;
                 } // try
@@ -74,6 +74,9 @@ private:
     std::string m_AppPath;
     std::string m_LogDir;
     ERRLEVEL    m_LogLevel = LOG_INFO_;
+    ERRLEVEL    m_LogFlushLevel = LOG_WARNING_;
+    unsigned long m_LogMaxSize = 0;     // MB, 0=one file per day
+    bool        m_LogCompress = false;  // Linux only
     std::string m_SqlDatabase;
     std::string m_SqlHostname;
     std::string m_SqlUsername;
@@ -82,6 +85,9 @@ private:
     std::map<SMASerial, PVOSystemID> m_PvoSIDs;
     std::string	m_PvoAPIkey;
     uint32_t m_SqlQueryInterval = 300;
+    std::string m_SqlProfile = "default";   // SQLite only
+    int m_SqlBusyTimeout = 10000;           // SQLite only
+    std::string m_SqlNotifySocket;          // Linux only
 
     std::ifstream m_fs;
 
@@ -100,6 +106,9 @@ public:
     std::string getAppPath() const { return m_AppPath; }
     std::string getLogDir() const { return m_LogDir; }
     ERRLEVEL getLogLevel() const { return m_LogLevel; }
+    ERRLEVEL getLogFlushLevel() const { return m_LogFlushLevel; }
+    unsigned long getLogMaxSize() const { return m_LogMaxSize; }
+    bool getLogCompress() const { return m_LogCompress; }
     std::string getSqlDatabase() const { return m_SqlDatabase; }
     std::string getSqlHostname() const { return m_SqlHostname; }
     std::string getSqlUsername() const { return m_SqlUsername; }
@@ -108,6 +117,9 @@ public:
     const std::map<SMASerial, PVOSystemID>& getPvoSIDs() const { return m_PvoSIDs; }
     std::string getPvoApiKey() const { return m_PvoAPIkey; }
     uint32_t getSqlQueryInterval() const { return m_SqlQueryInterval; }
+    std::string getSqlProfile() const { return m_SqlProfile; }
+    int getSqlBusyTimeout() const { return m_SqlBusyTimeout; }
+    std::string getSqlNotifySocket() const { return m_SqlNotifySocket; }
 
 private:
     bool isverbose(int level)
@@ -35,6 +35,80 @@ DISCLAIMER:
 #include "PVOutput.h"
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <mutex>
+
+CURLSH* PVOutput::s_share = NULL;
+thread_local CURL* PVOutput::t_curl = NULL;
+
+// Locks for the data shared between the handles (see global_init)
+static std::mutex share_lock[CURL_LOCK_DATA_CONNECT + 1];
+
+static void lock_share(CURL *, curl_lock_data data, curl_lock_access, void *)
+{
+    share_lock[data].lock();
+}
+
+static void unlock_share(CURL *, curl_lock_data data, void *)
+{
+    share_lock[data].unlock();
+}
+
+// Each thread gets its own handle, which keeps its connection to pvoutput.org alive
+// between requests, systems and loops. The handles share the TLS sessions and DNS cache;
+// libcurl doesn't support sharing a connection cache between threads
+bool PVOutput::global_init(void)
+{
+    if (s_share == NULL)
+    {
+        /* In windows, this will init the winsock stuff */
+        curl_global_init(CURL_GLOBAL_ALL);
+
+        if ((s_share = curl_share_init()) != NULL)
+        {
+            curl_share_setopt(s_share, CURLSHOPT_LOCKFUNC, lock_share);
+            curl_share_setopt(s_share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+            curl_share_setopt(s_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(s_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        }
+    }
+
+    return s_share != NULL;
+}
+
+// To be called by the thread that called global_init(), after all other threads called thread_cleanup()
+void PVOutput::global_cleanup(void)
+{
+    thread_cleanup();
+
+    if (s_share != NULL)
+    {
+        curl_share_cleanup(s_share);
+        s_share = NULL;
+        curl_global_cleanup();
+    }
+}
+
+void PVOutput::thread_cleanup(void)
+{
+    if (t_curl != NULL)
+    {
+        curl_easy_cleanup(t_curl);
+        t_curl = NULL;
+    }
+}
+
+CURL* PVOutput::handle(void)
+{
+    if ((t_curl == NULL) && (s_share != NULL) && ((t_curl = curl_easy_init()) != NULL))
+    {
+        curl_easy_setopt(t_curl, CURLOPT_SHARE, s_share);
+        curl_easy_setopt(t_curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(t_curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(t_curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    }
+
+    return t_curl;
+}
 
 PVOutput::PVOutput(unsigned int SID, std::string APIkey, unsigned int timeout)
 {
@@ -45,10 +119,7 @@ PVOutput::PVOutput(unsigned int SID, std::string APIkey, unsigned int timeout)
     m_Donations = 0;
     m_http_header = NULL;
 
-    /* In windows, this will init the winsock stuff */
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    m_curl = curl_easy_init();
+    m_curl = handle();
 
     if (m_curl)
     {
@@ -66,8 +137,6 @@ PVOutput::PVOutput(unsigned int SID, std::string APIkey, unsigned int timeout)
 PVOutput::~PVOutput()
 {
     curl_slist_free_all(m_http_header);
-    curl_easy_cleanup(m_curl);
-    curl_global_cleanup();
 }
 
 // Static Callback member function
@@ -81,6 +150,22 @@ size_t PVOutput::writeCallback_impl(char *ptr, size_t size, size_t nmemb)
     return size * nmemb;
 }
 
+CURLcode PVOutput::perform(void)
+{
+    clearBuffer();
+    m_curlres = curl_easy_perform(m_curl);
+    curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &m_http_status);
+
+    if (isverbose(3))
+    {
+        long connects = 0;
+        curl_easy_getinfo(m_curl, CURLINFO_NUM_CONNECTS, &connects);
+        std::cout << "PVOutput: " << (connects == 0 ? "reused connection" : "new connection") << std::endl;
+    }
+
+    return m_curlres;
+}
+
 CURLcode PVOutput::downloadURL(std::string URL)
 {
     m_curlres = CURLE_FAILED_INIT;
@@ -89,12 +174,12 @@ CURLcode PVOutput::downloadURL(std::string URL)
     if (m_curl)
     {
         curl_easy_setopt(m_curl, CURLOPT_URL, URL.c_str());
+        curl_easy_setopt(m_curl, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(m_curl, CURLOPT_HTTPHEADER, m_http_header);
         curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, m_timeout);
         curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, PVOutput::writeCallback);
         curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
-        clearBuffer();
-        m_curlres = curl_easy_perform(m_curl);
-        curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &m_http_status);
+        perform();
     }
 
     return m_curlres;
@@ -114,9 +199,7 @@ CURLcode PVOutput::downloadURL(std::string URL, std::string data)
         curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, m_timeout);
         curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, PVOutput::writeCallback);
         curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
-        clearBuffer();
-        m_curlres = curl_easy_perform(m_curl);
-        curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &m_http_status);
+        perform();
     }
 
     return m_curlres;
@@ -94,10 +94,15 @@ private:
     std::string m_buffer;
     curl_slist *m_http_header;
     long m_http_status;
+    static CURLSH* s_share;             // Shared TLS sessions and DNS cache, see global_init()
+    static thread_local CURL* t_curl;   // Handle of the calling thread
 
 public:
     PVOutput(unsigned int SID, std::string APIkey, unsigned int timeout);
     ~PVOutput();
+    static bool global_init(void);
+    static void global_cleanup(void);
+    static void thread_cleanup(void);
     CURLcode downloadURL(std::string URL);
     CURLcode downloadURL(std::string URL, std::string data);
     CURLcode getSystemData(void);
@@ -116,12 +121,14 @@ public:
     bool isSupporter() const { return (m_Donations > 0); }
     int batch_statuslimit() const { return m_Donations == 0 ? 30 : 100; }
     int batch_datelimit() const { return m_Donations == 0 ? 14 : 90; }
-    int batch_ratelimit() const { return m_Donations == 0 ? 60 : 100; }
+    int batch_ratelimit() const { return m_Donations == 0 ? 60 : 300; }
     CURLcode addBatchStatus(std::string data, std::string &response);
 
 private:
     static void writeCallback(char *ptr, size_t size, size_t nmemb, void *stream);
     size_t writeCallback_impl(char *ptr, size_t size, size_t nmemb);
+    CURLcode perform(void);
+    static CURL* handle(void);
     bool isverbose(int level) { return !quiet && (verbose >= level); }
 };
 
@@ -0,0 +1,373 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2024, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#include "UploadScheduler.h"
+#include "CommonServiceCode.h"
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <signal.h>
+#endif
+
+void TokenBucket::setRate(unsigned int perHour)
+{
+    m_rate = perHour;
+    m_tokens = std::min(m_tokens, m_rate);
+}
+
+bool TokenBucket::take(time_t now)
+{
+    // Refill
+    if (m_last != 0)
+        m_tokens = std::min(m_rate, m_tokens + m_rate * (now - m_last) / 3600);
+    m_last = now;
+
+    if (m_tokens < 1)
+        return false;
+
+    m_tokens -= 1;
+    return true;
+}
+
+UploadScheduler::UploadScheduler(const std::map<SMASerial, PVOSystemID> &systems, const std::string &apikey) : m_apikey(apikey)
+{
+    m_pending = 0;
+    m_stop = false;
+
+    for (const auto &pvo : systems)
+    {
+        System sys;
+        sys.Serial = pvo.first;
+        sys.SID = pvo.second;
+        sys.nextStatusCheck = 0;
+        sys.datelimit = 0;
+        sys.statuslimit = 0;
+        sys.backlog = 0;
+        sys.expired = 0;
+        sys.expiredLogged = 0;
+        sys.ratelimit = 60;
+        m_systems.push_back(sys);
+    }
+
+    const size_t workers = std::min<size_t>(m_systems.size(), PVO_UPLOAD_WORKERS);
+    for (size_t i = 0; i < workers; i++)
+        m_workers.push_back(std::thread(&UploadScheduler::worker, this));
+}
+
+UploadScheduler::~UploadScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+
+    for (auto &t : m_workers)
+        t.join();
+}
+
+// Config key of a system: <key>_<SID>
+static std::string system_key(const char *key, PVOSystemID SID)
+{
+    return std::string(key) + "_" + std::to_string(SID);
+}
+
+// Read the state of the last run, needed after a (re)connect only
+void UploadScheduler::load(db_SQL_Base &db)
+{
+    for (auto &sys : m_systems)
+    {
+        time_t nextStatusCheck = 0;
+        int datelimit = 0, statuslimit = 0;
+        db.get_config(system_key(SQL_NEXTSTATUSCHECK, sys.SID), nextStatusCheck);
+        db.get_config(system_key(SQL_BATCH_DATELIMIT, sys.SID), datelimit);
+        db.get_config(system_key(SQL_BATCH_STATUSLIMIT, sys.SID), statuslimit);
+
+        if (sys.nextStatusCheck == 0) sys.nextStatusCheck = nextStatusCheck;
+        if (sys.datelimit == 0) sys.datelimit = datelimit;
+        if (sys.statuslimit == 0) sys.statuslimit = statuslimit;
+    }
+}
+
+int UploadScheduler::run(db_SQL_Base &db)
+{
+    const time_t timeBetweenChecks = 2 * 60 * 60;   // every 2 hours
+    int rc_db = db.SQL_OK;
+    time_t now = time(nullptr);
+
+    // Refresh the system data (batch and rate limits) of the systems that are due
+    for (auto &sys : m_systems)
+    {
+        sys.statusOK = false;
+        if (((sys.nextStatusCheck - now) < 0) && sys.bucket.take(now))
+            submit([this, &sys]() { checkStatus(sys); });
+    }
+    wait();
+
+    int datelimit = 0;
+    bool refreshed = false;
+    for (auto &sys : m_systems)
+    {
+        if (sys.statusOK)
+        {
+            sys.nextStatusCheck = now + timeBetweenChecks;
+            sys.bucket.setRate(sys.ratelimit);
+            db.set_config(system_key(SQL_BATCH_DATELIMIT, sys.SID), std::to_string(sys.datelimit));
+            db.set_config(system_key(SQL_BATCH_STATUSLIMIT, sys.SID), std::to_string(sys.statuslimit));
+            db.set_config(system_key(SQL_NEXTSTATUSCHECK, sys.SID), std::to_string(sys.nextStatusCheck));
+            refreshed = true;
+
+            if (!sys.teamMember)
+            {
+                Log(sys.systemName + " is not yet member of SBFspot Team. Consider joining at http://pvoutput.org/listteam.jsp?tid=613", LOG_WARNING_);
+            }
+        }
+
+        // Limits of a system without donations, until its data is known
+        if (sys.datelimit == 0) sys.datelimit = 14;
+        if (sys.statuslimit == 0) sys.statuslimit = 30;
+        datelimit = std::max(datelimit, sys.datelimit);
+    }
+
+    // SBFspot stages the DayData of the last Batch_DateLimit days for all systems
+    if (refreshed)
+        db.set_config(SQL_BATCH_DATELIMIT, std::to_string(datelimit));
+
+    // A system with more than one batch waiting gets back-to-back batches (catch-up)
+    // until its backlog is gone, a batch fails or flags nothing, or its request quota is used
+    for (auto &sys : m_systems)
+        sys.uploaded = true;
+
+    for (int pass = 0; !bStopping; pass++)
+    {
+        // Largest backlog first
+        Log("Retrieving new datapoints from DB...", ERRLEVEL::LOG_DEBUG_);
+        std::vector<System *> queue;
+        for (auto &sys : m_systems)
+        {
+            if (!sys.uploaded)
+                continue;
+
+            const int previous = sys.backlog;
+            if ((rc_db = db.batch_get_backlog(sys.Serial, sys.datelimit, sys.backlog, sys.expired)) != db.SQL_OK)
+                return rc_db;
+
+            if (pass == 0)
+            {
+                // Rows older than batch_datelimit are refused by PVOutput
+                if (sys.expired > sys.expiredLogged)
+                    Log(std::to_string(sys.expired - sys.expiredLogged) + " datapoints of system " + std::to_string(sys.SID) + " are older than " + std::to_string(sys.datelimit) + " days and can't be uploaded anymore", LOG_WARNING_);
+                sys.expiredLogged = sys.expired;
+
+                sys.catchup = sys.backlog > sys.statuslimit;
+                if (sys.catchup)
+                    Log("Catching up system " + std::to_string(sys.SID) + ": " + std::to_string(sys.backlog) + " datapoints waiting", LOG_INFO_);
+            }
+            else if (sys.catchup && (sys.backlog == 0))
+                Log("System " + std::to_string(sys.SID) + " caught up", LOG_INFO_);
+            else if (sys.catchup && (sys.backlog >= previous))
+            {
+                // Don't spend the request quota on the same batch again
+                Log("Catch-up of system " + std::to_string(sys.SID) + " made no progress, " + std::to_string(sys.backlog) + " datapoints left until the next run", LOG_WARNING_);
+                sys.catchup = false;
+            }
+            else if (sys.catchup)
+            {
+                // ETA when the request quota is the limiting factor
+                const int batches = (sys.backlog + sys.statuslimit - 1) / sys.statuslimit;
+                Log("Catching up system " + std::to_string(sys.SID) + ": " + std::to_string(sys.backlog) + " datapoints left, ETA " + std::to_string(batches * 60 / sys.ratelimit) + " minutes", LOG_INFO_);
+            }
+
+            sys.uploaded = false;
+            if ((sys.backlog > 0) && ((pass == 0) || sys.catchup))
+                queue.push_back(&sys);
+        }
+
+        if (queue.empty())
+            break;
+
+        std::stable_sort(queue.begin(), queue.end(), [](const System *a, const System *b) { return a->backlog > b->backlog; });
+
+        now = time(nullptr);
+        for (auto sys : queue)
+        {
+            sys->data.clear();
+            if (!sys->bucket.take(now))
+            {
+                Log("Request quota of system " + std::to_string(sys->SID) + " reached, " + std::to_string(sys->backlog) + " datapoints postponed", LOG_WARNING_);
+                continue;
+            }
+
+            if ((rc_db = db.batch_get_archdaydata(sys->data, sys->Serial, sys->datelimit, sys->statuslimit, sys->datapoints)) != db.SQL_OK)
+                break;
+
+            if (!sys->data.empty())
+                submit([this, sys]() { upload(*sys); });
+        }
+        wait();
+
+        for (auto sys : queue)
+        {
+            if (sys->data.empty())
+                continue;
+
+            std::stringstream msg;
+
+            if (sys->datapoints == 1)
+                msg << "Uploading datapoint: " << sys->data;
+            else
+            {
+                if (VERBOSE_HIGH)
+                    msg << "Uploading " << sys->datapoints << " datapoints " << sys->data;
+                else
+                {
+                    size_t pos = sys->data.find_first_of(";");
+                    if (pos == std::string::npos) pos = sys->data.length();
+                    msg << "Uploading " << sys->datapoints << " datapoints, starting with " << sys->data.substr(0, pos);
+                }
+            }
+
+            if (sys->rc_curl == CURLE_OK)
+            {
+                if (sys->http_status == PVOutput::HTTP_OK)
+                {
+                    msg << " => OK (200)";
+                    Log(msg.str(), LOG_INFO_);
+                    int flagged = 0;
+                    if (db.batch_set_pvoflag(sys->response, sys->Serial, flagged) != db.SQL_OK)
+                        Log("batch_set_pvoflag() returned " + db.errortext(), LOG_ERROR_);
+                    else if (flagged == 0)
+                        Log("None of the datapoints of system " + std::to_string(sys->SID) + " were accepted: " + sys->response, LOG_WARNING_);
+                    else
+                        sys->uploaded = true;
+                }
+                else
+                {
+                    msg << " " << sys->response;
+                    Log(msg.str(), LOG_ERROR_);
+                }
+            }
+            else
+                Log("addBatchStatus() returned " + sys->response, LOG_ERROR_);
+
+            sys->data.clear();
+        }
+
+        if (rc_db != db.SQL_OK)
+            break;
+    }
+
+    return rc_db;
+}
+
+// Runs in a worker thread
+void UploadScheduler::checkStatus(System &sys)
+{
+    PVOutput PVO(sys.SID, m_apikey, 30);
+    PVO.getSystemData();
+
+    if ((PVO.errcode() == CURLE_OK) && (PVO.HTTP_status() == PVOutput::HTTP_OK))
+    {
+        sys.statusOK = true;
+        sys.systemName = PVO.SystemName();
+        sys.teamMember = PVO.isTeamMember();
+        sys.datelimit = PVO.batch_datelimit();
+        sys.statuslimit = PVO.batch_statuslimit();
+        sys.ratelimit = PVO.batch_ratelimit();
+    }
+}
+
+// Runs in a worker thread
+void UploadScheduler::upload(System &sys)
+{
+    PVOutput PVO(sys.SID, m_apikey, 30);
+    sys.rc_curl = PVO.addBatchStatus(sys.data, sys.response);
+    sys.http_status = PVO.HTTP_status();
+}
+
+void UploadScheduler::submit(std::function<void()> job)
+{
+    // Without workers (no systems), run in the caller's thread
+    if (m_workers.empty())
+    {
+        job();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+        m_pending++;
+    }
+    m_cv.notify_one();
+}
+
+// Wait until all submitted jobs are done
+void UploadScheduler::wait(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_pending == 0; });
+}
+
+void UploadScheduler::worker(void)
+{
+#if !defined(_WIN32)
+    // Leave signals (SIGTERM) to the main thread, they interrupt its wait for new data
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+#endif
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+        m_cv.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+        if (m_jobs.empty())
+            break;
+
+        std::function<void()> job = m_jobs.front();
+        m_jobs.pop_front();
+
+        lock.unlock();
+        job();
+        lock.lock();
+
+        if (--m_pending == 0)
+            m_done.notify_all();
+    }
+
+    lock.unlock();
+    PVOutput::thread_cleanup();
+}
@@ -0,0 +1,129 @@
+/************************************************************************************************
+    SBFspot - Yet another tool to read power production of SMA solar inverters
+    (c)2012-2024, SBF
+
+    Latest version found at https://github.com/SBFspot/SBFspot
+
+    License: Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+    http://creativecommons.org/licenses/by-nc-sa/3.0/
+
+    You are free:
+        to Share - to copy, distribute and transmit the work
+        to Remix - to adapt the work
+    Under the following conditions:
+    Attribution:
+        You must attribute the work in the manner specified by the author or licensor
+        (but not in any way that suggests that they endorse you or your use of the work).
+    Noncommercial:
+        You may not use this work for commercial purposes.
+    Share Alike:
+        If you alter, transform, or build upon this work, you may distribute the resulting work
+        only under the same or similar license to this one.
+
+DISCLAIMER:
+    A user of SBFspot software acknowledges that he or she is receiving this
+    software on an "as is" basis and the user is not relying on the accuracy
+    or functionality of the software for any purpose. The user further
+    acknowledges that any use of this software will be at his own risk
+    and the copyright owner accepts no responsibility whatsoever arising from
+    the use or application of the software.
+
+    SMA is a registered trademark of SMA Solar Technology AG
+
+************************************************************************************************/
+
+#pragma once
+
+#include "PVOutput.h"
+
+#if defined(USE_SQLITE)
+#include "../SBFspot/db_SQLite.h"
+#endif
+
+#if defined(USE_MYSQL)
+#include "../SBFspot/db_MySQL.h"
+#endif
+
+#include "Configuration.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define PVO_UPLOAD_WORKERS  4   // Max number of concurrent requests to pvoutput.org
+
+// Limits the requests of a PVOutput system to its hourly quota
+class TokenBucket
+{
+public:
+    TokenBucket() { m_rate = 60; m_tokens = 60; m_last = 0; }
+    void setRate(unsigned int perHour);
+    bool take(time_t now);
+
+private:
+    double m_rate;      // Tokens per hour, also the capacity of the bucket
+    double m_tokens;
+    time_t m_last;      // Time of last refill
+};
+
+// Uploads the staged datapoints of all PVOutput systems
+// The requests run concurrently on a small pool of worker threads,
+// the database is only accessed by the calling thread
+class UploadScheduler
+{
+public:
+    UploadScheduler(const std::map<SMASerial, PVOSystemID> &systems, const std::string &apikey);
+    ~UploadScheduler();
+
+    void load(db_SQL_Base &db);
+    int run(db_SQL_Base &db);
+
+private:
+    UploadScheduler(const UploadScheduler&) = delete;
+    UploadScheduler& operator=(const UploadScheduler&) = delete;
+
+    struct System
+    {
+        SMASerial Serial;
+        PVOSystemID SID;
+        TokenBucket bucket;
+        time_t nextStatusCheck;
+        int datelimit;
+        int statuslimit;
+        int backlog;        // Datapoints waiting to be uploaded
+        int expired;        // Datapoints older than datelimit, never uploaded
+        int expiredLogged;
+        bool catchup;       // More than one batch waiting at the start of the run
+        bool uploaded;      // Datapoints of the last batch were accepted
+
+        // Request, filled by the scheduler, and its result, filled by a worker
+        std::string data;
+        int datapoints;
+        CURLcode rc_curl;
+        long http_status;
+        std::string response;
+        bool statusOK;
+        std::string systemName;
+        bool teamMember;
+        int ratelimit;
+    };
+
+    void checkStatus(System &sys);
+    void upload(System &sys);
+    void submit(std::function<void()> job);
+    void wait(void);
+    void worker(void);
+
+    const std::string m_apikey;
+    std::vector<System> m_systems;
+
+    std::deque<std::function<void()>> m_jobs;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done;
+    unsigned int m_pending;
+    bool m_stop;
+};
@@ -109,7 +109,14 @@ int main(int argc, char *argv[])
 #if defined(USE_MYSQL)
     db.open(cfg.getSqlHostname(), cfg.getSqlUsername(), cfg.getSqlPassword(), cfg.getSqlDatabase(), cfg.getSqlPort());
 #elif defined(USE_SQLITE)
-    db.open(cfg.getSqlDatabase());
+    SQLPROFILE profile;
+    if (!db_SQL_Base::parse_profile(cfg.getSqlProfile(), profile))
+    {
+        std::clog << "Invalid SQL_Profile '" << cfg.getSqlProfile() << "' (default|flash|durable)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    db.open(cfg.getSqlDatabase(), true);
 #endif
     if (!db.isopen())
     {